@@ -44,8 +44,12 @@
 */
 
 #include "NetUMP.h"
+#include "NetUMP_MetricsExport.h"
+#include "NetUMP_Recorder.h"
+#include "NetUMP_StateTracker.h"
 #include "SystemSleep.h"
 #include <stdio.h>
+#include <thread>
 
 // Session status
 #define SESSION_CLOSED			0	// No action
@@ -53,13 +57,176 @@
 #define SESSION_INVITE			2	// Sending invitation to remote partner
 #define SESSION_WAIT_INVITE		4	// Wait to be invited by remote station
 #define SESSION_OPENED			8	// Session is opened, just generate background traffic now
+#define SESSION_CLOSING			16	// BYE sent by CloseSessionAsync, waiting for BYE REPLY
 
-//! Size of UMP messages in words for each possible MT
-static unsigned int UMPSize [16] = {1, 1, 1, 2, 2, 4, 1, 1, 2, 2, 2, 3, 3, 4, 4, 4};
+//! Delay between two BYE sent while closing a session, and maximum number of BYE sent
+#define BYE_RETRY_DELAY		100
+#define BYE_MAX_ATTEMPTS	3
 
-//! Maximum number of milliseconds allowed between two incoming messages before connection is closed automatically
+//! State resync : no channel in progress, and free voice lane slots needed to start a channel
+//! (worst case of one MIDI 1.0 channel : bank and program, 118 controllers, 32 RPN / NRPN sequences and null RPN, pitch bend, pressure, 128 notes)
+#define NETUMP_RESYNC_IDLE			0xFFFFFFFF
+#define NETUMP_RESYNC_FREE_SLOTS	400
+
+//! Transmit lane for each possible MT
+static const unsigned char TxLane [16] = {TX_LANE_VOICE, TX_LANE_REALTIME, TX_LANE_VOICE, TX_LANE_BULK,
+										  TX_LANE_VOICE, TX_LANE_BULK, TX_LANE_BULK, TX_LANE_BULK,
+										  TX_LANE_BULK, TX_LANE_BULK, TX_LANE_BULK, TX_LANE_BULK,
+										  TX_LANE_BULK, TX_LANE_BULK, TX_LANE_BULK, TX_LANE_BULK};
+
+//! Maximum number of words in the payload of a UMP Data command
+#define MAX_UMP_COMMAND_PAYLOAD		64
+
+//! Control changes merged by transmit coalescing (bit N : CC N). Bank select, data entry, LSB of 0 and 6,
+//! switches (64 to 69), portamento control (84), velocity prefix (88), (N)RPN and mode messages are never merged
+static const uint32_t CoalescedControllers [4] = {0xFFFFFFBE, 0xFFFFFFBE, 0xFEEFFFC0, 0x00000000};
+
+//! Default maximum number of milliseconds allowed between two incoming messages before connection is closed automatically
 #define TIMEOUT_RESET		30000
 
+//! Default invitation retry policy : one invitation per second, with jitter
+#define INVITE_RETRY_INITIAL_DELAY	1000
+#define INVITE_RETRY_MAX_DELAY		1000
+#define INVITE_RETRY_BACKOFF		200
+#define INVITE_RETRY_JITTER			10
+
+//! Default keepalive parameters
+#define PING_IDLE_INTERVAL		10000
+#define PING_SUSPECT_INTERVAL	1000
+#define PING_MAX_MISSED			3
+
+//! Returns histogram bucket for a value (log2 scale)
+static unsigned int HistogramBucket (unsigned int Value)
+{
+	unsigned int Bucket = 0;
+
+	while ((Value != 0) && (Bucket < NETUMP_HISTOGRAM_BUCKETS-1))
+	{
+		Value >>= 1;
+		Bucket++;
+	}
+	return Bucket;
+}  // HistogramBucket
+//---------------------------------------------------------------------------
+
+//! Returns the coalescing key of a message (first word without the value), 0 if the message is never merged
+static uint32_t GetCoalesceKey (uint32_t Word)
+{
+	unsigned int MT;
+	unsigned int Index;
+
+	MT = Word>>28;
+	if ((MT != 2) && (MT != 4)) return 0;
+
+	switch ((Word>>20)&0x0F)
+	{
+		case 0xB :		// Control change
+			Index = (Word>>8)&0x7F;
+			if (CoalescedControllers[Index>>5]&(1u<<(Index&0x1F)))
+				return Word&0xFFFF7F00;
+			return 0;
+		case 0xD :		// Channel pressure
+		case 0xE :		// Pitch bend
+			return Word&0xFFFF0000;
+		case 0x2 :		// Registered / assignable controller (MIDI 2.0)
+		case 0x3 :
+			if (MT == 4) return Word&0xFFFF7F7F;
+			return 0;
+		default :
+			return 0;
+	}
+}  // GetCoalesceKey
+//---------------------------------------------------------------------------
+
+//! Entry of the coalescing table for a key
+static unsigned int CoalesceHash (uint32_t Key)
+{
+	return ((Key*2654435761u)>>24)&(NETUMP_COALESCE_SLOTS-1);
+}  // CoalesceHash
+//---------------------------------------------------------------------------
+
+//! Reset transmit queue. Shall not be called while producers or consumer are using the queue
+static void ResetTxQueue (TNetUMPTxQueue* Queue)
+{
+	for (unsigned int SlotIndex=0; SlotIndex<UMP_TX_QUEUE_SIZE; SlotIndex++)
+		Queue->Slots[SlotIndex].Sequence.store (SlotIndex, std::memory_order_relaxed);
+	Queue->EnqueuePos.store (0, std::memory_order_relaxed);
+	Queue->DequeuePos = 0;
+}  // ResetTxQueue
+//---------------------------------------------------------------------------
+
+//! Add a message in transmit queue (any thread). Timestamp is the MT=0 word sent before the message (0 : none)
+//! Each producer reserves a slot by advancing EnqueuePos, then publishes the slot through its sequence number
+//! \return false if queue is full
+static bool PushTxMessage (TNetUMPTxQueue* Queue, uint32_t Timestamp, uint32_t* UMPData, unsigned int Size)
+{
+	TNetUMPTxSlot* Slot;
+	unsigned int Pos;
+	unsigned int Sequence;
+	int Diff;
+
+	Pos = Queue->EnqueuePos.load (std::memory_order_relaxed);
+	while (true)
+	{
+		Slot = &Queue->Slots[Pos&(UMP_TX_QUEUE_SIZE-1)];
+		Sequence = Slot->Sequence.load (std::memory_order_acquire);
+		Diff = (int)(Sequence-Pos);
+		if (Diff == 0)
+		{  // Slot is free : try to reserve it (Pos is reloaded if another producer was faster)
+			if (Queue->EnqueuePos.compare_exchange_weak (Pos, Pos+1, std::memory_order_relaxed))
+				break;
+		}
+		else if (Diff < 0)
+			return false;		// Slot has not been read yet by consumer : queue is full
+		else
+			Pos = Queue->EnqueuePos.load (std::memory_order_relaxed);
+	}
+
+	Slot->Size = 0;
+	if (Timestamp != 0)
+		Slot->UMP[Slot->Size++] = Timestamp;
+	for (unsigned int WordCounter=0; WordCounter<Size; WordCounter++)
+		Slot->UMP[Slot->Size++] = UMPData[WordCounter];
+
+	// Give the slot to the consumer
+	Slot->Sequence.store (Pos+1, std::memory_order_release);
+	return true;
+}  // PushTxMessage
+//---------------------------------------------------------------------------
+
+//! Returns the oldest message of transmit queue without removing it (realtime thread only)
+//! \return 0 if queue is empty (or if the oldest message is still being written by its producer)
+static TNetUMPTxSlot* PeekTxMessage (TNetUMPTxQueue* Queue)
+{
+	TNetUMPTxSlot* Slot;
+
+	Slot = &Queue->Slots[Queue->DequeuePos&(UMP_TX_QUEUE_SIZE-1)];
+	if (Slot->Sequence.load (std::memory_order_acquire) != Queue->DequeuePos+1)
+		return 0;
+	return Slot;
+}  // PeekTxMessage
+//---------------------------------------------------------------------------
+
+//! Removes the message returned by PeekTxMessage (realtime thread only)
+static void PopTxMessage (TNetUMPTxQueue* Queue)
+{
+	TNetUMPTxSlot* Slot;
+
+	Slot = &Queue->Slots[Queue->DequeuePos&(UMP_TX_QUEUE_SIZE-1)];
+	// Slot becomes free for the producer which will use it on next turn of the ring
+	Slot->Sequence.store (Queue->DequeuePos+UMP_TX_QUEUE_SIZE, std::memory_order_release);
+	Queue->DequeuePos++;
+}  // PopTxMessage
+//---------------------------------------------------------------------------
+
+//! JR Timestamp / Delta Clockstamp sent by the calling thread, waiting for the message it applies to
+static thread_local CNetUMPHandler* TimestampHandler = 0;
+static thread_local uint32_t PendingTimestamp = 0;
+
+//! Handler currently processed by RunSession on the calling thread (0 outside RunSession)
+//! Allows a callback to reconfigure its own handler without waiting for itself
+static thread_local CNetUMPHandler* RunningHandler = 0;
+
 CNetUMPHandler::CNetUMPHandler (TUMPDataCallback CallbackFunc, void* UserInstance)
 {
 	UMPSocket = INVALID_SOCKET;
@@ -69,55 +236,132 @@ CNetUMPHandler::CNetUMPHandler (TUMPDataCallback CallbackFunc, void* UserInstanc
 	RemoteUDPPort = 0;
 	LocalUDPPort = 0;
 	SocketLocked=true;
+	ConfigLocks=0;
+	RunEpoch=0;
 	strcpy((char*)&this->EndpointName[0], "NetUMP");
 	strcpy((char*)&this->ProductInstanceID[0], "DefaultID");
 
-	SessionPartnerIP=0;
-	SessionPartnerPort=0;
+	SetSessionPartner (0, 0);
+	PrepareSessionTemplates();
+	UseConnectedSocket=false;
+	SocketConnected=false;
+	KernelFilterMode=KERNEL_FILTER_NONE;
 	IsInitiatorNode=true;
-	TimeOutRemote=TIMEOUT_RESET;
+	ReinvitationPolicy=REINVITATION_FROM_PARTNER;
+	Keepalive.IdleInterval = PING_IDLE_INTERVAL;
+	Keepalive.SuspectInterval = PING_SUSPECT_INTERVAL;
+	Keepalive.MaxMissedPings = PING_MAX_MISSED;
+	Keepalive.SessionTimeout = TIMEOUT_RESET;
+	TimeOutRemote=Keepalive.SessionTimeout;
 	InviteCount=0;
+	CloseRequested=false;
+	BYEAttempts=0;
+	CloseCallback=0;
+	CloseInstance=0;
+	RetryPolicy.InitialDelay = INVITE_RETRY_INITIAL_DELAY;
+	RetryPolicy.MaxDelay = INVITE_RETRY_MAX_DELAY;
+	RetryPolicy.BackoffPercent = INVITE_RETRY_BACKOFF;
+	RetryPolicy.JitterPercent = INVITE_RETRY_JITTER;
+	RetryPolicy.MaxAttempts = 0;
+	InviteDelay = RetryPolicy.InitialDelay;
+	JitterRandom = (uint32_t)(uintptr_t)this | 1;
+	GiveUpCallback = 0;
 
 	ConnectionLost = false;
 	PeerClosedSession = false;
 
-	LastReceivedUMPCounter = 0;
 	PINGDelayCounter = 0;
 	PINGIdCounter = 0;
+	PINGsOutstanding = 0;
+	LossSuspected = false;
+	PartnerJoined = false;
 
 	ResetFECMemory();
 	SelectErrorCorrectionMode (ERROR_CORRECTION_FEC);
 	//SelectErrorCorrectionMode (ERROR_CORRECTION_NONE);
 
 	// Reset FIFO with host
-	UMP_FIFO_TO_NET.ReadPtr = 0;
-	UMP_FIFO_TO_NET.WritePtr = 0;
-	UMP_FIFO_FROM_NET.ReadPtr = 0;
-	UMP_FIFO_FROM_NET.WritePtr = 0;
+	for (unsigned int Lane=0; Lane<NUM_TX_LANES; Lane++)
+		ResetTxQueue (&UMP_TX_QUEUE[Lane]);
+	TxBulkReservedWords = 0;
+	memset (&RateLimit, 0, sizeof(RateLimit));
+	WordTokens = 0;
+	DatagramTokens = 0;
+	TxQueueRejected = 0;
+	CoalesceThreshold = 0;
+	CoalesceScanPos = 0;
+	memset (&CoalesceTable[0], 0, sizeof(CoalesceTable));
+	UseReceiveQueue = false;
+	RxQueueWritePtr = 0;
+	RxQueueReadPtr = 0;
+	RxQueueSignal = false;
+	RxEventHandle = -1;
 
 	// Reset timer
 	TimeCounter=0;
+	LastPartnerRxTime=0;
 	TimerRunning=false;
 	TimerEvent=false;
 	EventTime=0;
 
+	memset (&Stats, 0, sizeof(TNetUMPSessionStats));
+	SessionPartnerIP=0;
+	SessionPartnerPort=0;
+	StatsSnapshotSequence=0;
+	PublishStatsSnapshot();
+	MetricsSlot=0;
+	Recorder=0;
+	RecorderSource=0;
+	StateTracker=0;
+	ResyncPosition=NETUMP_RESYNC_IDLE;
+	ResyncRequested=false;
+	FilterActive=false;
+	FilterNumRules=0;
+	memset (&FilterCounters[0], 0, sizeof(FilterCounters));
+	NoteCleanup=false;
+	memset (&RxActiveNotes[0][0][0], 0, sizeof(RxActiveNotes));
+	memset (&RxMIDI2Channels[0], 0, sizeof(RxMIDI2Channels));
+	for (unsigned int Group=0; Group<16; Group++)
+	{
+		TxMIDI2Channels[Group] = 0;
+		for (unsigned int Channel=0; Channel<16; Channel++)
+			for (unsigned int Word=0; Word<4; Word++)
+				TxActiveNotes[Group][Channel][Word] = 0;
+	}
+	MetricsPublishInterval=100;
+	MetricsPublishCounter=0;
+
 	UMPCallback=CallbackFunc;
 	ClientInstance=UserInstance;
+	ConnectionCallback=0;
+	DisconnectCallback=0;
+	PacketShim=0;
 }  // CNetUMPHandler::CNetUMPHandler
 // -----------------------------------------------------
 
 CNetUMPHandler::~CNetUMPHandler (void)
 {
 	CloseSession();
-	CloseSockets();
+	CloseSockets();		// Realtime thread stays locked out
+#if defined (__TARGET_LINUX__)
+	if (RxEventHandle >= 0)
+		close (RxEventHandle);
+#endif
 }  // CNetUMPHandler::~CNetUMPHandler
 // -----------------------------------------------------
 
 void CNetUMPHandler::CloseSockets(void)
 {
+	// Realtime thread must not use the socket anymore before we close it
+	// It stays out of the handler until a new socket is ready (see InitiateSession)
+	LockRealtimeThread();
+	SocketLocked = true;
+
 	// Close the UDP sockets
 	if (UMPSocket!=INVALID_SOCKET)
 		CloseSocket(&UMPSocket);
+	SocketConnected=false;
+	UnlockRealtimeThread();
 }  // CNetUMPHandler::CloseSockets
 //---------------------------------------------------------------------------
 
@@ -125,7 +369,10 @@ void CNetUMPHandler::SetEndpointName (char* Name)
 {
 	if (strlen(Name) == 0) return;
 	if (strlen(Name) >= MAX_UMP_ENDPOINT_NAME_LEN-1) return;
+	LockRealtimeThread();		// Templates are used by realtime thread
 	strcpy ((char*)&this->EndpointName[0], Name);
+	PrepareSessionTemplates();
+	UnlockRealtimeThread();
 }  // CNetUMPHandler::SetEndpointName
 //---------------------------------------------------------------------------
 
@@ -133,7 +380,10 @@ void CNetUMPHandler::SetProductInstanceID(char* PIID)
 {
 	if (strlen(PIID) == 0) return;
 	if (strlen(PIID) >= MAX_UMP_PRODUCT_INSTANCE_ID_LEN) return;
+	LockRealtimeThread();
 	strcpy((char*)&this->ProductInstanceID[0], PIID);
+	PrepareSessionTemplates();
+	UnlockRealtimeThread();
 }  // CNetUMPHandler::SetProductInstanceID
 //---------------------------------------------------------------------------
 
@@ -144,7 +394,10 @@ int CNetUMPHandler::InitiateSession(unsigned int DestIP,
 {
 	bool SocketOK;
 
+	LockRealtimeThread();
+
 	// Close the UDP socket, just in case it was still opened...
+	// Realtime thread stays locked out until the session is fully initialized
 	CloseSockets();
 
 	RemoteIP=DestIP;
@@ -152,14 +405,22 @@ int CNetUMPHandler::InitiateSession(unsigned int DestIP,
 	LocalUDPPort = LocalPort;
 
 	SocketOK=CreateUDPSocket (&UMPSocket, LocalPort, false);
-	if (SocketOK == false) return -1;
+	if (SocketOK == false)
+	{
+		UnlockRealtimeThread();
+		return -1;
+	}
+	AttachKernelFilter (false);
 
 	ConnectionLost = false;
 	InviteCount=0;
-	TimeOutRemote=TIMEOUT_RESET;
+	TimeOutRemote=Keepalive.SessionTimeout;
 	UMPSequenceCounter = 0;
 	PINGDelayCounter = 0;
+	PINGsOutstanding = 0;
+	LossSuspected = false;
 	TimerRunning = false;
+	PrepareSessionTemplates();
 
 	IsInitiatorNode=IsInitiator;
 	if (IsInitiator==false)
@@ -169,11 +430,14 @@ int CNetUMPHandler::InitiateSession(unsigned int DestIP,
 	else
 	{ // Initiate session by inviting remote node
 		SessionState=SESSION_INVITE;
-        SessionPartnerIP = RemoteIP;
-		SessionPartnerPort = RemoteUDPPort;
+		SetSessionPartner (RemoteIP, RemoteUDPPort);
 	}
-	SocketLocked=false;		// Must be last instruction after session initialization
-	PrepareTimerEvent(1);	// This will produce invitation immediately
+	JitterRandom ^= ((uint32_t)LocalPort<<16) | DestPort;
+	if (JitterRandom == 0) JitterRandom = 1;
+	if (IsInitiator)
+		StartInvitations(1);	// This will produce invitation immediately
+	SocketLocked = false;		// Must be last instruction after session initialization
+	UnlockRealtimeThread();
 
 	return 0;
 }  // CNetUMPHandler::InitiateSession
@@ -181,50 +445,137 @@ int CNetUMPHandler::InitiateSession(unsigned int DestIP,
 
 void CNetUMPHandler::CloseSession (void)
 {
-	if (SessionState==SESSION_OPENED)
+	LockRealtimeThread();
+	if (SessionState!=SESSION_OPENED)
 	{
-		SessionState=SESSION_CLOSED;
-		SendBYECommand(BYE_USER_TERMINATED, SessionPartnerIP, SessionPartnerPort);
-		SystemSleepMillis(50);		// Give time to send the message before closing the socket
-
-		if (DisconnectCallback != 0)
-			DisconnectCallback();
+		UnlockRealtimeThread();
+		return;
 	}
+
+	SessionState=SESSION_CLOSED;
+	SendBYECommand(BYE_USER_TERMINATED, SessionPartnerIP, SessionPartnerPort);
+	LockSocketToPartner(false);
+	RecordSessionEvent (NETUMP_EVENT_SESSION_CLOSED);
+	ReleaseRxNotes();			// Given to the application from the calling thread, realtime thread is locked out
+	UnlockRealtimeThread();		// Realtime thread can process the closed session again
+	SystemSleepMillis(50);		// Give time to send the message before closing the socket
+
+	if (DisconnectCallback != 0)
+		DisconnectCallback();
 }  // CNetUMPHandler::CloseSession
 //---------------------------------------------------------------------------
 
+bool CNetUMPHandler::CloseSessionAsync (TNetUMPCloseCallback CallbackFunc, void* UserInstance)
+{
+	LockRealtimeThread();
+	// A close is already in progress : its callback must still be the one called when it completes
+	if ((CloseRequested.load(std::memory_order_relaxed)) || (SessionState == SESSION_CLOSING))
+	{
+		UnlockRealtimeThread();
+		return false;
+	}
+
+	CloseCallback = CallbackFunc;
+	CloseInstance = UserInstance;
+	CloseRequested.store(true, std::memory_order_release);
+	UnlockRealtimeThread();
+	return true;
+}  // CNetUMPHandler::CloseSessionAsync
+//---------------------------------------------------------------------------
+
+void CNetUMPHandler::CompleteClose (bool Acknowledged)
+{
+	LockSocketToPartner(false);
+	SessionState = SESSION_CLOSED;
+	TimerRunning = false;
+	TimerEvent = false;
+	RecordSessionEvent (NETUMP_EVENT_SESSION_CLOSED);
+
+	if (CloseCallback != 0)
+		CloseCallback (CloseInstance, Acknowledged);
+}  // CNetUMPHandler::CompleteClose
+//---------------------------------------------------------------------------
+
+void CNetUMPHandler::LockRealtimeThread (void)
+{
+	unsigned int Epoch;
+
+	// Called from a callback of this handler : realtime thread is the calling thread, RunSession is not running elsewhere
+	if (RunningHandler == this) return;
+
+	// One configuring thread at a time. The lock count keeps the realtime thread out until the last configurator leaves
+	ConfigMutex.lock();
+	ConfigLocks.fetch_add(1);
+
+	// Wait until RunSession call in progress (if any) is finished. Any call started after the
+	// increment above sees ConfigLocks and returns without touching the handler
+	Epoch = RunEpoch.load();
+	if (Epoch & 1)
+	{
+		while (RunEpoch.load() == Epoch)
+			std::this_thread::yield();
+	}
+}  // CNetUMPHandler::LockRealtimeThread
+//---------------------------------------------------------------------------
+
+void CNetUMPHandler::UnlockRealtimeThread (void)
+{
+	if (RunningHandler == this) return;
+
+	ConfigLocks.fetch_sub(1);
+	ConfigMutex.unlock();
+}  // CNetUMPHandler::UnlockRealtimeThread
+//---------------------------------------------------------------------------
+
 void CNetUMPHandler::RunSession (void)
 {
-#if defined (__TARGET_MAC__)
-	socklen_t fromlen;
-#endif
-#if defined (__TARGET_LINUX__)
-	socklen_t fromlen;
-#endif
-#if defined (__TARGET_WIN__)
-	int fromlen;
-#endif
+	// Odd epoch : handler is being processed by the realtime thread
+	RunEpoch.fetch_add(1);
+
+	// Do not process if communication layers are not ready or being reconfigured
+	if ((ConfigLocks.load() == 0) && (SocketLocked.load() == false))
+	{
+		RunningHandler = this;
+		ProcessSession();
+		PublishStatsSnapshot();
+		RunningHandler = 0;
+	}
+
+	RunEpoch.fetch_add(1);
+}  // CNetUMPHandler::RunSession
+//---------------------------------------------------------------------------
+
+void CNetUMPHandler::ProcessSession (void)
+{
 	int RecvSize;
 	sockaddr_in SenderData;
-	unsigned char ReceptionBuffer[1024];
-	bool InvitationAccepted;
+	unsigned char ReceptionBuffer[NETUMP_MAX_DATAGRAM_SIZE];
 	unsigned int UMPCommandSize;
-	uint32_t UMPCommand[65];		// Maximum length of UMP Command is 64 words + command header
-	sockaddr_in AdrEmit;
-	bool InvitationReceived;
-	bool BYEReceived;
-	bool PingReceived;
+	uint32_t UMPCommand[NETUMP_MAX_DATAGRAM_WORDS];		// Signature and UMP Data command, plus FEC copies of previous commands
+	unsigned int PingInterval;
+	bool FromPartner=false;
 	unsigned int SenderIP=0;
 	unsigned short SenderPort=0;
-	uint32_t Ping_ID=0;
 	TUMP_PING_PACKET_NO_SIGNATURE* PingPacket;
-	int PtrParse;
-	unsigned int PayloadSize;
-	int PeerEndpointNamePtr=0;
-	unsigned int PeerEndpointNameSize;
+	TNetUMPCommandDescriptor Commands[MAX_COMMANDS_PER_DATAGRAM];
+	int NumCommands;
+	int CommandIndex;
+	unsigned char* Command;
 
-	// Do not process if communication layers are not ready
-	if (SocketLocked) return;
+	TimeCounter++;
+
+	if (PacketShim)
+		PacketShim->Tick (UMPSocket);
+
+	if (MetricsSlot)
+	{
+		MetricsPublishCounter++;
+		if (MetricsPublishCounter >= MetricsPublishInterval)
+		{
+			MetricsPublishCounter = 0;
+			PublishMetrics();
+		}
+	}
 
 	// Check if timer elapsed
 	if (TimerRunning)
@@ -238,6 +589,26 @@ void CNetUMPHandler::RunSession (void)
 		}
 	}
 
+	// Session close requested by CloseSessionAsync
+	if (CloseRequested.exchange(false, std::memory_order_acquire))
+	{
+		if (SessionState == SESSION_OPENED)
+		{  // Socket stays locked to partner until BYE REPLY is received
+			SessionState = SESSION_CLOSING;
+			SendBYECommand(BYE_USER_TERMINATED, SessionPartnerIP, SessionPartnerPort);
+			BYEAttempts = 1;
+			PrepareTimerEvent(BYE_RETRY_DELAY);
+			ReleaseRxNotes();
+
+			if (DisconnectCallback != 0)
+				DisconnectCallback();
+		}
+		else if (SessionState != SESSION_CLOSING)
+		{
+			CompleteClose(false);
+		}
+	}
+
 	// If no resync from remote node after 2 minutes and we are session initiator, then try to invite again the remote device
 	if (SessionState == SESSION_OPENED)
 	{
@@ -247,9 +618,12 @@ void CNetUMPHandler::RunSession (void)
 		if (TimeOutRemote == 0)
 		{  // No messages received from remote partner after timeout
 			ConnectionLost = true;
+			Stats.ConnectionsLost++;
+			RecordSessionEvent (NETUMP_EVENT_CONNECTION_LOST);
 
 			// We send a BYE to inform remote partner that connection is now closed
 			SendBYECommand (BYE_TIMEOUT, SessionPartnerIP, SessionPartnerPort);
+			LockSocketToPartner(false);
 
 			if (IsInitiatorNode)
 			{
@@ -261,99 +635,101 @@ void CNetUMPHandler::RunSession (void)
 			{  // If we are not session initiator, just wait to be invited again
 				SessionState=SESSION_WAIT_INVITE;
 			}
+			ReleaseRxNotes();
 
 			if (DisconnectCallback != 0)
 				DisconnectCallback();
 		}
 	}
 
-	// Init state decoder
-	InvitationReceived = false;
-	BYEReceived = false;
-	InvitationAccepted = false;
-	PingReceived = false;
-
 	// Check if something has been received
 	if (DataAvail(UMPSocket, 0))
 	{
-		fromlen=sizeof(sockaddr_in);
-		RecvSize=(int)recvfrom(UMPSocket, (char*)&ReceptionBuffer, sizeof(ReceptionBuffer), 0, (sockaddr*)&SenderData, &fromlen);
+		RecvSize=ReceiveDatagram(&ReceptionBuffer[0], sizeof(ReceptionBuffer), &SenderData);
 
 		if (RecvSize>0)
 		{
-			// Check UMP header ("MIDI")
-			if ((ReceptionBuffer[0]=='M')&&(ReceptionBuffer[1]=='I')&&(ReceptionBuffer[2]=='D')&&(ReceptionBuffer[3]=='I'))
+			// The whole datagram is checked before any command is processed
+			NumCommands = ParseDatagram (&ReceptionBuffer[0], RecvSize, &Commands[0]);
+			if (NumCommands >= 0)
 			{
-				SenderIP=htonl(SenderData.sin_addr.s_addr);
-				SenderPort = htons (SenderData.sin_port);
+				if (SocketConnected)
+				{  // Kernel only delivers datagrams coming from the session partner
+					SenderIP = SessionPartnerIP;
+					SenderPort = SessionPartnerPort;
+					FromPartner = true;
+				}
+				else
+				{
+					SenderIP=htonl(SenderData.sin_addr.s_addr);
+					SenderPort = htons (SenderData.sin_port);
+					FromPartner = (SenderIP == SessionPartnerIP) && (SenderPort == SessionPartnerPort);
+				}
 
-				// Parse the received NetUMP packets (a single UDP packets can contain multiple NetUMP packets)
-				PtrParse = 4;		// Jump over MIDI signature
+				if ((SessionState == SESSION_OPENED) && (FromPartner))
+				{  // Any valid packet from partner proves it is alive
+					TimeOutRemote = Keepalive.SessionTimeout;
+					PINGsOutstanding = 0;
+					Stats.RxInterArrivalHistogram[HistogramBucket(TimeCounter-LastPartnerRxTime)]++;
+					LastPartnerRxTime = TimeCounter;
+				}
 
-				//printf ("New UDP packet size : %d\n", RecvSize);
-				while (PtrParse<RecvSize)
+				// Process NetUMP commands in the order they appear in the datagram
+				for (CommandIndex=0; CommandIndex<NumCommands; CommandIndex++)
 				{
-					PayloadSize = ReceptionBuffer[PtrParse+1];
-					PayloadSize*=4;		// Payload size is given in 32 bits words, turn it into byte
+					Command = &ReceptionBuffer[Commands[CommandIndex].Offset];
 
-					//printf ("Payload size : %d\n", PayloadSize);
-                    //printf ("PtrParse : %d\n", PtrParse);
+					// Partner has seen our INVITATION ACCEPTED : a later invitation means it has restarted
+					if ((FromPartner) && (Commands[CommandIndex].CommandCode != INVITATION_COMMAND))
+						PartnerJoined = true;
 
-					switch (ReceptionBuffer[PtrParse])
+					switch (Commands[CommandIndex].CommandCode)
 					{
 						case UMP_DATA_COMMAND :
-						// Check that message comes from the remote partner
-	#if defined (__TARGET_WIN__)
-							if (htonl(SenderData.sin_addr.S_un.S_addr) == SessionPartnerIP)
-	#endif
-	#if defined (__TARGET_MAC__)
-							if (htonl(SenderData.sin_addr.s_addr) == SessionPartnerIP)
-	#endif
-	#if defined (__TARGET_LINUX__)
-							if (htonl(SenderData.sin_addr.s_addr) == SessionPartnerIP)
-	#endif
+							// Check that message comes from the remote partner
+							if ((FromPartner) && (SessionState == SESSION_OPENED))
 							{
-								if (htons(SenderData.sin_port) == SessionPartnerPort)
-								{
-									if (SessionState == SESSION_OPENED)
-									{
-										TimeOutRemote = TIMEOUT_RESET;
-										ProcessIncomingUMP(&ReceptionBuffer[PtrParse]);
-									}
-								}
+								ProcessIncomingUMP(Command);
 							}
 							break;
 						case INVITATION_COMMAND :
-							InvitationReceived = true;
-							// Size is given in 32-bit words, convert it into bytes
-							PeerEndpointNameSize = ReceptionBuffer[PtrParse + 2] * 4;
-							PeerEndpointNamePtr = PtrParse + 4;
+							ProcessInvitation (Command, SenderIP, SenderPort);
 							break;
 						case BYE_COMMAND :
-							BYEReceived = true;
+							Stats.BYEReceived++;
+							ProcessBYE (SenderIP, SenderPort);
+							// Remaining commands are not related to a session anymore
+							CommandIndex = NumCommands;
 							break;
 						case INVITATION_ACCEPTED_COMMAND :
-							PeerEndpointNameSize = ReceptionBuffer[PtrParse + 2] * 4;
-							PeerEndpointNamePtr = PtrParse + 4;
-							InvitationAccepted = true;
+							ProcessInvitationAccepted (Command, SenderIP);
+							break;
+						case BYE_REPLY_COMMAND :
+							if ((FromPartner) && (SessionState == SESSION_CLOSING))
+								CompleteClose(true);
 							break;
 						case PING_COMMAND :
-							// TODO : receiving a PING from a remote station means it is alive
-							// So if the session is opened and *sender is the remote partner*, we reset timeout counter
-							PingReceived = true;
-							PingPacket = (TUMP_PING_PACKET_NO_SIGNATURE*)&ReceptionBuffer[PtrParse];
-							Ping_ID = htonl(PingPacket->ID);
+							Stats.PingsReceived++;
+							PingPacket = (TUMP_PING_PACKET_NO_SIGNATURE*)Command;
+							SendPINGReplyCommand (htonl(PingPacket->ID));
 							break;
 						case PING_REPLY_COMMAND :
-							// TODO : Reset timeout counter if we receive a PING Reply only with the packet ID matching the one we sent
-							if (SessionState == SESSION_OPENED)
-								TimeOutRemote = TIMEOUT_RESET;
+							// Timeout has already been reset for any packet from partner. A reply to our last PING also confirms the link after a loss
+							Stats.PingRepliesReceived++;
+							PingPacket = (TUMP_PING_PACKET_NO_SIGNATURE*)Command;
+							if ((FromPartner) && (htonl(PingPacket->ID) == PINGIdCounter))
+								LossSuspected = false;
 							break;
 						case SESSION_RESET_COMMAND :
+							// Notes are released on both sides
+							if ((FromPartner) && (SessionState == SESSION_OPENED))
+							{
+								ReleaseRxNotes();
+								SendHangingNoteOffs();
+							}
 							// TODO
 							// Reset sequence numbers
 							// Flush FEC buffers
-							// We should report the reste to application layer (send All Notes Off...)
 							break;
 						case SESSION_RESET_REPLY_COMMAND :
 							// TODO
@@ -366,71 +742,17 @@ void CNetUMPHandler::RunSession (void)
 							printf ("Hummmm...\n");
 #endif
 					}  // switch
-
-					PtrParse+=4;			    // Jump over command header (32 bits)
-					PtrParse+=PayloadSize;		// Jump to next NetUMP message in UDP packet
 				}  // Loop over all NetUMP commands
-			}  // MIDI signature found
+			}  // Valid datagram
+			else Stats.RxInvalidDatagrams++;
 		}  // Receives size > 0
 	}  // Packet received on socket
 
-	// TODO : should we move this processing inside the parsing loop ?
-	// In theory, there is no reason to receive multiple session packets or session packets mixed with UMP messages in the same UDP telegram
-	if (InvitationReceived)
-	{
-		// If we are a session listener AND session is not yet opened, send INVITATION ACCEPTED and open the session
-		if (IsInitiatorNode==false)
-		{  // Session listener
-			if (SessionState==SESSION_WAIT_INVITE)
-			{
-				TimeOutRemote = TIMEOUT_RESET;
-				SessionState = SESSION_OPENED;
-				this->SessionPartnerIP=SenderIP;
-				this->SessionPartnerPort = SenderPort;
-				SendInvitationAcceptedCommand ();
-				ResetFECMemory();
-
-				if (ConnectionCallback != 0)
-					ConnectionCallback((const char*)(ReceptionBuffer+PeerEndpointNamePtr), PeerEndpointNameSize);
-			}
-		}
-		else
-		{  // Session initiator : for now, we don't accept to be invited (TODO : we can acccept an invitation if it comes from the declared partner)
-			SendBYECommand (BYE_TOO_MANY_SESSIONS, SenderIP, SenderPort);
-		}
-	}
-
-	if (PingReceived)
+	// One wake up per call, whatever the number of messages stored
+	if (RxQueueSignal)
 	{
-		SendPINGReplyCommand (Ping_ID);
-	}
-
-	if (BYEReceived)
-	{
-		if ((SenderIP == SessionPartnerIP)&&(SenderPort == SessionPartnerPort))
-		{
-			SendBYEReplyCommand (SessionPartnerIP, SessionPartnerPort);
-			if (IsInitiatorNode == false)
-			{
-				SessionState = SESSION_WAIT_INVITE;
-				SessionPartnerIP = 0;
-				SessionPartnerPort = 0;
-			}
-			else
-			{
-				SessionState = SESSION_CLOSED;
-				// TODO : make an option to decide if session must close if a BYE is received or if it shall invite again the partner
-				RestartSessionInitiator ();		// This make the driver automatically invite again a partner which has sent a BYE
-			}
-			ConnectionLost = true;		// This will report information to user interface
-
-			if (DisconnectCallback != 0)
-				DisconnectCallback();
-		}
-		else
-		{
-			SendBYEReplyCommand (SenderIP, SenderPort);
-		}
+		RxQueueSignal = false;
+		SignalReceiveEvent();
 	}
 
 	// *** State machine manager ***
@@ -439,6 +761,14 @@ void CNetUMPHandler::RunSession (void)
 		return;
 	}
 
+	if (SessionState == SESSION_OPENED)
+	{
+		if (ResyncRequested.exchange (false))
+			ResyncPosition = 0;		// Restarts from first channel if a resync is already in progress
+		if (ResyncPosition != NETUMP_RESYNC_IDLE)
+			ContinueStateResync();
+	}
+
 	// We must call GenerateUMPCommand even if session is not opened in order to flush the FIFO
 	// Otherwise, all UMP data are sent in bursts when session opens...
 	UMPCommandSize = GenerateUMPCommand(&UMPCommand[0]);
@@ -448,21 +778,31 @@ void CNetUMPHandler::RunSession (void)
 		if (UMPCommandSize>0)
 		{
 			// Send message on network
-			memset (&AdrEmit, 0, sizeof(sockaddr_in));
-			AdrEmit.sin_family=AF_INET;
-			AdrEmit.sin_addr.s_addr=htonl(SessionPartnerIP);
-			AdrEmit.sin_port=htons(SessionPartnerPort);
-			sendto(UMPSocket, (const char*)&UMPCommand[0], UMPCommandSize*4, 0, (const sockaddr*)&AdrEmit, sizeof(sockaddr_in));
+			TransmitDatagram (&UMPCommand[0], UMPCommandSize*4, &PartnerAddress);
 		}
 
-		// Send PING message if nothing has been sent since more than 10 seconds
+		// Keepalive : no PING while partner sends anything. When partner is silent, PING every IdleInterval,
+		// or every SuspectInterval when previous PING is unanswered or packet loss has been detected
 		PINGDelayCounter++;
-		if (PINGDelayCounter>10000)
+		if ((PINGsOutstanding > 0) || (LossSuspected))
+			PingInterval = Keepalive.SuspectInterval;
+		else
+			PingInterval = Keepalive.IdleInterval;
+
+		if ((TimeCounter-LastPartnerRxTime >= PingInterval) && (PINGDelayCounter >= PingInterval))
 		{
-			PINGDelayCounter = 0;
-			PINGIdCounter++;
+			if (PINGsOutstanding >= Keepalive.MaxMissedPings)
+			{  // Partner does not answer anymore : connection lost will be processed on next call
+				TimeOutRemote = 0;
+			}
+			else
+			{
+				PINGDelayCounter = 0;
+				PINGIdCounter++;
+				PINGsOutstanding++;
 
-			SendPINGCommand (PINGIdCounter);
+				SendPINGCommand (PINGIdCounter);
+			}
 		}
 		return;
 	}
@@ -470,46 +810,58 @@ void CNetUMPHandler::RunSession (void)
 	// We are inviting remote node
 	if (SessionState==SESSION_INVITE)
 	{
-		if (InvitationAccepted)
-		{
-			SessionPartnerIP = SenderIP;		// TODO : what happens if we receive accidentally an INVITATION ACCEPTED from another device while we are inviting one ?
-			SessionState=SESSION_OPENED;
-			ResetFECMemory();
-
-			if (ConnectionCallback != 0)
-				ConnectionCallback((const char*)(ReceptionBuffer+PeerEndpointNamePtr), PeerEndpointNameSize);
-			return;
-		}
-
 		if (TimerRunning==false)
 		{
 			if (TimerEvent)
 			{  // Previous attempt has timed out
-				/*
-				if (InviteCount>12)
-				{  // No answer received from remote station after 12 attempts : stop invitation and go back to SESSION_INVITE_CONTROL
-					RestartSession();
-					return;
-				}
-				else
-				*/
-				{
-					this->SendInvitationCommand();
-					PrepareTimerEvent(1000);  // Wait one second before sending a new invitation
-					InviteCount++;
+				if ((RetryPolicy.MaxAttempts > 0) && (InviteCount >= RetryPolicy.MaxAttempts))
+				{  // No answer received from remote station : stop invitation
+					TimerEvent = false;
+					SessionState = SESSION_CLOSED;
+					if (GiveUpCallback != 0)
+						GiveUpCallback();
 					return;
 				}
+
+				this->SendInvitationCommand();
+				PrepareTimerEvent(JitteredDelay(InviteDelay));  // Wait before sending a new invitation
+				InviteCount++;
+
+				// Next retry will wait longer
+				InviteDelay = (unsigned int)(((uint64_t)InviteDelay*RetryPolicy.BackoffPercent)/100);
+				if (InviteDelay > RetryPolicy.MaxDelay)
+					InviteDelay = RetryPolicy.MaxDelay;
+				if (InviteDelay == 0)
+					InviteDelay = 1;
+				return;
 			}
 		}
 		//else {  /* We wait for an event : nothing to do */ }
 		return;
 	}
 
+	// We are closing the session : repeat BYE until partner answers
+	if (SessionState==SESSION_CLOSING)
+	{
+		if ((TimerRunning==false) && (TimerEvent))
+		{
+			if (BYEAttempts >= BYE_MAX_ATTEMPTS)
+			{  // Partner does not answer : session is considered closed anyway
+				CompleteClose(false);
+				return;
+			}
+			SendBYECommand(BYE_USER_TERMINATED, SessionPartnerIP, SessionPartnerPort);
+			BYEAttempts++;
+			PrepareTimerEvent(BYE_RETRY_DELAY);
+		}
+		return;
+	}
+
 	if (SessionState==SESSION_WAIT_INVITE)
 	{
 		return;
 	}
-}  // CNetUMPHandler::RunSession
+}  // CNetUMPHandler::ProcessSession
 //---------------------------------------------------------------------------
 
 void CNetUMPHandler::PrepareTimerEvent (unsigned int TimeToWait)
@@ -526,20 +878,50 @@ void CNetUMPHandler::RestartSessionInitiator (void)
 	if (this->IsInitiatorNode == false) return;
 	//if (this->SessionState != SESSION_CLOSED) return;
 
+	// Partner may not be ready yet (timeout) : wait before first invitation
+	LockRealtimeThread();
+	StartInvitations (JitteredDelay(RetryPolicy.InitialDelay));
+	UnlockRealtimeThread();
+}  // CNetUMPHandler::RestartSessionInitiator
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::StartInvitations (unsigned int FirstDelay)
+{
 	UMPSequenceCounter = 0;
+	InviteCount = 0;
+	InviteDelay = RetryPolicy.InitialDelay;
 	SessionState=SESSION_INVITE;
-    PrepareTimerEvent(1000);
-	TimeOutRemote=TIMEOUT_RESET;
+	PrepareTimerEvent(FirstDelay);
+	TimeOutRemote=Keepalive.SessionTimeout;
 	// Do not reset SessionPartnerIP and SessionPartnerPort as it will block the initiator process
-}  // CNetUMPHandler::RestartSessionInitiator
+}  // CNetUMPHandler::StartInvitations
+//--------------------------------------------------------------------------
+
+unsigned int CNetUMPHandler::JitteredDelay (unsigned int Delay)
+{
+	unsigned int Span;
+
+	Span = (unsigned int)(((uint64_t)Delay*RetryPolicy.JitterPercent)/100);
+	if (Span > 0)
+	{
+		// xorshift32
+		JitterRandom ^= JitterRandom << 13;
+		JitterRandom ^= JitterRandom >> 17;
+		JitterRandom ^= JitterRandom << 5;
+		Delay = Delay - Span + (JitterRandom % (2*Span+1));
+	}
+	if (Delay == 0) Delay = 1;
+	return Delay;
+}  // CNetUMPHandler::JitteredDelay
 //--------------------------------------------------------------------------
 
 int CNetUMPHandler::GetSessionStatus (void)
 {
-	if (SessionState==SESSION_CLOSED) return 0;
-	if (SessionState==SESSION_OPENED) return 3;
-	if (SessionState==SESSION_INVITE) return 1;
-	return 2;
+	if (SessionState==SESSION_CLOSED) return NETUMP_STATUS_CLOSED;
+	if (SessionState==SESSION_CLOSING) return NETUMP_STATUS_CLOSED;		// No more data exchanged, only waiting for BYE REPLY
+	if (SessionState==SESSION_OPENED) return NETUMP_STATUS_OPENED;
+	if (SessionState==SESSION_INVITE) return NETUMP_STATUS_INVITING;
+	return NETUMP_STATUS_WAITING_INVITATION;
 }  // CNetUMPHandler::::GetSessionStatus
 //--------------------------------------------------------------------------
 
@@ -547,8 +929,7 @@ bool CNetUMPHandler::ReadAndResetConnectionLost (void)
 {
 	if (ConnectionLost==false) return false;
 
-	ConnectionLost=false;
-	return true;
+	return ConnectionLost.exchange(false);
 }  // CNetUMPHandler::ReadAndResetConnectionLost
 //--------------------------------------------------------------------------
 
@@ -556,8 +937,7 @@ bool CNetUMPHandler::RemotePeerClosedSession (void)
 {
 	bool ReadValue;
 
-	ReadValue = PeerClosedSession;
-	PeerClosedSession = false;
+	ReadValue = PeerClosedSession.exchange(false);
 
 	return ReadValue;
 }  // CNetUMPHandler::RemotePeerClosedSession
@@ -565,94 +945,166 @@ bool CNetUMPHandler::RemotePeerClosedSession (void)
 
 bool CNetUMPHandler::SendUMPMessage (uint32_t* UMPData)
 {
-	unsigned int TmpWrite;
-	unsigned int WordCounter;
+	CNetUMPStateTracker* Tracker;
+
+	// State is tracked even when session is not opened, so the device gets the latest state when it reconnects
+	Tracker = StateTracker.load (std::memory_order_acquire);
+	if (Tracker)
+		Tracker->Update (UMPData);
+	return QueueUMPMessage (UMPData);
+}  // CNetUMPHandler::SendUMPMessage
+//--------------------------------------------------------------------------
+
+bool CNetUMPHandler::QueueUMPMessage (uint32_t* UMPData)
+{
 	unsigned int MT;
 	unsigned int MsgSize;
+	uint32_t Timestamp;
 
 	if (SessionState!=SESSION_OPENED) return false;		// Avoid filling the FIFO when nothing can be sent
 	MT = UMPData[0]>>28;
-	MsgSize = UMPSize[MT];
-
-	TmpWrite = UMP_FIFO_TO_NET.WritePtr;		// Snapshot
+	MsgSize = NetUMPMessageSize(UMPData[0]);
+
+	// A timestamp applies to the next message of the producer : it is queued with it, in the lane of that message
+	// A timestamp left by this thread for another handler is dropped (it did not precede any message)
+	Timestamp = 0;
+	if (TimestampHandler == this)
+		Timestamp = PendingTimestamp;
+	TimestampHandler = 0;
+
+	if ((MT == 0) && ((((UMPData[0]>>20)&0x0F) == 0x2) || (((UMPData[0]>>20)&0x0F) == 0x4)))
+	{  // JR Timestamp or Delta Clockstamp
+		if ((Timestamp != 0) && (PushTxMessage (&UMP_TX_QUEUE[TX_LANE_VOICE], 0, &Timestamp, 1) == false))
+			TxQueueRejected.fetch_add (1, std::memory_order_relaxed);		// Previous timestamp is sent alone
+		TimestampHandler = this;
+		PendingTimestamp = UMPData[0];
+		return true;
+	}
 
-	for (WordCounter=0; WordCounter<MsgSize; WordCounter++)
+	if (PushTxMessage (&UMP_TX_QUEUE[TxLane[MT]], Timestamp, UMPData, MsgSize) == false)
 	{
-		UMP_FIFO_TO_NET.FIFO[TmpWrite] = UMPData[WordCounter];
-		TmpWrite++;
-		if (TmpWrite>=UMP_FIFO_SIZE)
-			TmpWrite = 0;
-
-		// Check if FIFO is not full
-		if (TmpWrite == UMP_FIFO_TO_NET.ReadPtr) return false;
+		TxQueueRejected.fetch_add (1, std::memory_order_relaxed);
+		return false;
 	}
-
-	// Update write pointer only when the whole block has been copied
-	UMP_FIFO_TO_NET.WritePtr = TmpWrite;
-
+	if (NoteCleanup.load (std::memory_order_relaxed))
+		TrackTxNote (UMPData);
 	return true;
-}  // CNetUMPHandler::SendUMPMessage
+}  // CNetUMPHandler::QueueUMPMessage
 //--------------------------------------------------------------------------
 
 unsigned int CNetUMPHandler::GenerateUMPCommand (uint32_t* UMPCommand)
 {
-	unsigned int UMPBlockEnd;			// Index of last UMP word in FIFO to transmit
 	unsigned CtrWordPayload;
-	unsigned int TempPtr;
 	unsigned int FECIndex;
 	unsigned int NewFECSlot;
-	uint32_t NewUMPCommand[65];
+	uint32_t NewUMPCommand[MAX_UMP_COMMAND_PAYLOAD+1];
 	unsigned int NewCommandWordCount;
-	bool MessageLimit;
-	uint32_t NewUMP;
-	unsigned int NewLength;
+	TNetUMPTxSlot* Slot;
+	TNetUMPTxSlot* Source;
+	TNetUMPTxQueue* Queue;
+	unsigned int QueueDepth;
+	unsigned int WordLimit;
+	unsigned int PayloadLimit;
+
+	// Refill token buckets (called once per millisecond)
+	if (RateLimit.WordsPerSecond != 0)
+	{
+		WordTokens += RateLimit.WordsPerSecond;
+		if (WordTokens > RateLimit.BurstWords*1000) WordTokens = RateLimit.BurstWords*1000;
+	}
+	if (RateLimit.DatagramsPerSecond != 0)
+	{
+		DatagramTokens += RateLimit.DatagramsPerSecond;
+		if (DatagramTokens > RateLimit.BurstDatagrams*1000) DatagramTokens = RateLimit.BurstDatagrams*1000;
+	}
 
-    UMPBlockEnd=UMP_FIFO_TO_NET.WritePtr;			// Snapshot of current position of last MIDI message
+	// Check first if we have any UMP message waiting in the queues. If not, return 0 to signal nothing to transmit
+	QueueDepth = 0;
+	for (unsigned int Lane=0; Lane<NUM_TX_LANES; Lane++)
+		QueueDepth += UMP_TX_QUEUE[Lane].EnqueuePos.load(std::memory_order_relaxed)-UMP_TX_QUEUE[Lane].DequeuePos;
+	if (QueueDepth == 0) return 0;
 
-	// Check first if we have any UMP message waiting in the FIFO. If not, return 0 to signal nothing to transmit
-    if (UMPBlockEnd==UMP_FIFO_TO_NET.ReadPtr) return 0;
+	// Under congestion, new controller messages of the voice lane are indexed so older values can be skipped
+	if ((CoalesceThreshold != 0) &&
+		(UMP_TX_QUEUE[TX_LANE_VOICE].EnqueuePos.load(std::memory_order_relaxed)-UMP_TX_QUEUE[TX_LANE_VOICE].DequeuePos > CoalesceThreshold))
+		ScanCoalescing();
+
+	// Rate limit only applies to opened session (FIFO is flushed otherwise)
+	PayloadLimit = MAX_UMP_COMMAND_PAYLOAD;
+	if (SessionState == SESSION_OPENED)
+	{
+		if ((RateLimit.DatagramsPerSecond != 0) && (DatagramTokens < 1000))
+			PayloadLimit = 0;
+		if ((RateLimit.WordsPerSecond != 0) && (WordTokens/1000 < PayloadLimit))
+			PayloadLimit = WordTokens/1000;
+	}
 
 	// Prepare the new UMP command packet into local buffer. Packet must be 64 words max
+	// Lanes are emptied by priority order : a lane is only read when higher priority lanes are empty
+	// or when the remaining space is too small for their next message
 	NewCommandWordCount = 0;
+	for (unsigned int Lane=0; Lane<NUM_TX_LANES; Lane++)
+	{
+		Queue = &UMP_TX_QUEUE[Lane];
+		Slot = PeekTxMessage (Queue);
 
-	MessageLimit = false;
-	TempPtr=UMP_FIFO_TO_NET.ReadPtr;
-
-	while ((TempPtr!=UMPBlockEnd)&&(MessageLimit==false))
-    {
-		// Read first word of new UMP message to know its length depending on MT
-		NewUMP = UMP_FIFO_TO_NET.FIFO[TempPtr];
-		NewLength = UMPSize[NewUMP>>28];		// Get size from MT field
+		WordLimit = PayloadLimit;
+		if ((Lane == TX_LANE_VOICE) && (TxBulkReservedWords > 0) && (PeekTxMessage(&UMP_TX_QUEUE[TX_LANE_BULK]) != 0))
+		{
+			if (WordLimit > TxBulkReservedWords) WordLimit -= TxBulkReservedWords;
+			else WordLimit = 0;
+		}
 
-		if (NewCommandWordCount+NewLength<65)
+		while ((Slot != 0) && (NewCommandWordCount+Slot->Size<=WordLimit))
 		{
-			NewUMPCommand[NewCommandWordCount+1] = htonl (NewUMP);		// Store first word
-			NewCommandWordCount+=1;
-			TempPtr+=1;
-			if (TempPtr>=UMP_FIFO_SIZE)
-				TempPtr=0;
-
-			// if UMP is more than 1 word, copy the other words in the buffer
-			if (NewLength>1)
+			// Merged controller messages carry the newest value of the controller (same size), or are removed
+			Source = Slot;
+			if ((Lane == TX_LANE_VOICE) && (CoalesceThreshold != 0))
+				Source = GetCoalescedMessage (Slot);
+
+			if (Source != 0)
 			{
-				for (unsigned int WordCount=1; WordCount<NewLength; WordCount++)
+				for (unsigned int WordCount=0; WordCount<Slot->Size; WordCount++)
 				{
-					NewUMPCommand[NewCommandWordCount+1]=htonl(UMP_FIFO_TO_NET.FIFO[TempPtr]);
+					NewUMPCommand[NewCommandWordCount+1]=htonl(Source->UMP[WordCount]);
 					NewCommandWordCount+=1;
-					TempPtr+=1;
-					if (TempPtr>=UMP_FIFO_SIZE)
-						TempPtr=0;
 				}
 			}
+			else Stats.TxCoalescedMessages++;
+			PopTxMessage (Queue);
+			Slot = PeekTxMessage (Queue);
 		}
-		else MessageLimit=true;
 	}
-    UMP_FIFO_TO_NET.ReadPtr=TempPtr;		// Update pointer when we have read messages from queue
+
+	if (PayloadLimit < MAX_UMP_COMMAND_PAYLOAD)
+	{  // Check if the rate limit has kept messages in the queues
+		for (unsigned int Lane=0; Lane<NUM_TX_LANES; Lane++)
+		{
+			if (PeekTxMessage(&UMP_TX_QUEUE[Lane]) != 0)
+			{
+				Stats.TxThrottledTicks++;
+				break;
+			}
+		}
+	}
+
+	// Messages may be in the queues but not yet published by their producer
+	if (NewCommandWordCount == 0) return 0;
+
+	if (SessionState == SESSION_OPENED)
+	{
+		if (RateLimit.WordsPerSecond != 0) WordTokens -= NewCommandWordCount*1000;
+		if (RateLimit.DatagramsPerSecond != 0) DatagramTokens -= 1000;
+	}
+
+	Stats.TxQueueDepthHistogram[HistogramBucket(QueueDepth)]++;
 	// Make header for the new UMP packet
 	NewUMPCommand[0] = htonl(0xFF000000 + (NewCommandWordCount<<16) + UMPSequenceCounter);
 	NewCommandWordCount+=1;		// Add header
 
 	UMPSequenceCounter++;  // Increment for next message
+	Stats.TxUMPCommands++;
+	Stats.TxUMPWords += NewCommandWordCount-1;
 
 	// *** Prepare message to be sent on network ***
 	UMPCommand[0] = htonl (UMP_SIGNATURE);
@@ -704,16 +1156,200 @@ unsigned int CNetUMPHandler::GenerateUMPCommand (uint32_t* UMPCommand)
 }  // CNetUMPHandler::GenerateUMPCommand
 //--------------------------------------------------------------------------
 
+int CNetUMPHandler::ParseDatagram (const unsigned char* Buffer, int Size, TNetUMPCommandDescriptor* Descriptors)
+{
+	int PtrParse;
+	int NumCommands = 0;
+	unsigned int PayloadLength;
+	unsigned int WordCounter;
+
+	// Datagram is made of "MIDI" signature followed by commands, all aligned on 32-bit words
+	if ((Size < 4) || ((Size & 3) != 0))
+		return -1;
+	if ((Buffer[0]!='M')||(Buffer[1]!='I')||(Buffer[2]!='D')||(Buffer[3]!='I'))
+		return -1;
+
+	PtrParse = 4;		// Jump over MIDI signature
+	while (PtrParse<Size)
+	{
+		// Command header is always complete as size is a multiple of 4
+		PayloadLength = Buffer[PtrParse+1];
+		if (PtrParse+4+(int)(PayloadLength*4) > Size)
+			return -1;		// Payload goes past the end of the datagram
+		if (NumCommands >= MAX_COMMANDS_PER_DATAGRAM)
+			return -1;
+
+		switch (Buffer[PtrParse])
+		{
+			case UMP_DATA_COMMAND :
+				// UMP messages must fill exactly the payload (no message can be cut)
+				WordCounter = 0;
+				while (WordCounter < PayloadLength)
+					WordCounter += NetUMPMessageSize((uint32_t)Buffer[PtrParse+4+(WordCounter*4)]<<24);
+				if (WordCounter != PayloadLength)
+					return -1;
+				break;
+			case INVITATION_COMMAND :
+			case INVITATION_ACCEPTED_COMMAND :
+				// Endpoint name length (in words) must fit in the payload
+				if (Buffer[PtrParse+2] > PayloadLength)
+					return -1;
+				break;
+			case PING_COMMAND :
+			case PING_REPLY_COMMAND :
+				if (PayloadLength < 1)
+					return -1;		// PING ID is missing
+				break;
+		}
+
+		Descriptors[NumCommands].CommandCode = Buffer[PtrParse];
+		Descriptors[NumCommands].PayloadLength = (uint8_t)PayloadLength;
+		Descriptors[NumCommands].Offset = (uint16_t)PtrParse;
+		NumCommands++;
+
+		PtrParse += 4+(PayloadLength*4);		// Jump to next NetUMP command in UDP packet
+	}
+
+	return NumCommands;
+}  // CNetUMPHandler::ParseDatagram
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::ProcessInvitation (unsigned char* Command, unsigned int SenderIP, unsigned short SenderPort)
+{
+	if (IsInitiatorNode)
+	{  // Session initiator : for now, we don't accept to be invited (TODO : we can acccept an invitation if it comes from the declared partner)
+		SendBYECommand (BYE_TOO_MANY_SESSIONS, SenderIP, SenderPort);
+		return;
+	}
+
+	if (SessionState==SESSION_OPENED)
+	{  // Invited again while session is opened : the partner has probably restarted
+		if ((SenderIP == SessionPartnerIP) && (SenderPort == SessionPartnerPort) && (PartnerJoined == false))
+		{  // Retransmitted invitation, sent before the partner received our INVITATION ACCEPTED : session is kept
+			SendInvitationAcceptedCommand ();
+			return;
+		}
+
+		if (ReinvitationPolicy == REINVITATION_FROM_PARTNER)
+		{
+			if (SenderIP != SessionPartnerIP) return;
+		}
+		else if (ReinvitationPolicy != REINVITATION_FROM_ANY) return;
+
+		// Previous session is dropped. A different device taking over the session is announced to the previous partner
+		if ((SenderIP != SessionPartnerIP) || (SenderPort != SessionPartnerPort))
+			SendBYECommand (BYE_USER_TERMINATED, SessionPartnerIP, SessionPartnerPort);
+		LockSocketToPartner(false);
+		SessionState = SESSION_WAIT_INVITE;
+		ConnectionLost = true;
+		Stats.ConnectionsLost++;
+		RecordSessionEvent (NETUMP_EVENT_CONNECTION_LOST);
+		ReleaseRxNotes();
+
+		if (DisconnectCallback != 0)
+			DisconnectCallback();
+	}
+
+	// If we are a session listener AND session is not yet opened, send INVITATION ACCEPTED and open the session
+	if (SessionState!=SESSION_WAIT_INVITE) return;
+
+	TimeOutRemote = Keepalive.SessionTimeout;
+	PINGsOutstanding = 0;
+	LossSuspected = false;
+	PINGDelayCounter = 0;
+	PartnerJoined = false;
+	SessionState = SESSION_OPENED;
+	SetSessionPartner (SenderIP, SenderPort);
+	SendInvitationAcceptedCommand ();
+	LockSocketToPartner(true);
+	ResetFECMemory();
+	Stats.Connections++;
+	RecordSessionEvent (NETUMP_EVENT_SESSION_OPENED);
+	LastPartnerRxTime = TimeCounter;
+	memset (&RxActiveNotes[0][0][0], 0, sizeof(RxActiveNotes));		// Notes of a previous session are not released anymore
+	SendHangingNoteOffs();
+	ResyncPosition = 0;			// State is resent over the next milliseconds (see ContinueStateResync)
+
+	// Endpoint name size is given in 32-bit words
+	if (ConnectionCallback != 0)
+		ConnectionCallback((const char*)(Command+4), Command[2]*4);
+}  // CNetUMPHandler::ProcessInvitation
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::ProcessInvitationAccepted (unsigned char* Command, unsigned int SenderIP)
+{
+	// Only meaningful while we are inviting remote node
+	if (SessionState!=SESSION_INVITE) return;
+
+	SetSessionPartner (SenderIP, SessionPartnerPort);		// TODO : what happens if we receive accidentally an INVITATION ACCEPTED from another device while we are inviting one ?
+	SessionState=SESSION_OPENED;
+	TimeOutRemote = Keepalive.SessionTimeout;
+	PINGsOutstanding = 0;
+	LossSuspected = false;
+	PINGDelayCounter = 0;
+	LockSocketToPartner(true);
+	ResetFECMemory();
+	Stats.Connections++;
+	RecordSessionEvent (NETUMP_EVENT_SESSION_OPENED);
+	LastPartnerRxTime = TimeCounter;
+	memset (&RxActiveNotes[0][0][0], 0, sizeof(RxActiveNotes));		// Notes of a previous session are not released anymore
+	SendHangingNoteOffs();
+	ResyncPosition = 0;			// State is resent over the next milliseconds (see ContinueStateResync)
+
+	if (ConnectionCallback != 0)
+		ConnectionCallback((const char*)(Command+4), Command[2]*4);
+}  // CNetUMPHandler::ProcessInvitationAccepted
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::ProcessBYE (unsigned int SenderIP, unsigned short SenderPort)
+{
+	if ((SenderIP != SessionPartnerIP)||(SenderPort != SessionPartnerPort))
+	{
+		SendBYEReplyCommand (SenderIP, SenderPort);
+		return;
+	}
+
+	if (SessionState == SESSION_CLOSING)
+	{  // Both sides closed the session at the same time
+		SendBYEReplyCommand (SessionPartnerIP, SessionPartnerPort);
+		CompleteClose(true);
+		return;
+	}
+
+	if (SessionState != SESSION_OPENED)
+	{  // Partner declined our invitation : next invitation follows the retry policy
+		SendBYEReplyCommand (SessionPartnerIP, SessionPartnerPort);
+		return;
+	}
+
+	SendBYEReplyCommand (SessionPartnerIP, SessionPartnerPort);
+	LockSocketToPartner(false);
+	if (IsInitiatorNode == false)
+	{
+		SessionState = SESSION_WAIT_INVITE;
+		SetSessionPartner (0, 0);
+	}
+	else
+	{
+		// TODO : make an option to decide if session must close if a BYE is received or if it shall invite again the partner
+		// Partner closed the session on purpose and is alive : invite it again immediately
+		StartInvitations (1);
+	}
+	ConnectionLost = true;		// This will report information to user interface
+	Stats.ConnectionsLost++;
+	RecordSessionEvent (NETUMP_EVENT_PEER_CLOSED);
+	ReleaseRxNotes();
+
+	if (DisconnectCallback != 0)
+		DisconnectCallback();
+}  // CNetUMPHandler::ProcessBYE
+//--------------------------------------------------------------------------
+
 void CNetUMPHandler::ProcessIncomingUMP (unsigned char* Buffer)
 {
 	unsigned int PayloadLength;
-	unsigned int WordCounter = 0;
-	unsigned int ByteCounter;
-	uint32_t UMPByte[4];
-	uint32_t UMPMsg[4];
-	unsigned int MT;
-	unsigned int MessageSize;
 	uint16_t PacketNumber;
+	uint16_t Distance;
 
 	// Byte 0 : 0xFF
 	// Byte 1 : payload length (in 32-bit words)
@@ -723,93 +1359,104 @@ void CNetUMPHandler::ProcessIncomingUMP (unsigned char* Buffer)
 	PacketNumber = (Buffer[2]<<8)+(Buffer[3]);
 	//printf ("Packet number %d\n", PacketNumber);
 
-	// If packet counter is one of the last we have already received, it means this is a Forward Error Correction packet
-	// It must then be ignored
-	for (unsigned int FECCounter=0; FECCounter<NUM_FEC_ENTRIES; FECCounter++)
+	// Received sequence numbers are tracked in a 64 packets window ending at the most recent one
+	// A packet already marked in the window is a Forward Error Correction copy (or a network duplicate) and must be ignored
+	// This stays valid when datagrams are reordered (a late datagram carries FEC copies of packets received since)
+	if (RxSequenceWindow == 0)
+	{  // First packet of the session
+		HighestRxSequence = PacketNumber;
+		RxSequenceWindow = 1;
+	}
+	else
 	{
-		if (PacketNumber == ReceivedSequenceCounters[FECCounter])
-		{
-            //printf ("Recovery packet number : %d\n", PacketNumber);
-            return;
-        }
+		Distance = (uint16_t)(PacketNumber-HighestRxSequence);
+		if ((Distance != 0) && (Distance < 0x8000))
+		{  // Newer packet : slide the window. Packets jumped over are missing (at least for now)
+			if (Distance > 1)
+			{
+				Stats.RxLostCommands += Distance-1;
+				LossSuspected = true;
+			}
+			if (Distance >= 64)
+				RxSequenceWindow = 0;
+			else
+				RxSequenceWindow <<= Distance;
+			RxSequenceWindow |= 1;
+			HighestRxSequence = PacketNumber;
+		}
+		else
+		{  // Same or older packet
+			Distance = (uint16_t)(HighestRxSequence-PacketNumber);
+			if ((Distance >= 64) || (RxSequenceWindow & ((uint64_t)1<<Distance)))
+			{  // Already received, or too old to know it : ignore
+				Stats.RxDuplicateCommands++;
+				return;
+			}
+			// Late packet, previously counted as missing
+			RxSequenceWindow |= ((uint64_t)1<<Distance);
+			if (Stats.RxLostCommands > 0)
+				Stats.RxLostCommands--;
+		}
 	}
+	Stats.RxUMPCommands++;
 
-	// Packet number is not in the list : this is a new packet
-	LastReceivedUMPCounter = PacketNumber;
+	// Recording keeps all messages received, the filter decides what the application gets
+	if (Recorder)
+		Recorder->RecordUMPBlock (RecorderSource, &Buffer[4], PayloadLength);
 
-	// Update the received packet list (shift the data, then place the received packet number as the most recent one)
-	for (unsigned int FECCounter=0; FECCounter<NUM_FEC_ENTRIES-1; FECCounter++)
+	if (FilterActive)
 	{
-		ReceivedSequenceCounters[FECCounter] = ReceivedSequenceCounters[FECCounter+1];
+		PayloadLength = FilterUMPBlock (&Buffer[4], PayloadLength);
+		if (PayloadLength == 0) return;
 	}
-	ReceivedSequenceCounters[NUM_FEC_ENTRIES-1] = PacketNumber;		// Place the new packet number at the end of the list (most recent received one)
 
-	// Parse all UMP packets that follows, until we reach the number of words from the header
-	ByteCounter = 4;
-	while (WordCounter<PayloadLength)
-	{
-		// Reconstruct first word, so we can know the size of the UMP packet
-		UMPByte[0] = Buffer[ByteCounter++];
-		UMPByte[1] = Buffer[ByteCounter++];
-		UMPByte[2] = Buffer[ByteCounter++];
-		UMPByte[3] = Buffer[ByteCounter++];
-		WordCounter++;
-		UMPMsg[0] = (UMPByte[0]<<24)+(UMPByte[1]<<16)+(UMPByte[2]<<8)+UMPByte[3];
+	if (NoteCleanup.load (std::memory_order_relaxed))
+		TrackRxNotes (&Buffer[4], PayloadLength);
 
-		MT = UMPMsg[0]>>28;
-		MessageSize = UMPSize[MT];
+	// Messages of the new command are given to the application
+	Stats.RxUMPMessages += DeliverUMPBlock (&Buffer[4], PayloadLength);
+}  // CNetUMPHandler::ProcessIncomingUMP
+//--------------------------------------------------------------------------
 
-		if (MessageSize == 1)
-		{  // UMP message is 32 bits long : send it now
-			if (UMPCallback!=0)
-				UMPCallback (ClientInstance, &UMPMsg[0]);
-		}
-		else
-		{  // UMP message is 64, 96 or 128 bits long, decode the rest of the message
-			// Reconstruct second word
-			UMPByte[0] = Buffer[ByteCounter++];
-			UMPByte[1] = Buffer[ByteCounter++];
-			UMPByte[2] = Buffer[ByteCounter++];
-			UMPByte[3] = Buffer[ByteCounter++];
-			WordCounter++;
-			UMPMsg[1] = (UMPByte[0]<<24)+(UMPByte[1]<<16)+(UMPByte[2]<<8)+UMPByte[3];
-
-			if (MessageSize == 2)
-			{  // UMP message is 64 bits long : send it now
-				if (UMPCallback)
-					UMPCallback (ClientInstance, &UMPMsg[0]);
-			}
-			else
-			{  // Message is 96 or 128 bits long
-				// Reconstruct third word
-				UMPByte[0] = Buffer[ByteCounter++];
-				UMPByte[1] = Buffer[ByteCounter++];
-				UMPByte[2] = Buffer[ByteCounter++];
-				UMPByte[3] = Buffer[ByteCounter++];
-				WordCounter++;
-				UMPMsg[2] = (UMPByte[0]<<24)+(UMPByte[1]<<16)+(UMPByte[2]<<8)+UMPByte[3];
-
-				if (MessageSize == 3)
-				{  // UMP message is 96 bits long : send it now
-					if (UMPCallback)
-						UMPCallback (ClientInstance, &UMPMsg[0]);
-				}
-				else
-				{  // UMP message is 128 bits long : decode the last word and send the whole message
-					UMPByte[0] = Buffer[ByteCounter++];
-					UMPByte[1] = Buffer[ByteCounter++];
-					UMPByte[2] = Buffer[ByteCounter++];
-					UMPByte[3] = Buffer[ByteCounter++];
-					WordCounter++;
-					UMPMsg[3] = (UMPByte[0]<<24)+(UMPByte[1]<<16)+(UMPByte[2]<<8)+UMPByte[3];
-
-					if (UMPCallback)
-						UMPCallback (ClientInstance, &UMPMsg[0]);
-				}
-			}
-		}
+unsigned int CNetUMPHandler::DeliverUMPBlock (const unsigned char* Payload, unsigned int PayloadLength)
+{
+	auto Deliver = [this] (uint32_t* UMPMsg, unsigned int Size) { DeliverUMPMessage (UMPMsg, Size); };
+
+	return NetUMPDecodeBlock (Payload, PayloadLength, Deliver);
+}  // CNetUMPHandler::DeliverUMPBlock
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::DeliverUMPMessage (uint32_t* UMPMsg, unsigned int Size)
+{
+	unsigned int WritePtr;
+	unsigned int NextWritePtr;
+	TNetUMPRxMessage* Message;
+
+	if (UseReceiveQueue == false)
+	{
+		if (UMPCallback!=0)
+			UMPCallback (ClientInstance, UMPMsg);
+		return;
 	}
-}  // CNetUMPHandler::ProcessIncomingUMP
+
+	WritePtr = RxQueueWritePtr.load(std::memory_order_relaxed);
+	NextWritePtr = (WritePtr+1)&(UMP_RX_QUEUE_SIZE-1);
+	if (NextWritePtr == RxQueueReadPtr.load(std::memory_order_acquire))
+	{  // Application is too slow : message is lost
+		Stats.RxQueueFull++;
+		return;
+	}
+
+	Message = &RxQueue[WritePtr];
+	Message->Timestamp = TimeCounter;
+	Message->Size = Size;
+	for (unsigned int WordCount=0; WordCount<Size; WordCount++)
+		Message->UMP[WordCount] = UMPMsg[WordCount];
+
+	// Publish the message only when it is complete
+	RxQueueWritePtr.store(NextWritePtr, std::memory_order_release);
+	RxQueueSignal = true;
+}  // CNetUMPHandler::DeliverUMPMessage
 //--------------------------------------------------------------------------
 
 void CNetUMPHandler::ResetFECMemory (void)
@@ -821,39 +1468,534 @@ void CNetUMPHandler::ResetFECMemory (void)
 	{
 		FECMemory[Slot].Filled = false;
 		FECMemory[Slot].Size = 0;
-		ReceivedSequenceCounters[Slot] = 0xFFFF;
 	}
+	HighestRxSequence = 0;
+	RxSequenceWindow = 0;
 }  // CNetUMPHandler::ResetFECMemory
 //--------------------------------------------------------------------------
 
 void CNetUMPHandler::SelectErrorCorrectionMode (unsigned int CorrectionMethod)
 {
+	LockRealtimeThread();
 	ErrorCorrectionMode = CorrectionMethod;
+	UnlockRealtimeThread();
 }  // CNetUMPHandler::SelectErrorCorrectionMode
 //--------------------------------------------------------------------------
 
-void CNetUMPHandler::SetCallback(TUMPDataCallback CallbackFunc, void* UserInstance)
+void CNetUMPHandler::SetTransmitRateLimit (TNetUMPRateLimit* Limit)
 {
-	bool SocketState = this->SocketLocked;
+	LockRealtimeThread();
+	if (Limit == 0)
+		memset (&RateLimit, 0, sizeof(RateLimit));
+	else
+		RateLimit = *Limit;
+	if (RateLimit.BurstWords == 0) RateLimit.BurstWords = MAX_UMP_COMMAND_PAYLOAD;
+	// Largest transmit slot (JR timestamp + 4 words message) must fit in the bucket, otherwise its lane would stall forever
+	if (RateLimit.BurstWords < sizeof(((TNetUMPTxSlot*)0)->UMP)/4) RateLimit.BurstWords = sizeof(((TNetUMPTxSlot*)0)->UMP)/4;
+	if (RateLimit.BurstWords > 1000000) RateLimit.BurstWords = 1000000;
+	if (RateLimit.BurstDatagrams == 0) RateLimit.BurstDatagrams = 1;
+	if (RateLimit.BurstDatagrams > 1000000) RateLimit.BurstDatagrams = 1000000;
+	// Full bucket plus one refill must fit in 32 bits (handler never sends more than 64000 words and 1000 datagrams per second)
+	if (RateLimit.WordsPerSecond > 1000000) RateLimit.WordsPerSecond = 1000000;
+	if (RateLimit.DatagramsPerSecond > 1000000) RateLimit.DatagramsPerSecond = 1000000;
+
+	// Start with full buckets
+	WordTokens = RateLimit.BurstWords*1000;
+	DatagramTokens = RateLimit.BurstDatagrams*1000;
+	UnlockRealtimeThread();
+}  // CNetUMPHandler::SetTransmitRateLimit
+//--------------------------------------------------------------------------
 
-	this->SocketLocked = false;		// Block processing to avoid callbacks while we configure them
+void CNetUMPHandler::SetTransmitCoalescing (unsigned int Threshold)
+{
+	LockRealtimeThread();
+	CoalesceThreshold = Threshold;
+	CoalesceScanPos = UMP_TX_QUEUE[TX_LANE_VOICE].DequeuePos;
+	memset (&CoalesceTable[0], 0, sizeof(CoalesceTable));
+	UnlockRealtimeThread();
+}  // CNetUMPHandler::SetTransmitCoalescing
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::ScanCoalescing (void)
+{
+	TNetUMPTxQueue* Queue;
+	TNetUMPTxSlot* Slot;
+	TNetUMPCoalesceSlot* Entry;
+	unsigned int EnqueuePos;
+	uint32_t Key;
+
+	Queue = &UMP_TX_QUEUE[TX_LANE_VOICE];
+	if ((int)(CoalesceScanPos-Queue->DequeuePos) < 0)
+		CoalesceScanPos = Queue->DequeuePos;
+	EnqueuePos = Queue->EnqueuePos.load (std::memory_order_relaxed);
+
+	while (CoalesceScanPos != EnqueuePos)
+	{
+		Slot = &Queue->Slots[CoalesceScanPos&(UMP_TX_QUEUE_SIZE-1)];
+		if (Slot->Sequence.load (std::memory_order_acquire) != CoalesceScanPos+1)
+			break;		// Not published yet by its producer
+
+		Key = GetCoalesceKey (Slot->UMP[0]);
+		if (Key != 0)
+		{
+			Entry = &CoalesceTable[CoalesceHash(Key)];
+			if ((Entry->Key == Key) && ((int)(Entry->First-Queue->DequeuePos) >= 0))
+			{  // Oldest message of the controller is still queued : it will take this value
+				Entry->Newest = CoalesceScanPos;
+			}
+			else if ((Entry->Key == Key) || (Entry->Key == 0) || ((int)(Entry->Newest-Queue->DequeuePos) < 0))
+			{  // New controller in the entry (or oldest message already sent with the previous newest value)
+				Entry->Key = Key;
+				Entry->First = CoalesceScanPos;
+				Entry->Newest = CoalesceScanPos;
+			}
+			// Otherwise the entry is used by another controller with queued messages : this message is not merged
+		}
+		CoalesceScanPos++;
+	}
+}  // CNetUMPHandler::ScanCoalescing
+//--------------------------------------------------------------------------
+
+TNetUMPTxSlot* CNetUMPHandler::GetCoalescedMessage (TNetUMPTxSlot* Slot)
+{
+	TNetUMPTxQueue* Queue;
+	TNetUMPCoalesceSlot* Entry;
+	unsigned int Pos;
+	uint32_t Key;
+
+	Key = GetCoalesceKey (Slot->UMP[0]);
+	if (Key == 0) return Slot;
+	Entry = &CoalesceTable[CoalesceHash(Key)];
+	if (Entry->Key != Key) return Slot;
+
+	Queue = &UMP_TX_QUEUE[TX_LANE_VOICE];
+	Pos = Queue->DequeuePos;
+	if ((int)(Entry->Newest-Pos) < 0) return Slot;		// Queued after the last scan
+	if (Pos == Entry->First)
+		return &Queue->Slots[Entry->Newest&(UMP_TX_QUEUE_SIZE-1)];
+	return 0;		// The newest value has already been sent, or will be sent by the first message
+}  // CNetUMPHandler::GetCoalescedMessage
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::SetBulkLaneReservation (unsigned int BulkWords)
+{
+	if (BulkWords > MAX_UMP_COMMAND_PAYLOAD) BulkWords = MAX_UMP_COMMAND_PAYLOAD;
+	LockRealtimeThread();
+	TxBulkReservedWords = BulkWords;
+	UnlockRealtimeThread();
+}  // CNetUMPHandler::SetBulkLaneReservation
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::SetCallback(TUMPDataCallback CallbackFunc, void* UserInstance)
+{
+	LockRealtimeThread();		// Block processing to avoid callbacks while we configure them
 
 	this->ClientInstance = UserInstance;
 	this->UMPCallback = CallbackFunc;
 
-	// Restore lock state
-	this->SocketLocked = SocketState;
+	UnlockRealtimeThread();
 }  // CNetUMPHandler::SetCallback
 //--------------------------------------------------------------------------
 
 void CNetUMPHandler::SetConnectionCallback(void (*CallbackFunc)(const char* EndpointName, unsigned int Size))
 {
+	LockRealtimeThread();
 	this->ConnectionCallback = CallbackFunc;
+	UnlockRealtimeThread();
 }  // CNetUMPHandler::SetConnectionCallback
 //--------------------------------------------------------------------------
 
 void CNetUMPHandler::SetDisconnectCallback(void (*CallbackFunc)())
 {
+	LockRealtimeThread();
 	this->DisconnectCallback = CallbackFunc;
+	UnlockRealtimeThread();
 }  // CNetUMPHandler::SetDisconnectCallback
 //--------------------------------------------------------------------------
+
+void CNetUMPHandler::SetPacketShim (CNetUMPPacketShim* Shim)
+{
+	LockRealtimeThread();
+	this->PacketShim = Shim;
+	UnlockRealtimeThread();
+}  // CNetUMPHandler::SetPacketShim
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::GetSessionStats (TNetUMPSessionStats* Stats)
+{
+	uint32_t SequenceBefore;
+	uint32_t SequenceAfter;
+
+	// Seqlock read : retry while the realtime thread is updating the snapshot
+	do
+	{
+		SequenceBefore = StatsSnapshotSequence.load (std::memory_order_acquire);
+		if (SequenceBefore & 1) continue;
+
+		memcpy (Stats, &StatsSnapshot, sizeof(TNetUMPSessionStats));
+
+		std::atomic_thread_fence (std::memory_order_acquire);
+		SequenceAfter = StatsSnapshotSequence.load (std::memory_order_relaxed);
+		if (SequenceBefore == SequenceAfter) return;
+	} while (true);
+}  // CNetUMPHandler::GetSessionStats
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::BuildSessionStats (TNetUMPSessionStats* Stats)
+{
+	*Stats = this->Stats;
+	Stats->TxQueueFull = TxQueueRejected.load (std::memory_order_relaxed);
+	Stats->SessionStatus = GetSessionStatus();
+	Stats->PartnerIP = SessionPartnerIP;
+	Stats->PartnerPort = SessionPartnerPort;
+}  // CNetUMPHandler::BuildSessionStats
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::PublishStatsSnapshot (void)
+{
+	uint32_t Sequence;
+
+	// Same seqlock as PublishMetrics : sequence is odd while the snapshot is updated
+	Sequence = StatsSnapshotSequence.load (std::memory_order_relaxed);
+	StatsSnapshotSequence.store (Sequence+1, std::memory_order_relaxed);
+	std::atomic_thread_fence (std::memory_order_release);
+
+	BuildSessionStats (&StatsSnapshot);
+
+	StatsSnapshotSequence.store (Sequence+2, std::memory_order_release);
+}  // CNetUMPHandler::PublishStatsSnapshot
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::SetMetricsSlot (TNetUMPMetricsSlot* Slot, unsigned int PublishInterval)
+{
+	LockRealtimeThread();
+	if (PublishInterval == 0) PublishInterval = 1;
+	this->MetricsPublishInterval = PublishInterval;
+	this->MetricsPublishCounter = 0;
+	this->MetricsSlot = Slot;
+	if (Slot)
+		PublishMetrics();
+	UnlockRealtimeThread();
+}  // CNetUMPHandler::SetMetricsSlot
+//--------------------------------------------------------------------------
+
+bool CNetUMPHandler::SetRecorder (CNetUMPRecorder* Recorder, unsigned int Source)
+{
+	if (Source > NETUMP_RECORD_MAX_SOURCE) return false;		// Would be truncated in the records
+
+	LockRealtimeThread();
+	this->Recorder = Recorder;
+	this->RecorderSource = Source;
+	UnlockRealtimeThread();
+	return true;
+}  // CNetUMPHandler::SetRecorder
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::RecordSessionEvent (unsigned int Event)
+{
+	if (Recorder)
+		Recorder->RecordEvent (RecorderSource, Event);
+}  // CNetUMPHandler::RecordSessionEvent
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::SelectNoteCleanupMode (bool Enable)
+{
+	LockRealtimeThread();
+	this->NoteCleanup.store (Enable, std::memory_order_relaxed);
+	UnlockRealtimeThread();
+}  // CNetUMPHandler::SelectNoteCleanupMode
+//--------------------------------------------------------------------------
+
+//! Returns 1 for a Note On, -1 for a Note Off (MIDI 1.0 Note On with velocity 0 included), 0 for other messages
+static int GetNoteTransition (uint32_t Word)
+{
+	unsigned int MT;
+	unsigned int Opcode;
+
+	MT = Word>>28;
+	if ((MT != 2) && (MT != 4)) return 0;
+	Opcode = (Word>>20)&0x0F;
+	if (Opcode == 0x8) return -1;
+	if (Opcode != 0x9) return 0;
+	if ((MT == 2) && ((Word&0x7F) == 0)) return -1;
+	return 1;
+}  // GetNoteTransition
+//--------------------------------------------------------------------------
+
+//! Build the Note Off of a note, in the protocol used to play it. Returns the message size
+static unsigned int MakeNoteOff (uint32_t* UMP, unsigned int Group, unsigned int Channel, unsigned int Note, bool MIDI2)
+{
+	if (MIDI2)
+	{
+		UMP[0] = 0x40800000|(Group<<24)|(Channel<<16)|(Note<<8);
+		UMP[1] = 0x80000000;		// Velocity 0x8000 (64 in MIDI 1.0), no attribute
+		return 2;
+	}
+	UMP[0] = 0x20800040|(Group<<24)|(Channel<<16)|(Note<<8);
+	return 1;
+}  // MakeNoteOff
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::TrackTxNote (uint32_t* UMPData)
+{
+	int Transition;
+	unsigned int Group;
+	unsigned int Channel;
+	unsigned int Note;
+
+	Transition = GetNoteTransition (UMPData[0]);
+	if (Transition == 0) return;
+
+	Group = (UMPData[0]>>24)&0x0F;
+	Channel = (UMPData[0]>>16)&0x0F;
+	Note = (UMPData[0]>>8)&0x7F;
+	// Producers can run in parallel : bits are changed with atomic operations
+	if (Transition > 0)
+	{
+		TxActiveNotes[Group][Channel][Note>>5].fetch_or (1u<<(Note&0x1F), std::memory_order_relaxed);
+		if ((UMPData[0]>>28) == 4)
+			TxMIDI2Channels[Group].fetch_or (1u<<Channel, std::memory_order_relaxed);
+		else
+			TxMIDI2Channels[Group].fetch_and (~(1u<<Channel), std::memory_order_relaxed);
+	}
+	else
+		TxActiveNotes[Group][Channel][Note>>5].fetch_and (~(1u<<(Note&0x1F)), std::memory_order_relaxed);
+}  // CNetUMPHandler::TrackTxNote
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::TrackRxNotes (const unsigned char* Payload, unsigned int PayloadLength)
+{
+	uint32_t Word;
+	int Transition;
+	unsigned int Group;
+	unsigned int Channel;
+	unsigned int Note;
+	unsigned int WordCounter = 0;
+
+	// Only the first word of each message is needed
+	while (WordCounter < PayloadLength)
+	{
+		Word = ((uint32_t)Payload[0]<<24)|((uint32_t)Payload[1]<<16)|((uint32_t)Payload[2]<<8)|Payload[3];
+		Payload += NetUMPMessageSize(Word)*4;
+		WordCounter += NetUMPMessageSize(Word);
+
+		Transition = GetNoteTransition (Word);
+		if (Transition == 0) continue;
+
+		Group = (Word>>24)&0x0F;
+		Channel = (Word>>16)&0x0F;
+		Note = (Word>>8)&0x7F;
+		if (Transition > 0)
+		{
+			RxActiveNotes[Group][Channel][Note>>5] |= (1u<<(Note&0x1F));
+			if ((Word>>28) == 4) RxMIDI2Channels[Group] |= (1u<<Channel);
+			else RxMIDI2Channels[Group] &= ~(1u<<Channel);
+		}
+		else
+			RxActiveNotes[Group][Channel][Note>>5] &= ~(1u<<(Note&0x1F));
+	}
+}  // CNetUMPHandler::TrackRxNotes
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::ReleaseRxNotes (void)
+{
+	unsigned char Payload[MAX_UMP_COMMAND_PAYLOAD*4];
+	unsigned int PayloadLength = 0;
+	uint32_t UMP[2];
+	unsigned int Size;
+	uint32_t Bits;
+
+	if (NoteCleanup.load (std::memory_order_relaxed) == false) return;
+
+	// Note Off are given by blocks, as if they had been received in UMP Data commands (so they reach any DeliverUMPBlock)
+	for (unsigned int Group=0; Group<16; Group++)
+	{
+		for (unsigned int Channel=0; Channel<16; Channel++)
+		{
+			for (unsigned int Word=0; Word<4; Word++)
+			{
+				Bits = RxActiveNotes[Group][Channel][Word];
+				RxActiveNotes[Group][Channel][Word] = 0;
+				for (unsigned int Bit=0; (Bits != 0) && (Bit<32); Bit++)
+				{
+					if ((Bits&(1u<<Bit)) == 0) continue;
+					Bits &= ~(1u<<Bit);
+
+					Size = MakeNoteOff (&UMP[0], Group, Channel, (Word*32)+Bit, (RxMIDI2Channels[Group]&(1u<<Channel)) != 0);
+					if (PayloadLength+Size > MAX_UMP_COMMAND_PAYLOAD)
+					{
+						DeliverUMPBlock (&Payload[0], PayloadLength);
+						PayloadLength = 0;
+					}
+					for (unsigned int WordIdx=0; WordIdx<Size; WordIdx++)
+					{
+						Payload[(PayloadLength*4)] = UMP[WordIdx]>>24;
+						Payload[(PayloadLength*4)+1] = (UMP[WordIdx]>>16)&0xFF;
+						Payload[(PayloadLength*4)+2] = (UMP[WordIdx]>>8)&0xFF;
+						Payload[(PayloadLength*4)+3] = UMP[WordIdx]&0xFF;
+						PayloadLength++;
+					}
+				}
+			}
+		}
+	}
+	if (PayloadLength > 0)
+		DeliverUMPBlock (&Payload[0], PayloadLength);
+}  // CNetUMPHandler::ReleaseRxNotes
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::SendHangingNoteOffs (void)
+{
+	uint32_t UMP[2];
+	uint32_t Bits;
+
+	if (NoteCleanup.load (std::memory_order_relaxed) == false) return;
+
+	for (unsigned int Group=0; Group<16; Group++)
+	{
+		for (unsigned int Channel=0; Channel<16; Channel++)
+		{
+			for (unsigned int Word=0; Word<4; Word++)
+			{
+				Bits = TxActiveNotes[Group][Channel][Word].exchange (0, std::memory_order_relaxed);
+				for (unsigned int Bit=0; (Bits != 0) && (Bit<32); Bit++)
+				{
+					if ((Bits&(1u<<Bit)) == 0) continue;
+					Bits &= ~(1u<<Bit);
+					MakeNoteOff (&UMP[0], Group, Channel, (Word*32)+Bit, (TxMIDI2Channels[Group].load (std::memory_order_relaxed)&(1u<<Channel)) != 0);
+					QueueUMPMessage (&UMP[0]);
+				}
+			}
+		}
+	}
+}  // CNetUMPHandler::SendHangingNoteOffs
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::SetStateTracker (CNetUMPStateTracker* Tracker)
+{
+	LockRealtimeThread();
+	this->StateTracker.store (Tracker, std::memory_order_release);
+	UnlockRealtimeThread();
+}  // CNetUMPHandler::SetStateTracker
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::SendStateResync (void)
+{
+	ResyncRequested.store (true);
+}  // CNetUMPHandler::SendStateResync
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::ContinueStateResync (void)
+{
+	CNetUMPStateTracker* Tracker;
+	TNetUMPTxQueue* Queue;
+
+	Tracker = StateTracker.load (std::memory_order_acquire);
+	if (Tracker == 0)
+	{
+		ResyncPosition = NETUMP_RESYNC_IDLE;
+		return;
+	}
+
+	// A channel is only started when the voice lane can hold all messages of a channel
+	Queue = &UMP_TX_QUEUE[TX_LANE_VOICE];
+	while ((ResyncPosition < 256) &&
+		   (UMP_TX_QUEUE_SIZE-(Queue->EnqueuePos.load (std::memory_order_relaxed)-Queue->DequeuePos) >= NETUMP_RESYNC_FREE_SLOTS))
+	{
+		Tracker->ResyncRange (ResyncPosition, 1, QueueResyncMessage, this);
+		ResyncPosition++;
+	}
+	if (ResyncPosition >= 256)
+		ResyncPosition = NETUMP_RESYNC_IDLE;
+}  // CNetUMPHandler::ContinueStateResync
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::QueueResyncMessage (void* Instance, uint32_t* UMP)
+{
+	CNetUMPHandler* Handler = (CNetUMPHandler*)Instance;
+
+	if (Handler->QueueUMPMessage (UMP) == false)
+		Handler->Stats.TxResyncLost++;
+}  // CNetUMPHandler::QueueResyncMessage
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::PublishMetrics (void)
+{
+	uint32_t Sequence;
+
+	// Seqlock : sequence is odd while the slot is updated, readers retry if they see an odd or changed sequence
+	Sequence = MetricsSlot->Sequence.load (std::memory_order_relaxed);
+	MetricsSlot->Sequence.store (Sequence+1, std::memory_order_relaxed);
+	std::atomic_thread_fence (std::memory_order_release);
+
+	BuildSessionStats (&MetricsSlot->Stats);
+	MetricsSlot->UpdateTime = TimeCounter;
+
+	MetricsSlot->Sequence.store (Sequence+2, std::memory_order_release);
+}  // CNetUMPHandler::PublishMetrics
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::SelectConnectedSocketMode (bool Connected)
+{
+	LockRealtimeThread();
+	this->UseConnectedSocket = Connected;
+	UnlockRealtimeThread();
+}  // CNetUMPHandler::SelectConnectedSocketMode
+//--------------------------------------------------------------------------
+
+bool CNetUMPHandler::SelectKernelFilter (unsigned int FilterMode)
+{
+#if defined (__TARGET_LINUX__)
+	LockRealtimeThread();
+	this->KernelFilterMode = FilterMode;
+	UnlockRealtimeThread();
+	return true;
+#else
+	this->KernelFilterMode = KERNEL_FILTER_NONE;
+	return (FilterMode == KERNEL_FILTER_NONE);
+#endif
+}  // CNetUMPHandler::SelectKernelFilter
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::SetKeepaliveParameters (TNetUMPKeepaliveConfig* Config)
+{
+	LockRealtimeThread();
+	Keepalive = *Config;
+	if (Keepalive.IdleInterval == 0) Keepalive.IdleInterval = PING_IDLE_INTERVAL;
+	if (Keepalive.SuspectInterval == 0) Keepalive.SuspectInterval = PING_SUSPECT_INTERVAL;
+	if (Keepalive.SessionTimeout == 0) Keepalive.SessionTimeout = TIMEOUT_RESET;
+	if (Keepalive.MaxMissedPings == 0) Keepalive.MaxMissedPings = PING_MAX_MISSED;
+	if (Keepalive.IdleInterval > KEEPALIVE_MAX_TIME) Keepalive.IdleInterval = KEEPALIVE_MAX_TIME;
+	if (Keepalive.SuspectInterval > KEEPALIVE_MAX_TIME) Keepalive.SuspectInterval = KEEPALIVE_MAX_TIME;
+	if (Keepalive.SessionTimeout > KEEPALIVE_MAX_TIME) Keepalive.SessionTimeout = KEEPALIVE_MAX_TIME;
+	UnlockRealtimeThread();
+}  // CNetUMPHandler::SetKeepaliveParameters
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::SetReinvitationPolicy (unsigned int Policy)
+{
+	LockRealtimeThread();
+	ReinvitationPolicy = Policy;
+	UnlockRealtimeThread();
+}  // CNetUMPHandler::SetReinvitationPolicy
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::SetInvitationRetryPolicy (TNetUMPRetryPolicy* Policy)
+{
+	LockRealtimeThread();
+	RetryPolicy = *Policy;
+	if (RetryPolicy.InitialDelay == 0) RetryPolicy.InitialDelay = 1;
+	if (RetryPolicy.MaxDelay < RetryPolicy.InitialDelay) RetryPolicy.MaxDelay = RetryPolicy.InitialDelay;
+	if (RetryPolicy.BackoffPercent < 100) RetryPolicy.BackoffPercent = 100;
+	if (RetryPolicy.JitterPercent > 100) RetryPolicy.JitterPercent = 100;
+	UnlockRealtimeThread();
+}  // CNetUMPHandler::SetInvitationRetryPolicy
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::SetInvitationGiveUpCallback (void (*CallbackFunc)())
+{
+	LockRealtimeThread();
+	this->GiveUpCallback = CallbackFunc;
+	UnlockRealtimeThread();
+}  // CNetUMPHandler::SetInvitationGiveUpCallback
+//--------------------------------------------------------------------------
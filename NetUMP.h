@@ -32,12 +32,20 @@
 #ifdef __TARGET_WIN__
 #include <stdint.h>
 #endif
+#include <atomic>
+#include <mutex>
 
 #define MAX_UMP_ENDPOINT_NAME_LEN				99
 #define MAX_UMP_PRODUCT_INSTANCE_ID_LEN			43
 
 #define UMP_SIGNATURE 0x4D494449
 
+// Values returned by CNetUMPHandler::GetSessionStatus
+#define NETUMP_STATUS_CLOSED					0
+#define NETUMP_STATUS_INVITING					1
+#define NETUMP_STATUS_WAITING_INVITATION		2
+#define NETUMP_STATUS_OPENED					3
+
 // Callback type definition
 // This callback is called from realtime thread. Processing time in the callback shall be kept to a minimum
 // The function is called for each UMP packet received
@@ -53,6 +61,10 @@ typedef void (*TUMPDataCallback) (void* UserInstance, uint32_t* DataBlock);
 typedef void (CALLBACK *TUMPDataCallback) (void* UserInstance, uint32_t* DataBlock);
 #endif
 
+//! Called when a session closed by CloseSessionAsync is completely closed (from realtime thread)
+//! Acknowledged is false if partner did not answer the BYE or if no session was opened
+typedef void (*TNetUMPCloseCallback) (void* UserInstance, bool Acknowledged);
+
 //! BYE command codes
 #define BYE_UNDEFINED				0x00
 #define BYE_USER_TERMINATED			0x01
@@ -100,13 +112,108 @@ typedef void (CALLBACK *TUMPDataCallback) (void* UserInstance, uint32_t* DataBlo
 #define ERROR_CORRECTION_NONE		0
 #define ERROR_CORRECTION_FEC		1
 
-#define UMP_FIFO_SIZE	1024
+//! Keepalive parameters (all times in milliseconds, limited to KEEPALIVE_MAX_TIME)
+//! PINGs are sent only when the partner has been silent : any valid packet from the partner proves it is alive
+typedef struct {
+	unsigned int IdleInterval;			// Partner silence before a PING is sent (and interval between PINGs on a quiet link)
+	unsigned int SuspectInterval;		// Interval used when a PING is unanswered or when packet loss has been detected
+	unsigned int MaxMissedPings;		// Connection is declared lost when this number of PINGs are unanswered
+	unsigned int SessionTimeout;		// Connection is declared lost when partner is silent for this time, whatever PINGs
+} TNetUMPKeepaliveConfig;
+
+//! Longest keepalive interval or session timeout accepted by SetKeepaliveParameters (one hour)
+#define KEEPALIVE_MAX_TIME		3600000
 
+//! Invitation retry policy of a session initiator (times in milliseconds)
 typedef struct {
-	uint32_t FIFO[UMP_FIFO_SIZE];
-	unsigned int ReadPtr;
-	unsigned int WritePtr;
-} TUMP_FIFO;
+	unsigned int InitialDelay;		// Delay before first retry (and before first invitation after a session timeout)
+	unsigned int MaxDelay;			// Upper limit of the delay between two invitations
+	unsigned int BackoffPercent;	// Delay is multiplied by BackoffPercent/100 after each unanswered invitation (100 : fixed delay)
+	unsigned int JitterPercent;		// Each delay is randomized by +/- JitterPercent, so devices restarted together do not invite together
+	unsigned int MaxAttempts;		// Invitations sent before giving up (0 : never give up)
+} TNetUMPRetryPolicy;
+
+//! Transmit rate limit of a session (token buckets refilled every millisecond)
+typedef struct {
+	unsigned int WordsPerSecond;		// UMP words sent per second, FEC copies not counted (0 : no limit)
+	unsigned int DatagramsPerSecond;	// UMP Data datagrams sent per second (0 : no limit)
+	unsigned int BurstWords;			// Words that can be sent at once after an idle period (minimum 5, 0 : 64)
+	unsigned int BurstDatagrams;		// Datagrams that can be sent in a row after an idle period (0 : 1)
+} TNetUMPRateLimit;
+
+//! Policy of a session listener receiving an invitation while its session is opened
+#define REINVITATION_IGNORE			0		// Invitation is ignored, session is only restarted after timeout
+#define REINVITATION_FROM_PARTNER	1		// Invitation from partner IP address (any UDP port) restarts the session immediately
+#define REINVITATION_FROM_ANY		2		// Any invitation restarts the session (a new device takes over the session)
+
+//! Kernel filter modes (Linux only)
+#define KERNEL_FILTER_NONE			0		// All datagrams are delivered to the handler
+#define KERNEL_FILTER_SIGNATURE		1		// Datagrams without NetUMP signature are dropped by the kernel
+#define KERNEL_FILTER_PARTNER		2		// Same as KERNEL_FILTER_SIGNATURE, plus datagrams not coming from partner are dropped while session is opened
+
+//! Number of messages in each transmit queue (must be a power of 2)
+#define UMP_TX_QUEUE_SIZE	1024
+
+//! Transmit lanes (one queue per lane), emptied in strict priority order when a UMP Data command is generated
+#define TX_LANE_REALTIME	0		// System messages (MT=1) : clock, start/stop, song position...
+#define TX_LANE_VOICE		1		// Utility messages (MT=0) and channel voice messages (MT=2 and MT=4)
+#define TX_LANE_BULK		2		// SysEx and data messages (MT=3 and MT=5), flex data, UMP stream and other message types
+#define NUM_TX_LANES		3
+
+//! Transmit queue slot. Sequence tells if the slot is free for producers or ready for the consumer
+typedef struct {
+	std::atomic<unsigned int> Sequence;
+	uint32_t Size;			// Number of 32-bit words in UMP
+	uint32_t UMP[5];		// Message, preceded by its JR Timestamp / Delta Clockstamp if the application sent one
+} TNetUMPTxSlot;
+
+//! Bounded lock-free queue of UMP messages : multiple producers (application threads), single consumer (realtime thread)
+typedef struct {
+	TNetUMPTxSlot Slots[UMP_TX_QUEUE_SIZE];
+	std::atomic<unsigned int> EnqueuePos;		// Next position to be reserved by a producer
+	uint8_t Padding[60];						// Keep producers and consumer positions on different cache lines
+	unsigned int DequeuePos;					// Next position to be read by the consumer
+} TNetUMPTxQueue;
+
+//! Number of entries of the transmit coalescing table (must be a power of 2)
+#define NETUMP_COALESCE_SLOTS	256
+
+//! Coalescing table entry : queued messages of one controller between First and Newest positions of the voice lane
+typedef struct {
+	uint32_t Key;			// First word of the messages without the value (0 : entry is free)
+	unsigned int First;		// Oldest queued message not sent yet : it will carry the value of Newest
+	unsigned int Newest;	// Most recent message of the controller found in the queue
+} TNetUMPCoalesceSlot;
+
+//! Number of messages in the receive queue (must be a power of 2)
+#define UMP_RX_QUEUE_SIZE	1024
+
+//! One UMP message received from network (receive queue mode)
+typedef struct {
+	uint32_t Timestamp;		// Handler millisecond counter when the message has been received
+	uint32_t Size;			// Number of 32-bit words in UMP
+	uint32_t UMP[4];
+} TNetUMPRxMessage;
+
+//! Maximum number of rules in the receive filter (rule matches are evaluated as a 32 bits mask)
+#define NETUMP_MAX_FILTER_RULES		32
+
+//! Receive filter actions
+#define NETUMP_FILTER_ACCEPT		0		// Message is given to the application
+#define NETUMP_FILTER_DROP			1		// Message is discarded before the callback / receive queue
+
+//! Receive filter rule. A message matches the rule when all fields match. The first matching rule decides
+typedef struct {
+	uint16_t MTMask;			// Bit N : message type N
+	uint16_t GroupMask;			// Bit N : group N (not checked for MT=0 and MT=F, which have no group)
+	uint16_t ChannelMask;		// Bit N : channel N (only checked for channel voice messages, MT=2 and MT=4)
+	uint8_t Status;				// Status byte (second byte of the message : opcode and channel for channel voice messages,
+	uint8_t StatusMask;			// status for system messages) matches when (Byte & StatusMask) == Status. StatusMask = 0 : any
+	uint8_t NoteLow;			// Note range, for messages carrying a note number (note on/off, poly pressure, per-note
+	uint8_t NoteHigh;			// controllers and management). A rule with a range smaller than 0-127 never matches other messages
+	uint8_t Action;				// NETUMP_FILTER_XXX
+	uint8_t Reserved;
+} TNetUMPFilterRule;
 
 //! Number of packets recorded in Forward Error Correction register
 #define NUM_FEC_ENTRIES		5
@@ -118,6 +225,22 @@ typedef struct {
 	uint32_t Packet[65];		// 64 UMP words plus header - Binary copy of a sent packet
 } TFEC_REGISTER;
 
+//! Size of reception buffer. Largest datagram sent by the handler is 1304 bytes (signature + FEC copies + new UMP Data command)
+#define NETUMP_MAX_DATAGRAM_SIZE	2048
+
+//! Maximum length in 32-bit words of a transmitted datagram : signature, then up to NUM_FEC_ENTRIES UMP Data commands of 64 words + header
+#define NETUMP_MAX_DATAGRAM_WORDS	(1+(NUM_FEC_ENTRIES*65))
+
+//! Maximum number of NetUMP commands in a received datagram (each command is at least 32 bits long)
+#define MAX_COMMANDS_PER_DATAGRAM	((NETUMP_MAX_DATAGRAM_SIZE-4)/4)
+
+//! Descriptor of one NetUMP command found in a validated datagram
+typedef struct {
+	uint8_t CommandCode;
+	uint8_t PayloadLength;		// Payload length in 32-bit words (command header not included)
+	uint16_t Offset;			// Position of command header in datagram
+} TNetUMPCommandDescriptor;
+
 #pragma pack (push, 1)
 
 typedef struct {
@@ -126,7 +249,7 @@ typedef struct {
 	uint8_t PayloadLength;	// 2..36
 	uint8_t CSD1;			// Length in 32-bit words of UMP Endpoint Name
 	uint8_t CSD2;			// Capabilities bitmap D0 : Client supports sending Invitation with Authentication, D1 : Client supports sending Invitation with User Authentication
-	uint8_t EPName_PIID[MAX_UMP_ENDPOINT_NAME_LEN + MAX_UMP_PRODUCT_INSTANCE_ID_LEN];
+	uint8_t EPName_PIID[MAX_UMP_ENDPOINT_NAME_LEN + MAX_UMP_PRODUCT_INSTANCE_ID_LEN + 2];		// +2 : both strings are padded to a word boundary
 } TUMP_INVITATION_PACKET;
 
 typedef struct {
@@ -135,7 +258,7 @@ typedef struct {
 	uint8_t PayloadLength;
 	uint8_t CSD1;			// Length in 32-bit words of UMP Endpoint Name
 	uint8_t CSD2;			// Reserved
-	uint8_t EPName_PIID[MAX_UMP_ENDPOINT_NAME_LEN + MAX_UMP_PRODUCT_INSTANCE_ID_LEN];
+	uint8_t EPName_PIID[MAX_UMP_ENDPOINT_NAME_LEN + MAX_UMP_PRODUCT_INSTANCE_ID_LEN + 2];		// +2 : both strings are padded to a word boundary
 } TUMP_INVITATION_ACCEPTED_PACKET;
 
 //! The same packet is used for the Session Reset Reply
@@ -195,11 +318,107 @@ typedef struct {
 
 #pragma pack (pop)
 
+//! Number of buckets in session histograms. Bucket N counts values from 2^(N-1) to 2^N-1 (bucket 0 counts value 0)
+#define NETUMP_HISTOGRAM_BUCKETS	16
+
+//! Session counters. All counters are cumulated since handler creation
+typedef struct {
+	uint32_t SessionStatus;				// Same value as GetSessionStatus()
+	uint32_t PartnerIP;					// Current session partner (0 if none)
+	uint32_t PartnerPort;
+	uint32_t Reserved;
+	uint64_t TxDatagrams;
+	uint64_t TxBytes;
+	uint64_t TxUMPCommands;				// UMP Data commands generated (without FEC copies)
+	uint64_t TxUMPWords;				// UMP words sent (without FEC copies)
+	uint64_t TxQueueFull;				// Messages rejected by SendUMPMessage because FIFO is full
+	uint64_t RxQueueFull;				// Messages lost because application did not empty the receive queue
+	uint64_t TxThrottledTicks;			// RunSession calls where messages were kept in transmit queue by the rate limit
+	uint64_t TxCoalescedMessages;		// Controller messages removed from transmit queue because a newer value was queued
+	uint64_t TxResyncLost;				// State resync messages lost because the transmit queue was full
+	uint64_t RxDatagrams;
+	uint64_t RxBytes;
+	uint64_t RxInvalidDatagrams;		// Datagrams without NetUMP signature or malformed (rejected as a whole)
+	uint64_t RxUMPCommands;				// New UMP Data commands received
+	uint64_t RxUMPMessages;				// UMP messages delivered to application
+	uint64_t RxDuplicateCommands;		// UMP Data commands already received (FEC copies)
+	uint64_t RxLostCommands;			// UMP Data commands missing in sequence (not recovered by FEC)
+	uint64_t InvitationsSent;
+	uint64_t PingsSent;
+	uint64_t PingsReceived;
+	uint64_t PingRepliesReceived;
+	uint64_t BYESent;
+	uint64_t BYEReceived;
+	uint64_t Connections;				// Number of times the session has been opened
+	uint64_t ConnectionsLost;			// Number of times the session has been closed by timeout or by partner
+	uint64_t RxInterArrivalHistogram[NETUMP_HISTOGRAM_BUCKETS];		// Milliseconds between two datagrams from session partner
+	uint64_t TxQueueDepthHistogram[NETUMP_HISTOGRAM_BUCKETS];		// Messages waiting in transmit queue when a UMP Data command is generated
+} TNetUMPSessionStats;
+
+struct TNetUMPMetricsSlot;
+class CNetUMPRecorder;
+class CNetUMPStateTracker;
+
+//! Number of 32-bit words of a UMP message, given by Message Type of its first word
+inline unsigned int NetUMPMessageSize (uint32_t FirstWord)
+{
+	static const unsigned char MessageSizes [16] = {1, 1, 1, 2, 2, 4, 1, 1, 2, 2, 2, 3, 3, 4, 4, 4};
+	return MessageSizes[FirstWord>>28];
+}  // NetUMPMessageSize
+
+//! Decode the payload of a validated UMP Data command (big endian words, no message cut) and call Deliver (UMP, Size) for each message
+//! \return number of messages decoded
+template <class TDeliver> inline unsigned int NetUMPDecodeBlock (const unsigned char* Payload, unsigned int PayloadLength, TDeliver& Deliver)
+{
+	uint32_t UMPMsg[4];
+	unsigned int WordCounter = 0;
+	unsigned int MessageSize;
+	unsigned int Messages = 0;
+
+	while (WordCounter < PayloadLength)
+	{
+		UMPMsg[0] = ((uint32_t)Payload[0]<<24)|((uint32_t)Payload[1]<<16)|((uint32_t)Payload[2]<<8)|Payload[3];
+		MessageSize = NetUMPMessageSize (UMPMsg[0]);
+		for (unsigned int WordIdx=1; WordIdx<MessageSize; WordIdx++)
+		{
+			const unsigned char* Word = Payload+(WordIdx*4);
+			UMPMsg[WordIdx] = ((uint32_t)Word[0]<<24)|((uint32_t)Word[1]<<16)|((uint32_t)Word[2]<<8)|Word[3];
+		}
+		Payload += MessageSize*4;
+		WordCounter += MessageSize;
+
+		Deliver (&UMPMsg[0], MessageSize);
+		Messages++;
+	}
+	return Messages;
+}  // NetUMPDecodeBlock
+
+//! Interface for a layer placed between the handler and the UDP socket (test / simulation purpose)
+//! When a shim is declared, all datagrams sent and received by the handler go through it
+//! Methods are called from the realtime thread
+class CNetUMPPacketShim
+{
+public:
+	virtual ~CNetUMPPacketShim (void) {}
+
+	//! Called at the beginning of each RunSession call (1 ms tick)
+	virtual void Tick (TSOCKTYPE Socket) = 0;
+
+	//! Replaces sendto() for all datagrams sent by the handler
+	//! Destination is 0 when the socket is connected to the session partner (send() shall be used)
+	//! \return number of bytes sent (or accepted by the shim), negative value on error
+	virtual int SendTo (TSOCKTYPE Socket, const char* Data, int Size, const sockaddr_in* Destination) = 0;
+
+	//! Replaces recvfrom() for all datagrams read by the handler. Called only when data is available on socket
+	//! Source is 0 when the socket is connected to the session partner (recv() shall be used)
+	virtual int RecvFrom (TSOCKTYPE Socket, char* Buffer, int Size, sockaddr_in* Source) = 0;
+};
+
 class CNetUMPHandler
 {
 public:
 	CNetUMPHandler (TUMPDataCallback CallbackFunc, void* UserInstance);
-	~CNetUMPHandler (void);
+	virtual ~CNetUMPHandler (void);
 
 	//! Record a session name. Shall be called before InitiateSession.
 	//! Note that session name is mandatory, so Name shall not be empty. Length is limited to 98 bytes
@@ -216,9 +435,20 @@ public:
 						bool IsInitiator);
 
 	//! Terminate active NetUMP session if it exists
+	//! The calling thread is blocked during 50ms to let the BYE message leave before the socket is closed
 	void CloseSession(void);
 
+	//! Request termination of the NetUMP session without blocking the calling thread
+	//! The BYE is sent by RunSession and repeated until partner answers (or after a few attempts), then CallbackFunc is called
+	//! RunSession must be called until the callback has been called. CallbackFunc can be 0
+	//! Returns false (and CallbackFunc will not be called) if a close requested by a previous call is still in progress :
+	//! only the callback of the first call is called when that close completes
+	bool CloseSessionAsync(TNetUMPCloseCallback CallbackFunc, void* UserInstance);
+
 	//! Main processing function to call from high priority thread (audio or multimedia timer) every millisecond
+	//! Configuration methods can be called from any thread while RunSession runs : they wait for the current
+	//! RunSession call to end (never more than one call) and keep the realtime thread out while the handler is modified
+	//! Concurrent configuration methods called from different threads are serialized
 	void RunSession(void);
 
 	//! Restarts session process after it has been closed by a remote partner
@@ -226,9 +456,10 @@ public:
 
 	//! Returns the session status
 	/*!
-	0 : session is closed
-	1 : inviting remote node
-	3 : session opened (MIDI data can be exchanged)
+	NETUMP_STATUS_CLOSED (0) : session is closed
+	NETUMP_STATUS_INVITING (1) : inviting remote node
+	NETUMP_STATUS_WAITING_INVITATION (2) : waiting to be invited by remote node
+	NETUMP_STATUS_OPENED (3) : session opened (MIDI data can be exchanged)
 	*/
 	int GetSessionStatus (void);
 
@@ -241,8 +472,42 @@ public:
 	bool RemotePeerClosedSession (void);
 
 	//! Put a next message to be sent in the transmission queue
+	//! Message is stored in the transmit lane matching its MT (see TX_LANE_XXX) : system realtime messages
+	//! overtake channel voice messages, which overtake SysEx. Order is kept between messages of the same lane
+	//! A JR Timestamp or Delta Clockstamp (MT=0) is kept until the next message sent by the same thread to this
+	//! handler, and both are queued together in the lane of that message
+	//! Can be called from several threads at the same time (no lock is taken)
+	//! \return false if session is not opened or if the queue is full
 	bool SendUMPMessage (uint32_t* UMPData);
 
+	//! Reserve BulkWords (0 to 64) in each UMP Data command for the bulk lane, so SysEx is not blocked
+	//! by a continuous flow of channel voice messages (realtime lane is never limited). Default is 0 (strict priority)
+	void SetBulkLaneReservation (unsigned int BulkWords);
+
+	//! Set keepalive parameters (can be called at any time, applies to next PING decision). Fields set to 0 take their default value
+	void SetKeepaliveParameters (TNetUMPKeepaliveConfig* Config);
+
+	//! Set invitation retry policy of a session initiator (applies to next invitation delay)
+	void SetInvitationRetryPolicy (TNetUMPRetryPolicy* Policy);
+
+	//! Declares callback called when the session initiator stops inviting after MaxAttempts unanswered invitations
+	//! Session is then closed (call RestartSessionInitiator to invite again)
+	void SetInvitationGiveUpCallback (void (*CallbackFunc)());
+
+	//! Limit the transmit rate of the session (Limit = 0 removes the limit). Messages exceeding the rate stay
+	//! in the transmit queues and are sent in next UMP Data commands, so the receiver gets a smooth flow
+	void SetTransmitRateLimit (TNetUMPRateLimit* Limit);
+
+	//! Last value wins for continuous controllers when the transmit queue is congested (Threshold = 0 : disabled, default)
+	//! When more than Threshold messages wait in the voice lane, queued values of the same controller (CC, pitch bend,
+	//! channel pressure, MIDI 2.0 registered / assignable controllers, per group and channel) are merged : the oldest
+	//! message takes the newest value and the other ones are removed. Switch, bank, data entry and mode controllers are never merged
+	void SetTransmitCoalescing (unsigned int Threshold);
+
+	//! Select what a session listener does when it is invited while its session is opened (see REINVITATION_XXX)
+	//! Default is REINVITATION_FROM_PARTNER, so a rebooted partner reconnects without waiting for the session timeout
+	void SetReinvitationPolicy (unsigned int Policy);
+
 	//! Select error correction method on transmit - 0 : no error correction (no FEC) / 1 : Forward Error Correction (add older packets before latest UMP data)
 	void SelectErrorCorrectionMode (unsigned int CorrectionMethod);
 
@@ -255,12 +520,106 @@ public:
 	//! Declares callback for disconnection event
 	void SetDisconnectCallback(void (*CallbackFunc)());
 
+	//! Returns a copy of the session counters
+	//! Can be called from any thread : the copy is the snapshot published by the last RunSession call
+	void GetSessionStats (TNetUMPSessionStats* Stats);
+
+	//! Publish session counters in a shared memory slot (see NetUMP_MetricsExport.h). Slot = 0 to stop publication
+	//! \param PublishInterval number of milliseconds between two updates of the slot
+	// Do not call on activated handler (must be called before InitiateSession is called)
+	void SetMetricsSlot (TNetUMPMetricsSlot* Slot, unsigned int PublishInterval);
+
+	//! Record received UMP messages and session events in a recording file (see NetUMP_Recorder.h). Recorder = 0 to stop
+	//! \param Source number stored with each record to identify the handler when several handlers use the same recorder (0..255)
+	//! Returns false (and previous recorder is kept) if Source is higher than 255 (NETUMP_RECORD_MAX_SOURCE)
+	bool SetRecorder (CNetUMPRecorder* Recorder, unsigned int Source);
+
+	//! Keep the state of each channel (see NetUMP_StateTracker.h) from the messages given to SendUMPMessage. Tracker = 0 to stop
+	//! Each time the session opens, the messages restoring this state are queued (see SendStateResync)
+	//! The tracker can be deleted only after it has been detached and while no thread calls SendUMPMessage
+	void SetStateTracker (CNetUMPStateTracker* Tracker);
+
+	//! Queue the messages restoring the state kept by the state tracker (if one is declared)
+	//! Messages are queued by RunSession over the next milliseconds, a few channels at a time, as the voice lane empties
+	//! Messages lost anyway (queue filled by the application) are counted in TxResyncLost
+	void SendStateResync (void);
+
+	//! Track the notes played in both directions, so notes are not left hanging when the session is interrupted
+	//! When the partner disappears (timeout, BYE, new invitation), resets the session or when the session is closed,
+	//! a Note Off is given to the application (callback or receive queue) for each note it has received and not released,
+	//! and a Note Off is sent for each note played by the application when the session opens again. Default is false
+	//! With CloseSession, the Note Off messages are given from the thread calling CloseSession
+	void SelectNoteCleanupMode (bool Enable);
+
+	//! Connects the UDP socket to the session partner while the session is opened
+	//! The kernel then filters datagrams from other senders : a session listener with an opened session
+	//! does not see (and does not reject) invitations from other devices anymore
+	void SelectConnectedSocketMode (bool Connected);
+
+	//! Attach a classic BPF program to the UDP socket, so unwanted datagrams are dropped before reaching the realtime thread
+	//! See KERNEL_FILTER_XXX. In KERNEL_FILTER_PARTNER mode, invitations from other devices are not seen while session is opened
+	// Do not call on activated handler (must be called before InitiateSession is called)
+	//! \return false if kernel filtering is not supported on the target
+	bool SelectKernelFilter (unsigned int FilterMode);
+
+	//! Select how received UMP messages are given to the application
+	//! false (default) : UMP callback is called from the realtime thread for each message
+	//! true : messages are timestamped and stored in a lock-free queue, read by the application with ReadUMPMessages
+	// Do not call on activated handler (must be called before InitiateSession is called)
+	void SelectReceiveQueueMode (bool UseQueue);
+
+	//! Reads up to MaxMessages messages from the receive queue (from a single application thread)
+	//! \return number of messages copied in Messages
+	unsigned int ReadUMPMessages (TNetUMPRxMessage* Messages, unsigned int MaxMessages);
+
+	//! Returns a file descriptor becoming readable when messages are stored in the receive queue (Linux only, -1 otherwise)
+	//! The application shall read the descriptor (to clear it) before emptying the queue with ReadUMPMessages
+	int GetReceiveEventHandle (void);
+
+	//! Install a receive filter, applied to new UMP Data commands before messages are given to the application
+	//! Rules are compiled into lookup tables, so the cost per message does not depend on the number of rules
+	//! \param DefaultAction action for messages matching no rule (NETUMP_FILTER_XXX). NumRules = 0 removes the filter
+	//! \return false if there are more than NETUMP_MAX_FILTER_RULES rules
+	bool SetReceiveFilter (const TNetUMPFilterRule* Rules, unsigned int NumRules, unsigned int DefaultAction);
+
+	//! Copy the number of messages decided by each rule (Counters[NumRules] counts messages matching no rule)
+	//! Counters shall hold NumRules+1 values. Counters are reset by SetReceiveFilter
+	//! \return number of rules of the filter
+	unsigned int GetReceiveFilterCounters (uint64_t* Counters);
+
+	//! Inserts a packet shim between the handler and the UDP socket (0 to remove it)
+	// Do not call on activated handler (must be called before InitiateSession is called)
+	void SetPacketShim (CNetUMPPacketShim* Shim);
+
+protected:
+	//! Called once for each new UMP Data command received from partner (FEC copies and duplicates have been removed)
+	//! Payload points to PayloadLength big endian words, already validated (no message is cut)
+	//! Default implementation gives each message to the UMP callback, or stores it in the receive queue
+	//! See NetUMP_HandlerT.h for a variant where messages are given to an inlined sink
+	//! \return number of UMP messages delivered
+	virtual unsigned int DeliverUMPBlock (const unsigned char* Payload, unsigned int PayloadLength);
+
 private:
 	// Callback data
 	TUMPDataCallback UMPCallback;	// Callback for incoming RTP-MIDI message
 	void* ClientInstance;
-	TUMP_FIFO UMP_FIFO_TO_NET;
-	TUMP_FIFO UMP_FIFO_FROM_NET;
+	TNetUMPTxQueue UMP_TX_QUEUE[NUM_TX_LANES];		// One queue per transmit lane (see TX_LANE_XXX)
+	unsigned int TxBulkReservedWords;			// Words of each UMP Data command kept for bulk lane when it has messages waiting
+	TNetUMPRateLimit RateLimit;
+	unsigned int WordTokens;					// Word bucket, in 1/1000 of word (WordsPerSecond is added every millisecond)
+	unsigned int DatagramTokens;				// Datagram bucket, in 1/1000 of datagram
+	std::atomic<uint64_t> TxQueueRejected;		// Messages rejected by SendUMPMessage (counted by producer threads)
+	unsigned int CoalesceThreshold;				// Voice lane depth above which controllers are merged (0 : disabled)
+	unsigned int CoalesceScanPos;				// Voice lane position up to which queued messages are in CoalesceTable
+	TNetUMPCoalesceSlot CoalesceTable[NETUMP_COALESCE_SLOTS];
+
+	// Receive queue (single producer : realtime thread, single consumer : application thread)
+	bool UseReceiveQueue;
+	TNetUMPRxMessage RxQueue[UMP_RX_QUEUE_SIZE];
+	std::atomic<unsigned int> RxQueueWritePtr;
+	std::atomic<unsigned int> RxQueueReadPtr;
+	bool RxQueueSignal;				// Messages have been stored during current RunSession call
+	int RxEventHandle;				// eventfd signalled when messages are stored (-1 if not used)
 
 	unsigned char EndpointName [MAX_UMP_ENDPOINT_NAME_LEN];
 	unsigned char ProductInstanceID[MAX_UMP_PRODUCT_INSTANCE_ID_LEN];
@@ -269,41 +628,166 @@ private:
 	unsigned short RemoteUDPPort;	// Port number or remote partner to invite (0 if module is used as session listener)
 	unsigned short LocalUDPPort;	// Local port number
 	bool IsInitiatorNode;			// Handler will invite the remote device
+	unsigned int ReinvitationPolicy;	// See REINVITATION_XXX
 
-	bool SocketLocked;				// Blocks access to socket from realtime thread if socket is being modified
+	std::atomic<bool> SocketLocked;			// Blocks access to handler from realtime thread while no socket is ready
+	std::atomic<unsigned int> ConfigLocks;	// Number of LockRealtimeThread calls in progress (realtime thread is out while not 0)
+	std::recursive_mutex ConfigMutex;		// Serializes configuration methods called from control threads
+	std::atomic<unsigned int> RunEpoch;		// Incremented when RunSession starts and ends (odd while realtime thread is working)
 
 	uint16_t UMPSequenceCounter;	// Incremented each time a UMP packet is sent
-	uint16_t LastReceivedUMPCounter;	// Updated by incoming UMP packet (used to detect lost packet)
-	unsigned int PINGDelayCounter;		// Millisecond counter to know how much time elapsed since the last transmitted packet
+	unsigned int PINGDelayCounter;		// Millisecond counter to know how much time elapsed since the last transmitted PING
 	unsigned int PINGIdCounter;		// To generate a new ID each time a PING is sent
+	unsigned int PINGsOutstanding;	// Number of PINGs sent since partner has been heard for the last time
+	bool LossSuspected;				// Lost UMP Data commands detected since last answered PING
+	bool PartnerJoined;				// Partner has sent something else than an invitation since session opened
+	TNetUMPKeepaliveConfig Keepalive;
 
 	TSOCKTYPE UMPSocket;
-	int SessionState;
+	std::atomic<int> SessionState;
 	unsigned int SessionPartnerIP;              // IP address of session partner (only valid if session is opened)
 	unsigned short SessionPartnerPort;			// Remote partner UDP port (0 if handler is used as a session listener)
-
-	bool ConnectionLost;				// Set to 1 when connection is lost after a session has opened successfully
-	bool PeerClosedSession;				// Set to 1 when we receive a BY message on a opened session
+	sockaddr_in PartnerAddress;					// SessionPartnerIP / SessionPartnerPort ready for sendto()
+	bool UseConnectedSocket;					// Connect socket to partner when session opens
+	bool SocketConnected;						// Socket is currently connected to session partner
+	unsigned int KernelFilterMode;				// See KERNEL_FILTER_XXX
+
+	// Session commands are prepared once (when names are declared or session is initiated) and only patched when sent
+	TUMP_INVITATION_PACKET InvitationTemplate;
+	TUMP_INVITATION_ACCEPTED_PACKET InvitationAcceptedTemplate;
+	int InvitationTemplateSize;					// Size in bytes of Invitation and Invitation Accepted packets
+	TUMP_BYE_PACKET BYETemplate;
+	TUMP_BYE_REPLY_PACKET BYEReplyTemplate;
+	TUMP_PING_PACKET PingTemplate;
+	TUMP_PING_REPLY_PACKET PingReplyTemplate;
+
+	std::atomic<bool> ConnectionLost;		// Set to 1 when connection is lost after a session has opened successfully
+	std::atomic<bool> PeerClosedSession;	// Set to 1 when we receive a BY message on a opened session
 
 	unsigned int InviteCount;		// Number of invitation messages sent
-	int TimeOutRemote;				// Counter to detect loss of remote node (reset when PING is received)
+	std::atomic<bool> CloseRequested;	// Set by CloseSessionAsync under LockRealtimeThread, consumed by RunSession
+	unsigned int BYEAttempts;		// Number of BYE sent while closing session
+	TNetUMPCloseCallback CloseCallback;
+	void* CloseInstance;
+	TNetUMPRetryPolicy RetryPolicy;
+	unsigned int InviteDelay;		// Delay before next invitation, before jitter is applied
+	uint32_t JitterRandom;			// Pseudo-random generator state for invitation jitter
+	unsigned int TimeOutRemote;		// Counter to detect loss of remote node (reset when any packet is received from partner)
 
 	bool TimerRunning;				// Event timer is running
 	bool TimerEvent;				// Event is signalled
 	unsigned int EventTime;		// System time to which event will be signalled
-	unsigned int TimeCounter;		// Counter in 100us used for clock synchronization
+	unsigned int TimeCounter;		// Counter in milliseconds (incremented by each RunSession call)
+	unsigned int LastPartnerRxTime;	// Value of TimeCounter when last datagram has been received from session partner
 
 	TFEC_REGISTER FECMemory[NUM_FEC_ENTRIES];		// Storage for the last send UMP Command Packets, used as round-robin
 	unsigned int NextFECSlot;						// Pointer for the round-robin FEC
 	unsigned int ErrorCorrectionMode;				// See ERROR_CORRECTION_XXX consts
-	uint16_t ReceivedSequenceCounters[NUM_FEC_ENTRIES];				// List of the last received counters to detect incoming packet loss
+	uint16_t HighestRxSequence;						// Most recent sequence number received from partner
+	uint64_t RxSequenceWindow;						// Bit N set if HighestRxSequence-N has been received (0 : nothing received yet)
 
 	void (*ConnectionCallback)(const char* EndpointName, unsigned int size);
 	void (*DisconnectCallback)();
+	void (*GiveUpCallback)();
+
+	CNetUMPPacketShim* PacketShim;		// Optional layer between handler and socket (0 if not used)
+
+	TNetUMPSessionStats Stats;				// Updated by realtime thread only
+	std::atomic<uint32_t> StatsSnapshotSequence;	// Seqlock counter of StatsSnapshot (odd while snapshot is being updated)
+	TNetUMPSessionStats StatsSnapshot;		// Copy of counters published at each RunSession call for GetSessionStats
+	TNetUMPMetricsSlot* MetricsSlot;		// Shared memory slot (0 if metrics are not published)
+	unsigned int MetricsPublishInterval;
+	unsigned int MetricsPublishCounter;
+
+	CNetUMPRecorder* Recorder;			// Recording of received messages (0 if not used)
+	unsigned int RecorderSource;
+
+	// Receive filter, compiled by SetReceiveFilter (realtime thread only reads it)
+	bool FilterActive;
+	unsigned int FilterNumRules;
+	uint32_t FilterTypeTable[256];			// Rules matching first byte of message (MT and group)
+	uint32_t FilterStatusTable[16][256];	// Rules matching second byte of message, per MT
+	uint32_t FilterNoteTable[128];			// Rules matching note number
+	uint32_t FilterAnyNoteRules;			// Rules without note range (the only ones matching messages without note)
+	uint32_t FilterDropRules;				// Rules discarding the messages
+	bool FilterDefaultDrop;
+	uint64_t FilterCounters[NETUMP_MAX_FILTER_RULES+1];
+
+	// Active notes per group / channel, bit N set while note N is on (used when NoteCleanup is set)
+	std::atomic<bool> NoteCleanup;
+	uint32_t RxActiveNotes[16][16][4];					// Notes received from partner (realtime thread)
+	uint16_t RxMIDI2Channels[16];						// Bit N set if last note of channel N was received as MT=4
+	std::atomic<uint32_t> TxActiveNotes[16][16][4];		// Notes sent to partner (producer threads)
+	std::atomic<uint32_t> TxMIDI2Channels[16];			// Bit N set if last note of channel N was sent as MT=4
+
+	std::atomic<CNetUMPStateTracker*> StateTracker;	// Channel state resent when session opens (0 if not used). Read by producer threads
+	unsigned int ResyncPosition;				// Next channel (Group*16+Channel) to be resent, NETUMP_RESYNC_IDLE if no resync is in progress
+	std::atomic<bool> ResyncRequested;			// Set by SendStateResync, resync is started by realtime thread
+
+	//! Adds a session event (NETUMP_EVENT_XXX) to the recording, if a recorder is declared
+	void RecordSessionEvent (unsigned int Event);
+
+	//! Puts a message in the transmit lane matching its MT (no state tracking)
+	bool QueueUMPMessage (uint32_t* UMPData);
+
+	//! Gives messages rebuilt by the state tracker to the transmit queues (Instance is the handler)
+	static void QueueResyncMessage (void* Instance, uint32_t* UMP);
+
+	//! Queue the next channels of the state resync in progress while the voice lane has room (realtime thread)
+	void ContinueStateResync (void);
+
+	//! Removes the messages discarded by the receive filter from a UMP Data command payload (big endian words)
+	//! \return new payload length in 32-bit words
+	unsigned int FilterUMPBlock (unsigned char* Payload, unsigned int PayloadLength);
+
+	//! Update the active notes sent to partner with a message given to the transmit queues
+	void TrackTxNote (uint32_t* UMPData);
+
+	//! Update the active notes received from partner with the messages of a UMP Data command (big endian words)
+	void TrackRxNotes (const unsigned char* Payload, unsigned int PayloadLength);
+
+	//! Give the application a Note Off for each note received and not released (realtime thread)
+	void ReleaseRxNotes (void);
+
+	//! Queue a Note Off for each note sent to partner and not released
+	void SendHangingNoteOffs (void);
 
-	//! Release UDP sockets used by the handler
+	//! Release UDP sockets used by the handler. Realtime thread is left locked out of the handler
 	void CloseSockets(void);
 
+	//! Prevents the realtime thread from processing the handler and waits for the RunSession call in progress (if any)
+	//! Calls from other control threads wait until UnlockRealtimeThread. Can be nested and called from the handler callbacks
+	void LockRealtimeThread (void);
+
+	//! Allow realtime thread to process the handler again once every LockRealtimeThread call has been released
+	void UnlockRealtimeThread (void);
+
+	//! Session processing done by RunSession when the handler is not locked
+	void ProcessSession (void);
+
+	//! Sends a datagram on the UMP socket (through the packet shim if one is declared)
+	void TransmitDatagram (const void* Data, int Size, const sockaddr_in* Destination);
+	void TransmitDatagram (const void* Data, int Size, unsigned int DestinationIP, unsigned short DestinationPort);
+
+	//! Connect UDP socket to session partner (Connect = true) or dissolve the association (Connect = false)
+	void ConnectSocketToPartner (bool Connect);
+
+	//! Attach kernel filter matching KernelFilterMode to the socket. PartnerOnly restricts to session partner
+	void AttachKernelFilter (bool PartnerOnly);
+
+	//! Called when session opens (Lock = true) or closes (Lock = false) to restrict socket to session partner
+	//! (connected socket and/or kernel filter, depending on selected options)
+	void LockSocketToPartner (bool Lock);
+
+	//! Record session partner address (and prepare the socket address used to send to it)
+	void SetSessionPartner (unsigned int PartnerIP, unsigned short PartnerPort);
+
+	//! Build the session command packets from endpoint name and product instance ID
+	void PrepareSessionTemplates (void);
+
+	//! Reads a datagram from the UMP socket (through the packet shim if one is declared)
+	int ReceiveDatagram (unsigned char* Buffer, int Size, sockaddr_in* Source);
+
 	//! Sends NetUMP invitation (simple invitation, no authentication)
 	//! Invitation is sent to declared partner
 	void SendInvitationCommand (void);
@@ -323,19 +807,64 @@ private:
 	//! Send UMP PING REPLY command
 	void SendPINGReplyCommand (uint32_t PINGId);
 
+	//! Start sending invitations to partner. First invitation is sent after FirstDelay
+	void StartInvitations (unsigned int FirstDelay);
+
+	//! Ends an asynchronous session close and reports it to the application
+	void CompleteClose (bool Acknowledged);
+
+	//! Returns Delay randomized by the retry policy jitter
+	unsigned int JitteredDelay (unsigned int Delay);
+
 	//! Arms timer (internal timer event will be activated after TimeToWait has elapsed
 	//! \param TimeToWait number of milliseconds to wait after this method is called until event is signalled
 	void PrepareTimerEvent (unsigned int TimeToWait);
 
+	//! Add the voice lane messages queued since last scan to the coalescing table (realtime thread)
+	void ScanCoalescing (void);
+
+	//! Returns the slot whose content shall be sent for the voice lane message at DequeuePos (the newest value
+	//! of the controller), or 0 if the message has been merged in an older one and shall be removed
+	TNetUMPTxSlot* GetCoalescedMessage (TNetUMPTxSlot* Slot);
+
 	//! Prepare a UMP Command Block to be sent on network. The packet contains FEC if activated
+	//! UMPCommand must be able to hold NETUMP_MAX_DATAGRAM_WORDS words
 	//! \return 0 if there is no new UMP data to send on the network
 	unsigned int GenerateUMPCommand (uint32_t* UMPCommand);
 
-	//! Process an incoming NetUMP packet from network
+	//! Check a received datagram and build the list of NetUMP commands it contains
+	//! \return number of commands in Descriptors, -1 if datagram is invalid (it must then be ignored as a whole)
+	int ParseDatagram (const unsigned char* Buffer, int Size, TNetUMPCommandDescriptor* Descriptors);
+
+	//! Process an incoming NetUMP packet from network (Buffer points to a command validated by ParseDatagram)
 	void ProcessIncomingUMP (unsigned char* Buffer);
 
+	//! Process an incoming Invitation (Command points to a command validated by ParseDatagram)
+	void ProcessInvitation (unsigned char* Command, unsigned int SenderIP, unsigned short SenderPort);
+
+	//! Process an incoming Invitation Accepted (Command points to a command validated by ParseDatagram)
+	void ProcessInvitationAccepted (unsigned char* Command, unsigned int SenderIP);
+
+	//! Process an incoming BYE
+	void ProcessBYE (unsigned int SenderIP, unsigned short SenderPort);
+
+	//! Give a received UMP message to the application (callback or receive queue)
+	void DeliverUMPMessage (uint32_t* UMPMsg, unsigned int Size);
+
+	//! Wake up application waiting on receive event handle
+	void SignalReceiveEvent (void);
+
 	//! Reset the Forward Error Correction memory
 	void ResetFECMemory (void);
+
+	//! Build a copy of the session counters (realtime thread only)
+	void BuildSessionStats (TNetUMPSessionStats* Stats);
+
+	//! Copy session counters into the snapshot read by GetSessionStats
+	void PublishStatsSnapshot (void);
+
+	//! Copy session counters into the shared memory slot
+	void PublishMetrics (void);
 };
 
 #endif  // __NETUMP_H__
@@ -0,0 +1,475 @@
+/*
+ *  NetUMP_Coroutine.h
+ *  C++20 coroutine interface for NetUMP sessions (header only)
+ *
+ * Copyright (c) 2023 Benoit BOUCHEZ / KissBox
+ * License : MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#ifndef __NETUMP_COROUTINE_H__
+#define __NETUMP_COROUTINE_H__
+
+/*
+ Awaitable interface on top of CNetUMPHandler. Requires a C++20 compiler (the header is empty otherwise).
+
+ A CNetUMPExecutor owns one thread, which calls RunSession() every millisecond on all the sessions it
+ manages and resumes the coroutines waiting on them. Many sessions can be multiplexed on one executor;
+ use several executors to spread sessions over several threads.
+ Coroutines always run on the executor thread, so they can use their sessions without any lock.
+
+ Example :
+   CNetUMPTask Echo (CNetUMPExecutor* Executor)
+   {
+       CNetUMPCoSession Session (Executor);
+       Session.Handler()->InitiateSession (0, 0, 5004, false);
+       co_await Session.Connected();
+       TNetUMPRxMessage Messages[64];
+       unsigned int Count;
+       while ((Count = co_await Session.NextMessages (Messages, 64)) > 0)
+           for (unsigned int i=0; i<Count; i++)
+               co_await Session.Send (Messages[i].UMP);
+       co_await Session.Close();
+   }
+
+   CNetUMPExecutor Executor;
+   Executor.Start();
+   Executor.Spawn (Echo (&Executor));
+*/
+
+#if (__cplusplus >= 202002L) && defined (__cpp_impl_coroutine)
+
+#include "NetUMP.h"
+#include <coroutine>
+#include <exception>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+class CNetUMPExecutor;
+
+//! Coroutine type for session tasks
+//! A task does not start before it is given to CNetUMPExecutor::Spawn. Its frame is released when it ends
+class CNetUMPTask
+{
+public:
+	struct promise_type
+	{
+		CNetUMPTask get_return_object (void) { return CNetUMPTask (std::coroutine_handle<promise_type>::from_promise (*this)); }
+		std::suspend_always initial_suspend (void) noexcept { return {}; }
+		std::suspend_never final_suspend (void) noexcept { return {}; }
+		void return_void (void) {}
+		void unhandled_exception (void) { std::terminate(); }
+	};
+
+	CNetUMPTask (CNetUMPTask&& Other) noexcept : Handle (Other.Handle) { Other.Handle = nullptr; }
+	CNetUMPTask (const CNetUMPTask&) = delete;
+	CNetUMPTask& operator= (const CNetUMPTask&) = delete;
+	~CNetUMPTask (void) { if (Handle) Handle.destroy(); }		// Task has never been spawned
+
+	//! Gives the coroutine to the caller (the task object does not own it anymore)
+	std::coroutine_handle<> Release (void) { std::coroutine_handle<> H = Handle; Handle = nullptr; return H; }
+
+private:
+	explicit CNetUMPTask (std::coroutine_handle<promise_type> H) : Handle (H) {}
+	std::coroutine_handle<promise_type> Handle;
+};
+
+//! NetUMP session managed by an executor. The session owns its CNetUMPHandler, used in receive queue mode
+//! Awaitables shall be used from coroutines running on the executor, one waiting coroutine per operation
+class CNetUMPCoSession
+{
+public:
+	//! Create the handler and register it to the executor (any thread)
+	explicit CNetUMPCoSession (CNetUMPExecutor* SessionExecutor);
+
+	//! Unregister from executor and delete the handler
+	//! From another thread than the executor one, the call waits until the executor does not use the session anymore
+	~CNetUMPCoSession (void);
+
+	CNetUMPCoSession (const CNetUMPCoSession&) = delete;
+	CNetUMPCoSession& operator= (const CNetUMPCoSession&) = delete;
+
+	//! Handler used for configuration (SetEndpointName, InitiateSession, etc...)
+	CNetUMPHandler* Handler (void) { return UMPHandler; }
+
+	//! co_await Connected() : resumes when session is opened
+	struct TConnectedAwaiter
+	{
+		CNetUMPCoSession* Session;
+		bool await_ready (void) { return Session->UMPHandler->GetSessionStatus() == NETUMP_STATUS_OPENED; }
+		void await_suspend (std::coroutine_handle<> H) { Session->ConnectWaiter = H; }
+		void await_resume (void) {}
+	};
+	TConnectedAwaiter Connected (void) { return TConnectedAwaiter { this }; }
+
+	//! co_await NextMessages() : resumes when messages have been received, returns the number of messages
+	//! copied in Messages (0 if session is not opened anymore)
+	struct TReceiveAwaiter
+	{
+		CNetUMPCoSession* Session;
+		TNetUMPRxMessage* Messages;
+		unsigned int MaxMessages;
+		unsigned int Count;
+		bool await_ready (void)
+		{
+			Count = Session->UMPHandler->ReadUMPMessages (Messages, MaxMessages);
+			return (Count > 0) || (Session->UMPHandler->GetSessionStatus() != NETUMP_STATUS_OPENED);
+		}
+		void await_suspend (std::coroutine_handle<> H) { Session->ReceiveWaiter = H; Session->PendingReceive = this; }
+		unsigned int await_resume (void) { return Count; }
+	};
+	TReceiveAwaiter NextMessages (TNetUMPRxMessage* Messages, unsigned int MaxMessages) { return TReceiveAwaiter { this, Messages, MaxMessages, 0 }; }
+
+	//! co_await Send() : queues a UMP message. When the transmit queue is full, waits until the message can be queued
+	//! Returns false if session is not opened
+	struct TSendAwaiter
+	{
+		CNetUMPCoSession* Session;
+		uint32_t* UMP;
+		bool Result;
+		bool await_ready (void)
+		{
+			Result = Session->UMPHandler->SendUMPMessage (UMP);
+			return (Result) || (Session->UMPHandler->GetSessionStatus() != NETUMP_STATUS_OPENED);
+		}
+		void await_suspend (std::coroutine_handle<> H) { Session->SendWaiter = H; Session->PendingSend = this; }
+		bool await_resume (void) { return Result; }
+	};
+	TSendAwaiter Send (uint32_t* UMP) { return TSendAwaiter { this, UMP, false }; }
+
+	//! co_await Close() : closes the session (BYE / BYE REPLY exchange) without blocking the executor thread
+	//! Returns true if partner acknowledged the close
+	struct TCloseAwaiter
+	{
+		CNetUMPCoSession* Session;
+		bool await_ready (void) { return false; }
+		bool await_suspend (std::coroutine_handle<> H)
+		{
+			// Close already in progress : resume at once, its own awaiter gets the result
+			if (!Session->UMPHandler->CloseSessionAsync (&CNetUMPCoSession::CloseCompleted, Session))
+			{
+				Session->CloseAcknowledged = false;
+				return false;
+			}
+			Session->CloseWaiter = H;		// Callback is called from RunSession, on this same executor thread
+			return true;
+		}
+		bool await_resume (void) { return Session->CloseAcknowledged; }
+	};
+	TCloseAwaiter Close (void) { return TCloseAwaiter { this }; }
+
+private:
+	friend class CNetUMPExecutor;
+
+	CNetUMPExecutor* Executor;
+	CNetUMPHandler* UMPHandler;
+
+	std::coroutine_handle<> ConnectWaiter;
+	std::coroutine_handle<> ReceiveWaiter;
+	std::coroutine_handle<> SendWaiter;
+	std::coroutine_handle<> CloseWaiter;
+	TReceiveAwaiter* PendingReceive;
+	TSendAwaiter* PendingSend;
+	bool CloseAcknowledged;
+
+	//! Called by the executor after RunSession : moves coroutines which can continue into Ready
+	void Poll (std::vector<std::coroutine_handle<>>& Ready);
+
+	//! Called by CNetUMPHandler (from RunSession, so on executor thread) when the close has completed
+	static void CloseCompleted (void* UserInstance, bool Acknowledged);
+};
+
+//! Runs sessions and their coroutines on one thread
+class CNetUMPExecutor
+{
+public:
+	CNetUMPExecutor (void) : Running (false), TickCounter (0), CompletedTicks (0) {}
+	~CNetUMPExecutor (void) { Stop(); }
+
+	CNetUMPExecutor (const CNetUMPExecutor&) = delete;
+	CNetUMPExecutor& operator= (const CNetUMPExecutor&) = delete;
+
+	//! Start the executor thread
+	void Start (void);
+
+	//! Stop the executor thread. Coroutines still waiting are not resumed anymore
+	//! Shall not be called from a coroutine (executor thread)
+	void Stop (void);
+
+	//! Start a task on the executor thread (task starts on next tick). Can be called from any thread
+	void Spawn (CNetUMPTask&& Task);
+
+	//! co_await Delay(ms) : resumes the coroutine after the given number of milliseconds
+	struct TDelayAwaiter
+	{
+		CNetUMPExecutor* Executor;
+		unsigned int Millis;
+		bool await_ready (void) { return Millis == 0; }
+		void await_suspend (std::coroutine_handle<> H) { Executor->Timers.push_back (TTimer { Executor->TickCounter+Millis, H }); }
+		void await_resume (void) {}
+	};
+	TDelayAwaiter Delay (unsigned int Millis) { return TDelayAwaiter { this, Millis }; }
+
+	//! Returns true if caller runs on the executor thread
+	bool InExecutorThread (void) { return std::this_thread::get_id() == ThreadId; }
+
+private:
+	friend class CNetUMPCoSession;
+
+	typedef struct {
+		uint64_t WakeTick;
+		std::coroutine_handle<> Coroutine;
+	} TTimer;
+
+	std::thread Thread;
+	std::thread::id ThreadId;
+	std::atomic<bool> Running;
+	uint64_t TickCounter;
+
+	// Shared with other threads (protected by Lock)
+	std::mutex Lock;
+	std::condition_variable TickDone;
+	std::vector<CNetUMPCoSession*> PendingAdd;
+	std::vector<CNetUMPCoSession*> PendingRemove;
+	std::vector<std::coroutine_handle<>> PendingStart;
+	uint64_t CompletedTicks;
+
+	// Executor thread only
+	std::vector<CNetUMPCoSession*> Sessions;
+	std::vector<std::coroutine_handle<>> Ready;
+	std::vector<TTimer> Timers;
+
+	void Run (void);
+	void Tick (void);
+	void AddSession (CNetUMPCoSession* Session);
+	void RemoveSession (CNetUMPCoSession* Session);
+};
+
+//---------------------------------------------------------------------------
+
+inline CNetUMPCoSession::CNetUMPCoSession (CNetUMPExecutor* SessionExecutor)
+	: Executor (SessionExecutor), PendingReceive (nullptr), PendingSend (nullptr), CloseAcknowledged (false)
+{
+	UMPHandler = new CNetUMPHandler (0, 0);
+	UMPHandler->SelectReceiveQueueMode (true);
+	Executor->AddSession (this);
+}  // CNetUMPCoSession::CNetUMPCoSession
+//---------------------------------------------------------------------------
+
+inline CNetUMPCoSession::~CNetUMPCoSession (void)
+{
+	Executor->RemoveSession (this);
+	delete UMPHandler;
+}  // CNetUMPCoSession::~CNetUMPCoSession
+//---------------------------------------------------------------------------
+
+inline void CNetUMPCoSession::Poll (std::vector<std::coroutine_handle<>>& Ready)
+{
+	bool Opened = UMPHandler->GetSessionStatus() == NETUMP_STATUS_OPENED;
+
+	if ((ConnectWaiter) && (Opened))
+	{
+		Ready.push_back (ConnectWaiter);
+		ConnectWaiter = nullptr;
+	}
+
+	if (ReceiveWaiter)
+	{
+		PendingReceive->Count = UMPHandler->ReadUMPMessages (PendingReceive->Messages, PendingReceive->MaxMessages);
+		if ((PendingReceive->Count > 0) || (Opened == false))
+		{
+			Ready.push_back (ReceiveWaiter);
+			ReceiveWaiter = nullptr;
+		}
+	}
+
+	if (SendWaiter)
+	{
+		PendingSend->Result = UMPHandler->SendUMPMessage (PendingSend->UMP);
+		if ((PendingSend->Result) || (Opened == false))
+		{
+			Ready.push_back (SendWaiter);
+			SendWaiter = nullptr;
+		}
+	}
+}  // CNetUMPCoSession::Poll
+//---------------------------------------------------------------------------
+
+inline void CNetUMPCoSession::CloseCompleted (void* UserInstance, bool Acknowledged)
+{
+	CNetUMPCoSession* Session = (CNetUMPCoSession*)UserInstance;
+
+	Session->CloseAcknowledged = Acknowledged;
+	if (Session->CloseWaiter)
+	{  // Resumed after all sessions have been processed
+		Session->Executor->Ready.push_back (Session->CloseWaiter);
+		Session->CloseWaiter = nullptr;
+	}
+}  // CNetUMPCoSession::CloseCompleted
+//---------------------------------------------------------------------------
+
+inline void CNetUMPExecutor::Start (void)
+{
+	std::lock_guard<std::mutex> Guard (Lock);		// Run waits until ThreadId is known
+
+	if (Running) return;
+	Running = true;
+	Thread = std::thread (&CNetUMPExecutor::Run, this);
+	ThreadId = Thread.get_id();
+}  // CNetUMPExecutor::Start
+//---------------------------------------------------------------------------
+
+inline void CNetUMPExecutor::Stop (void)
+{
+	if (Running == false) return;
+	Running = false;
+	Thread.join();
+	ThreadId = std::thread::id();
+
+	// Wake up threads waiting for a session removal
+	std::lock_guard<std::mutex> Guard (Lock);
+	CompletedTicks += 2;
+	TickDone.notify_all();
+}  // CNetUMPExecutor::Stop
+//---------------------------------------------------------------------------
+
+inline void CNetUMPExecutor::Spawn (CNetUMPTask&& Task)
+{
+	std::lock_guard<std::mutex> Guard (Lock);
+	PendingStart.push_back (Task.Release());
+}  // CNetUMPExecutor::Spawn
+//---------------------------------------------------------------------------
+
+inline void CNetUMPExecutor::AddSession (CNetUMPCoSession* Session)
+{
+	std::lock_guard<std::mutex> Guard (Lock);
+	PendingAdd.push_back (Session);
+}  // CNetUMPExecutor::AddSession
+//---------------------------------------------------------------------------
+
+inline void CNetUMPExecutor::RemoveSession (CNetUMPCoSession* Session)
+{
+	std::unique_lock<std::mutex> Guard (Lock);
+	uint64_t WaitUntil;
+
+	PendingRemove.push_back (Session);
+	if ((Running == false) || (InExecutorThread()))
+	{  // Removal is done at the beginning of next tick, before the session is used again
+		return;
+	}
+
+	// Wait until the executor has processed the removal (next complete tick)
+	WaitUntil = CompletedTicks+2;
+	TickDone.wait (Guard, [&]() { return CompletedTicks >= WaitUntil; });
+}  // CNetUMPExecutor::RemoveSession
+//---------------------------------------------------------------------------
+
+inline void CNetUMPExecutor::Run (void)
+{
+	std::chrono::steady_clock::time_point NextTick;
+
+	{  // Wait for Start to complete
+		std::lock_guard<std::mutex> Guard (Lock);
+	}
+
+	NextTick = std::chrono::steady_clock::now();
+	while (Running)
+	{
+		Tick();
+		NextTick += std::chrono::milliseconds(1);
+		std::this_thread::sleep_until (NextTick);
+	}
+}  // CNetUMPExecutor::Run
+//---------------------------------------------------------------------------
+
+inline void CNetUMPExecutor::Tick (void)
+{
+	std::vector<std::coroutine_handle<>> Started;
+
+	TickCounter++;
+
+	// Apply requests from other threads (and from coroutines)
+	{
+		std::lock_guard<std::mutex> Guard (Lock);
+		for (CNetUMPCoSession* Session : PendingRemove)
+		{
+			for (size_t SessionIdx=0; SessionIdx<Sessions.size(); SessionIdx++)
+			{
+				if (Sessions[SessionIdx] == Session)
+				{
+					Sessions.erase (Sessions.begin()+SessionIdx);
+					break;
+				}
+			}
+			for (size_t SessionIdx=0; SessionIdx<PendingAdd.size(); SessionIdx++)
+			{
+				if (PendingAdd[SessionIdx] == Session)
+				{
+					PendingAdd.erase (PendingAdd.begin()+SessionIdx);
+					break;
+				}
+			}
+		}
+		PendingRemove.clear();
+		Sessions.insert (Sessions.end(), PendingAdd.begin(), PendingAdd.end());
+		PendingAdd.clear();
+		Started.swap (PendingStart);
+	}
+
+	// Protocol processing, then collect coroutines which can continue
+	for (CNetUMPCoSession* Session : Sessions)
+	{
+		Session->UMPHandler->RunSession();
+		Session->Poll (Ready);
+	}
+
+	for (size_t TimerIdx=0; TimerIdx<Timers.size(); )
+	{
+		if (Timers[TimerIdx].WakeTick <= TickCounter)
+		{
+			Ready.push_back (Timers[TimerIdx].Coroutine);
+			Timers.erase (Timers.begin()+TimerIdx);
+		}
+		else TimerIdx++;
+	}
+
+	// Coroutines are resumed after the session loop, as they can create or destroy sessions
+	Ready.insert (Ready.end(), Started.begin(), Started.end());
+	for (size_t ReadyIdx=0; ReadyIdx<Ready.size(); ReadyIdx++)
+		Ready[ReadyIdx].resume();		// Ready can grow during resume (completion callbacks), so no iterator is used
+	Ready.clear();
+
+	{
+		std::lock_guard<std::mutex> Guard (Lock);
+		CompletedTicks++;
+	}
+	TickDone.notify_all();
+}  // CNetUMPExecutor::Tick
+//---------------------------------------------------------------------------
+
+#endif  // C++20 coroutines
+
+#endif  // __NETUMP_COROUTINE_H__
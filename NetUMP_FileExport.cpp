@@ -0,0 +1,457 @@
+/*
+ *  NetUMP_FileExport.cpp
+ *  Streaming export of UMP to Standard MIDI File and MIDI Clip File
+ *
+ * Copyright (c) 2023 Benoit BOUCHEZ / KissBox
+ * License : MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include "NetUMP_FileExport.h"
+#include "NetUMP_Recorder.h"
+#include "UMP_Transcoder.h"
+#include <string.h>
+
+#if defined (__TARGET_LINUX__) || defined (__TARGET_MAC__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+//! Largest value of a Delta Clockstamp (20 bits)
+#define MAX_DELTA_CLOCKSTAMP	0xFFFFF
+
+//! Number of recording blocks read in advance (and released once exported)
+#define EXPORT_READAHEAD_BLOCKS	16
+
+CNetUMPFileExport::CNetUMPFileExport (void)
+{
+	File = 0;
+	Format = NETUMP_EXPORT_SMF;
+	Group = -1;
+	WriteError = false;
+	LastTicks = 0;
+	TrackSizePosition = 0;
+	TrackSize = 0;
+	memset (&SYSEXOpened[0], 0, sizeof(SYSEXOpened));
+}  // CNetUMPFileExport::CNetUMPFileExport
+//---------------------------------------------------------------------------
+
+CNetUMPFileExport::~CNetUMPFileExport (void)
+{
+	Finish();
+}  // CNetUMPFileExport::~CNetUMPFileExport
+//---------------------------------------------------------------------------
+
+bool CNetUMPFileExport::Create (const char* FilePath, unsigned int Format, int Group)
+{
+	const uint8_t SMFHeader[] = {'M', 'T', 'h', 'd', 0, 0, 0, 6,
+								 0, 0,		// Format 0
+								 0, 1,		// One track
+								 (NETUMP_EXPORT_TICKS_PER_QUARTER>>8)&0xFF, NETUMP_EXPORT_TICKS_PER_QUARTER&0xFF,
+								 'M', 'T', 'r', 'k', 0, 0, 0, 0};		// Track size is written by Finish
+	const uint8_t SMFTempo[] = {0, 0xFF, 0x51, 3, (NETUMP_EXPORT_TEMPO>>16)&0xFF, (NETUMP_EXPORT_TEMPO>>8)&0xFF, NETUMP_EXPORT_TEMPO&0xFF};
+
+	Finish();
+
+	File = fopen (FilePath, "wb");
+	if (File == 0) return false;
+
+	this->Format = Format;
+	this->Group = Group;
+	WriteError = false;
+	LastTicks = 0;
+	TrackSize = 0;
+	memset (&SYSEXOpened[0], 0, sizeof(SYSEXOpened));
+
+	if (Format == NETUMP_EXPORT_CLIP)
+	{
+		WriteBytes ((const uint8_t*)"SMF2CLIP", 8);
+		// Clip configuration header
+		WriteUMPWord (0x00300000|NETUMP_EXPORT_TICKS_PER_QUARTER);		// Delta Clockstamp Ticks Per Quarter Note
+		// Clip sequence : Start of Clip, then tempo (Flex Data Set Tempo, in 10 ns units)
+		WriteDeltaClockstamp (0);
+		WriteUMPWord (0xF0200000);
+		WriteUMPWord (0);
+		WriteUMPWord (0);
+		WriteUMPWord (0);
+		WriteDeltaClockstamp (0);
+		WriteUMPWord (0xD0100000);
+		WriteUMPWord (NETUMP_EXPORT_TEMPO*100);
+		WriteUMPWord (0);
+		WriteUMPWord (0);
+	}
+	else
+	{
+		WriteBytes (&SMFHeader[0], sizeof(SMFHeader));
+		TrackSizePosition = (long)sizeof(SMFHeader)-4;
+		TrackSize = 0;
+		WriteBytes (&SMFTempo[0], sizeof(SMFTempo));
+		TrackSize += sizeof(SMFTempo);
+	}
+
+	return (WriteError == false);
+}  // CNetUMPFileExport::Create
+//---------------------------------------------------------------------------
+
+bool CNetUMPFileExport::Finish (void)
+{
+	const uint8_t SMFEndOfTrack[] = {0, 0xFF, 0x2F, 0};
+	bool Result;
+
+	if (File == 0) return false;
+
+	if (Format == NETUMP_EXPORT_CLIP)
+	{
+		WriteDeltaClockstamp (0);
+		WriteUMPWord (0xF0210000);		// End of Clip
+		WriteUMPWord (0);
+		WriteUMPWord (0);
+		WriteUMPWord (0);
+	}
+	else
+	{
+		WriteBytes (&SMFEndOfTrack[0], sizeof(SMFEndOfTrack));
+		TrackSize += sizeof(SMFEndOfTrack);
+		if (fseek (File, TrackSizePosition, SEEK_SET) != 0) WriteError = true;
+		WriteUInt32 (TrackSize);
+	}
+
+	if (fclose (File) != 0) WriteError = true;
+	File = 0;
+	Result = (WriteError == false);
+	WriteError = false;
+	return Result;
+}  // CNetUMPFileExport::Finish
+//---------------------------------------------------------------------------
+
+void CNetUMPFileExport::WriteBytes (const uint8_t* Data, unsigned int Size)
+{
+	if (fwrite (Data, 1, Size, File) != Size)
+		WriteError = true;
+}  // CNetUMPFileExport::WriteBytes
+//---------------------------------------------------------------------------
+
+void CNetUMPFileExport::WriteUInt32 (uint32_t Value)
+{
+	uint8_t Bytes[4];
+
+	Bytes[0] = (Value>>24)&0xFF;
+	Bytes[1] = (Value>>16)&0xFF;
+	Bytes[2] = (Value>>8)&0xFF;
+	Bytes[3] = Value&0xFF;
+	WriteBytes (&Bytes[0], 4);
+}  // CNetUMPFileExport::WriteUInt32
+//---------------------------------------------------------------------------
+
+void CNetUMPFileExport::WriteUMPWord (uint32_t Word)
+{
+	// UMP are stored in big endian in Clip files
+	WriteUInt32 (Word);
+}  // CNetUMPFileExport::WriteUMPWord
+//---------------------------------------------------------------------------
+
+uint64_t CNetUMPFileExport::GetDeltaTicks (uint64_t Time)
+{
+	uint64_t Ticks;
+	uint64_t DeltaTicks;
+
+	Ticks = (Time*NETUMP_EXPORT_TICKS_PER_QUARTER)/NETUMP_EXPORT_TEMPO;
+	if (Ticks < LastTicks) Ticks = LastTicks;		// Time shall never decrease
+	DeltaTicks = Ticks-LastTicks;
+	LastTicks = Ticks;
+	return DeltaTicks;
+}  // CNetUMPFileExport::GetDeltaTicks
+//---------------------------------------------------------------------------
+
+void CNetUMPFileExport::AddMessage (uint64_t Time, const uint32_t* UMP)
+{
+	unsigned int MT;
+	uint64_t PreviousTicks;
+
+	if (File == 0) return;
+
+	MT = UMP[0]>>28;
+	// Only messages with a group can be exported (utility and UMP stream messages are ignored)
+	if ((MT == 0) || (MT == 0xF) || ((MT > 5) && (MT != 0xD))) return;
+	if ((Group >= 0) && ((int)((UMP[0]>>24)&0x0F) != Group)) return;
+
+	if (Format == NETUMP_EXPORT_CLIP)
+	{
+		WriteDeltaClockstamp (GetDeltaTicks(Time));
+		for (unsigned int WordIdx=0; WordIdx<NetUMPMessageSize(UMP[0]); WordIdx++)
+			WriteUMPWord (UMP[WordIdx]);
+	}
+	else
+	{
+		if ((MT != 2) && (MT != 3) && (MT != 4)) return;		// Nothing to store in SMF
+		PreviousTicks = LastTicks;
+		// Time of a message which can not be translated is given to the next event
+		if (WriteSMFMessage (GetDeltaTicks(Time), UMP) == false)
+			LastTicks = PreviousTicks;
+	}
+}  // CNetUMPFileExport::AddMessage
+//---------------------------------------------------------------------------
+
+void CNetUMPFileExport::WriteDeltaClockstamp (uint64_t DeltaTicks)
+{
+	// Long delays are split in several Delta Clockstamps
+	while (DeltaTicks > MAX_DELTA_CLOCKSTAMP)
+	{
+		WriteUMPWord (0x00400000|MAX_DELTA_CLOCKSTAMP);
+		DeltaTicks -= MAX_DELTA_CLOCKSTAMP;
+	}
+	WriteUMPWord (0x00400000|(uint32_t)DeltaTicks);
+}  // CNetUMPFileExport::WriteDeltaClockstamp
+//---------------------------------------------------------------------------
+
+void CNetUMPFileExport::WriteSMFEvent (uint64_t DeltaTicks, const uint8_t* Event, unsigned int Size)
+{
+	uint8_t DeltaBytes[10];
+	unsigned int DeltaSize;
+	uint64_t Value;
+
+	// Variable length quantity (SMF delta time is limited to 28 bits)
+	if (DeltaTicks > 0x0FFFFFFF) DeltaTicks = 0x0FFFFFFF;
+	Value = DeltaTicks;
+	DeltaSize = 0;
+	do
+	{
+		DeltaBytes[DeltaSize++] = Value&0x7F;
+		Value >>= 7;
+	} while (Value != 0);
+
+	// Bytes are stored most significant first, with bit 7 set on all bytes except the last one
+	for (unsigned int ByteIdx=DeltaSize; ByteIdx>0; ByteIdx--)
+	{
+		uint8_t Byte = DeltaBytes[ByteIdx-1];
+		if (ByteIdx > 1) Byte |= 0x80;
+		WriteBytes (&Byte, 1);
+	}
+	WriteBytes (Event, Size);
+	TrackSize += DeltaSize+Size;
+}  // CNetUMPFileExport::WriteSMFEvent
+//---------------------------------------------------------------------------
+
+bool CNetUMPFileExport::WriteSMFSYSEX (uint64_t DeltaTicks, const uint32_t* UMP)
+{
+	uint8_t Event[10];
+	unsigned int Status;
+	unsigned int DataSize;
+	unsigned int EventSize;
+	unsigned int SysexGroup;
+
+	Status = (UMP[0]>>20)&0x0F;
+	DataSize = (UMP[0]>>16)&0x0F;
+	if (DataSize > 6) return false;
+	SysexGroup = (UMP[0]>>24)&0x0F;
+
+	// Complete and Start packets open a SysEx event (F0), Continue and End packets are written as F7 escapes
+	EventSize = 0;
+	if ((Status == 0) || (Status == 1))
+	{
+		Event[EventSize++] = 0xF0;
+		SYSEXOpened[SysexGroup] = (Status == 1);
+	}
+	else
+	{
+		if (SYSEXOpened[SysexGroup] == false) return false;		// Start has not been exported
+		Event[EventSize++] = 0xF7;
+		if (Status == 3) SYSEXOpened[SysexGroup] = false;
+	}
+
+	// Length (always less than 128 bytes, so one byte VLQ) then data, and F7 when SysEx is terminated
+	Event[EventSize++] = (uint8_t)(DataSize+(((Status == 0) || (Status == 3)) ? 1 : 0));
+	for (unsigned int ByteIdx=0; ByteIdx<DataSize; ByteIdx++)
+	{
+		if (ByteIdx < 2) Event[EventSize++] = (UMP[0]>>(8-(ByteIdx*8)))&0x7F;
+		else Event[EventSize++] = (UMP[1]>>(24-((ByteIdx-2)*8)))&0x7F;
+	}
+	if ((Status == 0) || (Status == 3))
+		Event[EventSize++] = 0xF7;
+
+	WriteSMFEvent (DeltaTicks, &Event[0], EventSize);
+	return true;
+}  // CNetUMPFileExport::WriteSMFSYSEX
+//---------------------------------------------------------------------------
+
+bool CNetUMPFileExport::WriteSMFMessage (uint64_t DeltaTicks, const uint32_t* UMP)
+{
+	uint8_t Event[8];
+	unsigned int Size;
+	unsigned int Opcode;
+	unsigned int Channel;
+	unsigned int Value;
+
+	if ((UMP[0]>>28) == 3)
+		return WriteSMFSYSEX (DeltaTicks, UMP);
+
+	if ((UMP[0]>>28) == 2)
+	{  // MIDI 1.0 channel voice message
+		Size = TranscodeUMP_MIDI1 ((uint32_t*)UMP, &Event[0]);
+		if (Size == 0) return false;
+		WriteSMFEvent (DeltaTicks, &Event[0], Size);
+		return true;
+	}
+
+	// MIDI 2.0 channel voice message : values are scaled down to 7 bits (14 bits for pitch bend)
+	Opcode = (UMP[0]>>20)&0x0F;
+	Channel = (UMP[0]>>16)&0x0F;
+	switch (Opcode)
+	{
+		case 0x8 :			// Note Off
+		case 0x9 :			// Note On (velocity 0 does not exist in MIDI 2.0 : lowest velocity becomes 1)
+			Event[0] = (Opcode<<4)|Channel;
+			Event[1] = (UMP[0]>>8)&0x7F;
+			Event[2] = UMP[1]>>25;
+			if ((Opcode == 0x9) && (Event[2] == 0)) Event[2] = 1;
+			WriteSMFEvent (DeltaTicks, &Event[0], 3);
+			break;
+		case 0xA :			// Poly pressure
+		case 0xB :			// Control change
+			Event[0] = (Opcode<<4)|Channel;
+			Event[1] = (UMP[0]>>8)&0x7F;
+			Event[2] = UMP[1]>>25;
+			WriteSMFEvent (DeltaTicks, &Event[0], 3);
+			break;
+		case 0xC :			// Program change, with bank select if bank is valid
+			if (UMP[0]&1)
+			{
+				Event[0] = 0xB0|Channel;
+				Event[1] = 0;
+				Event[2] = (UMP[1]>>8)&0x7F;
+				WriteSMFEvent (DeltaTicks, &Event[0], 3);
+				Event[1] = 32;
+				Event[2] = UMP[1]&0x7F;
+				WriteSMFEvent (0, &Event[0], 3);
+				DeltaTicks = 0;
+			}
+			Event[0] = 0xC0|Channel;
+			Event[1] = (UMP[1]>>24)&0x7F;
+			WriteSMFEvent (DeltaTicks, &Event[0], 2);
+			break;
+		case 0xD :			// Channel pressure
+			Event[0] = 0xD0|Channel;
+			Event[1] = UMP[1]>>25;
+			WriteSMFEvent (DeltaTicks, &Event[0], 2);
+			break;
+		case 0xE :			// Pitch bend
+			Value = UMP[1]>>18;
+			Event[0] = 0xE0|Channel;
+			Event[1] = Value&0x7F;
+			Event[2] = (Value>>7)&0x7F;
+			WriteSMFEvent (DeltaTicks, &Event[0], 3);
+			break;
+		case 0x2 :			// Registered controller : RPN sequence
+		case 0x3 :			// Assignable controller : NRPN sequence
+			Value = UMP[1]>>18;
+			Event[0] = 0xB0|Channel;
+			Event[1] = (Opcode == 0x2) ? 101 : 99;
+			Event[2] = (UMP[0]>>8)&0x7F;
+			WriteSMFEvent (DeltaTicks, &Event[0], 3);
+			Event[1] = (Opcode == 0x2) ? 100 : 98;
+			Event[2] = UMP[0]&0x7F;
+			WriteSMFEvent (0, &Event[0], 3);
+			Event[1] = 6;
+			Event[2] = (Value>>7)&0x7F;
+			WriteSMFEvent (0, &Event[0], 3);
+			Event[1] = 38;
+			Event[2] = Value&0x7F;
+			WriteSMFEvent (0, &Event[0], 3);
+			break;
+		default :			// Per-note and relative controllers have no MIDI 1.0 equivalent
+			return false;
+	}
+	return true;
+}  // CNetUMPFileExport::WriteSMFMessage
+//---------------------------------------------------------------------------
+
+bool CNetUMPFileExport::AddRecording (const char* RecordingPath, int Source, uint64_t TimeOffset)
+{
+#if defined (__TARGET_LINUX__) || defined (__TARGET_MAC__)
+	int FileHandle;
+	struct stat FileInfo;
+	void* Area;
+	const uint8_t* MappedArea;
+	const TNetUMPRecordHeader* Header;
+	const TNetUMPRecordBlockHeader* Block;
+	const TNetUMPRecord* Record;
+	uint32_t Offset;
+	uint32_t UMP[4];
+	bool Valid;
+
+	if (File == 0) return false;
+
+	FileHandle = open (RecordingPath, O_RDONLY);
+	if (FileHandle < 0) return false;
+	if ((fstat (FileHandle, &FileInfo) != 0) || ((size_t)FileInfo.st_size < sizeof(TNetUMPRecordHeader)))
+	{
+		close (FileHandle);
+		return false;
+	}
+	Area = mmap (0, (size_t)FileInfo.st_size, PROT_READ, MAP_SHARED, FileHandle, 0);
+	if (Area == MAP_FAILED)
+	{
+		close (FileHandle);
+		return false;
+	}
+	MappedArea = (const uint8_t*)Area;
+	madvise (Area, (size_t)FileInfo.st_size, MADV_SEQUENTIAL);
+
+	Header = (const TNetUMPRecordHeader*)MappedArea;
+	Valid = (Header->Magic == NETUMP_RECORD_MAGIC) && (Header->Version == NETUMP_RECORD_VERSION) &&
+			(Header->BlockSize == NETUMP_RECORD_BLOCK_SIZE) &&
+			(Header->DataOffset+((uint64_t)Header->UsedBlocks*NETUMP_RECORD_BLOCK_SIZE) <= (uint64_t)FileInfo.st_size);
+
+	// Blocks are read in sequence. Exported blocks are released, so memory used does not depend on recording length
+	for (uint32_t BlockIdx=0; (Valid) && (BlockIdx<Header->UsedBlocks); BlockIdx++)
+	{
+		Block = (const TNetUMPRecordBlockHeader*)(MappedArea+Header->DataOffset+((uint64_t)BlockIdx*NETUMP_RECORD_BLOCK_SIZE));
+		if (BlockIdx+EXPORT_READAHEAD_BLOCKS < Header->UsedBlocks)
+			madvise ((void*)((const uint8_t*)Block+((size_t)EXPORT_READAHEAD_BLOCKS*NETUMP_RECORD_BLOCK_SIZE)), NETUMP_RECORD_BLOCK_SIZE, MADV_WILLNEED);
+		if ((Block->Magic != NETUMP_RECORD_BLOCK_MAGIC) || (Block->UsedBytes > NETUMP_RECORD_BLOCK_SIZE)) break;
+
+		Offset = sizeof(TNetUMPRecordBlockHeader);
+		for (uint32_t RecordIdx=0; RecordIdx<Block->NumRecords; RecordIdx++)
+		{
+			Record = (const TNetUMPRecord*)((const uint8_t*)Block+Offset);
+			if ((Offset+sizeof(TNetUMPRecord) > Block->UsedBytes) || (Record->Size > 4) ||
+				(Offset+sizeof(TNetUMPRecord)+(Record->Size*4) > Block->UsedBytes)) break;
+			Offset += sizeof(TNetUMPRecord)+(Record->Size*4);
+
+			if ((Record->Type != NETUMP_RECORD_UMP) || (Record->Size == 0)) continue;
+			if ((Source >= 0) && (Record->Source != Source)) continue;
+			memcpy (&UMP[0], Record+1, Record->Size*4);
+			AddMessage (TimeOffset+((Block->BaseTime/1000)+Record->Time), &UMP[0]);
+		}
+
+		madvise ((void*)Block, NETUMP_RECORD_BLOCK_SIZE, MADV_DONTNEED);
+	}
+
+	munmap (Area, (size_t)FileInfo.st_size);
+	close (FileHandle);
+	return (Valid) && (WriteError == false);
+#else
+	return false;
+#endif
+}  // CNetUMPFileExport::AddRecording
+//---------------------------------------------------------------------------
@@ -0,0 +1,110 @@
+/*
+ *  NetUMP_FileExport.h
+ *  Streaming export of UMP to Standard MIDI File and MIDI Clip File
+ *
+ * Copyright (c) 2023 Benoit BOUCHEZ / KissBox
+ * License : MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#ifndef __NETUMP_FILEEXPORT_H__
+#define __NETUMP_FILEEXPORT_H__
+
+#include "NetUMP.h"
+#include <stdio.h>
+
+//! Output formats
+#define NETUMP_EXPORT_SMF			0		// Standard MIDI File, format 0 (MIDI 2.0 channel voice messages are translated to MIDI 1.0)
+#define NETUMP_EXPORT_CLIP			1		// MIDI Clip File (UMP messages written as is, with Delta Clockstamps)
+
+//! Time base of exported files : 960 ticks per quarter note at 120 BPM (one tick is about 520 us)
+#define NETUMP_EXPORT_TICKS_PER_QUARTER		960
+#define NETUMP_EXPORT_TEMPO					500000		// Microseconds per quarter note
+
+//! Writes UMP messages to a Standard MIDI File or a MIDI Clip File while they are given, using a fixed amount of memory
+//! Messages come from a recording made by CNetUMPRecorder (AddRecording) or from a live session (AddMessage)
+//! Methods are not realtime safe (file writes) : call them from an application thread, never from the handler callback
+/*
+ SMF : one track, one event per message (no running status). UMP SysEx packets are written as SysEx events as they come
+ (F0 for the first packet, F7 escapes for the next ones), so SysEx of any length are exported without buffering.
+ System realtime messages (clock, start, stop...) can not be stored in SMF and are ignored, as UMP stream and utility
+ messages. MIDI 2.0 channel voice messages are translated to MIDI 1.0 (registered / assignable controllers become
+ RPN / NRPN controller sequences, bank in program change becomes bank select). Channels of all groups are merged
+ unless a group is selected.
+
+ Clip : all messages with a group (MT=1 to 5 and MT=D) are written as is, each one preceded by a Delta Clockstamp.
+ The clip starts with the Delta Clockstamp Ticks Per Quarter Note, Start of Clip and Set Tempo messages and ends with End of Clip.
+*/
+class CNetUMPFileExport
+{
+public:
+	CNetUMPFileExport (void);
+	~CNetUMPFileExport (void);
+
+	//! Create the output file and write the file header
+	//! \param Group group to export (0 to 15), -1 to export all groups
+	//! \return false if the file can not be created
+	bool Create (const char* FilePath, unsigned int Format, int Group);
+
+	//! Add a message. Time is given in microseconds and must never decrease between two calls
+	void AddMessage (uint64_t Time, const uint32_t* UMP);
+
+	//! Add the messages of a recording (CNetUMPRecorder file), read block by block
+	//! \param Source source number of the messages to export, -1 for all sources
+	//! \param TimeOffset added to the time of recorded messages (microseconds)
+	//! \return false if the recording can not be read
+	bool AddRecording (const char* RecordingPath, int Source, uint64_t TimeOffset);
+
+	//! Write the end of the file (and chunk sizes) and close it
+	//! \return false if an error occured while writing the file
+	bool Finish (void);
+
+private:
+	FILE* File;
+	unsigned int Format;
+	int Group;
+	bool WriteError;
+	uint64_t LastTicks;			// Time of last event written (ticks)
+	long TrackSizePosition;		// Position of SMF track chunk size
+	uint32_t TrackSize;			// Bytes written in SMF track chunk
+	bool SYSEXOpened[16];		// SMF : a SysEx has been started on the group and not terminated
+
+	void WriteBytes (const uint8_t* Data, unsigned int Size);
+	void WriteUMPWord (uint32_t Word);
+	void WriteUInt32 (uint32_t Value);
+
+	//! Returns number of ticks since previous event, and updates LastTicks
+	uint64_t GetDeltaTicks (uint64_t Time);
+
+	//! SMF : writes delta time and MIDI event
+	void WriteSMFEvent (uint64_t DeltaTicks, const uint8_t* Event, unsigned int Size);
+
+	//! SMF : translates UMP message to MIDI 1.0 event(s)
+	//! \return false if nothing has been written (message has no MIDI 1.0 equivalent)
+	bool WriteSMFSYSEX (uint64_t DeltaTicks, const uint32_t* UMP);
+	bool WriteSMFMessage (uint64_t DeltaTicks, const uint32_t* UMP);
+
+	//! Clip : writes Delta Clockstamp messages for DeltaTicks
+	void WriteDeltaClockstamp (uint64_t DeltaTicks);
+};
+
+#endif  // __NETUMP_FILEEXPORT_H__
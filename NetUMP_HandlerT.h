@@ -0,0 +1,77 @@
+/*
+ *  NetUMP_HandlerT.h
+ *  NetUMP handler delivering received messages to a statically bound sink (header only)
+ *
+ * Copyright (c) 2023 Benoit BOUCHEZ / KissBox
+ * License : MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#ifndef __NETUMP_HANDLERT_H__
+#define __NETUMP_HANDLERT_H__
+
+#include "NetUMP.h"
+
+/*
+ CNetUMPHandler gives each received message to a callback through a function pointer, which the compiler
+ can not inline. CNetUMPHandlerT calls the OnUMPMessage method of its sink type directly from the decoding
+ loop, so the message processing can be inlined. The only indirect call left is one virtual call for each
+ UMP Data command (not for each message).
+
+ The sink type shall provide :
+   void OnUMPMessage (uint32_t* UMP, unsigned int Size);		// Called from realtime thread, Size in 32-bit words
+
+ Example :
+   struct TMySink {
+       void OnUMPMessage (uint32_t* UMP, unsigned int Size) { ... }
+   };
+   TMySink Sink;
+   CNetUMPHandlerT<TMySink> Handler (&Sink);
+
+ The UMP callback and the receive queue mode are not used by this handler.
+*/
+
+template <class TSink> class CNetUMPHandlerT final : public CNetUMPHandler
+{
+public:
+	explicit CNetUMPHandlerT (TSink* MessageSink) : CNetUMPHandler (0, 0), Sink (MessageSink) {}
+
+	TSink* GetSink (void) { return Sink; }
+
+protected:
+	unsigned int DeliverUMPBlock (const unsigned char* Payload, unsigned int PayloadLength) override
+	{
+		TSinkAdapter Adapter = { Sink };
+		return NetUMPDecodeBlock (Payload, PayloadLength, Adapter);
+	}
+
+private:
+	struct TSinkAdapter
+	{
+		TSink* Target;
+		void operator() (uint32_t* UMP, unsigned int Size) { Target->OnUMPMessage (UMP, Size); }
+	};
+
+	TSink* Sink;
+};
+
+#endif  // __NETUMP_HANDLERT_H__
@@ -0,0 +1,258 @@
+/*
+ *  NetUMP_LossInjector.cpp
+ *  Packet shim injecting deterministic loss, duplication, reordering and delay
+ *
+ * Copyright (c) 2023 Benoit BOUCHEZ / KissBox
+ * License : MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include "NetUMP_LossInjector.h"
+
+CNetUMPLossInjector::CNetUMPLossInjector (void)
+{
+	TNetUMPLossProfile Profile;
+
+	HeldQueue = new THeldDatagram[LOSS_INJECTOR_QUEUE_SIZE];
+
+	memset (&Profile, 0, sizeof(TNetUMPLossProfile));
+	SetProfile (&Profile);
+	Reset ();
+}  // CNetUMPLossInjector::CNetUMPLossInjector
+//---------------------------------------------------------------------------
+
+CNetUMPLossInjector::~CNetUMPLossInjector (void)
+{
+	delete[] HeldQueue;
+}  // CNetUMPLossInjector::~CNetUMPLossInjector
+//---------------------------------------------------------------------------
+
+static uint32_t ProbabilityToThreshold (double Probability)
+{
+	if (Probability <= 0.0) return 0;
+	if (Probability >= 1.0) return 0xFFFFFFFF;
+	return (uint32_t)(Probability*4294967296.0);
+}  // ProbabilityToThreshold
+//---------------------------------------------------------------------------
+
+void CNetUMPLossInjector::SetProfile (TNetUMPLossProfile* Profile)
+{
+	uint64_t Seed;
+
+	LossThreshold = ProbabilityToThreshold (Profile->LossProbability);
+	BurstStartThreshold = ProbabilityToThreshold (Profile->BurstStartProbability);
+	BurstEndThreshold = ProbabilityToThreshold (Profile->BurstEndProbability);
+	BurstLossThreshold = ProbabilityToThreshold (Profile->BurstLossProbability);
+	DuplicateThreshold = ProbabilityToThreshold (Profile->DuplicateProbability);
+	ReorderThreshold = ProbabilityToThreshold (Profile->ReorderProbability);
+	ReorderMaxTicks = Profile->ReorderMaxTicks;
+	if (ReorderMaxTicks == 0) ReorderMaxTicks = 1;
+	DelayTicks = Profile->DelayTicks;
+	JitterTicks = Profile->JitterTicks;
+
+	// Spread the seed (splitmix64 step) so close seeds give unrelated sequences. State must never be 0
+	Seed = (uint64_t)Profile->Seed + 0x9E3779B97F4A7C15ULL;
+	Seed = (Seed ^ (Seed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	Seed = (Seed ^ (Seed >> 27)) * 0x94D049BB133111EBULL;
+	Seed = Seed ^ (Seed >> 31);
+	if (Seed == 0) Seed = 1;
+	RandomState = Seed;
+	BurstState = false;
+}  // CNetUMPLossInjector::SetProfile
+//---------------------------------------------------------------------------
+
+void CNetUMPLossInjector::GetStats (TNetUMPLossStats* Stats)
+{
+	*Stats = this->Stats;
+}  // CNetUMPLossInjector::GetStats
+//---------------------------------------------------------------------------
+
+void CNetUMPLossInjector::Reset (void)
+{
+	for (unsigned int Slot=0; Slot<LOSS_INJECTOR_QUEUE_SIZE; Slot++)
+		HeldQueue[Slot].Used = false;
+	HeldCount = 0;
+	OrderCounter = 0;
+	TickCounter = 0;
+	memset (&Stats, 0, sizeof(TNetUMPLossStats));
+}  // CNetUMPLossInjector::Reset
+//---------------------------------------------------------------------------
+
+uint32_t CNetUMPLossInjector::NextRandom (void)
+{
+	RandomState ^= RandomState >> 12;
+	RandomState ^= RandomState << 25;
+	RandomState ^= RandomState >> 27;
+	return (uint32_t)((RandomState * 0x2545F4914F6CDD1DULL) >> 32);
+}  // CNetUMPLossInjector::NextRandom
+//---------------------------------------------------------------------------
+
+bool CNetUMPLossInjector::Draw (uint32_t Threshold)
+{
+	if (Threshold == 0) return false;
+	if (Threshold == 0xFFFFFFFF) return true;
+	return NextRandom() < Threshold;
+}  // CNetUMPLossInjector::Draw
+//---------------------------------------------------------------------------
+
+bool CNetUMPLossInjector::HoldDatagram (const char* Data, int Size, const sockaddr_in* Destination, unsigned int ReleaseTick)
+{
+	if (HeldCount >= LOSS_INJECTOR_QUEUE_SIZE) return false;
+
+	for (unsigned int Slot=0; Slot<LOSS_INJECTOR_QUEUE_SIZE; Slot++)
+	{
+		if (HeldQueue[Slot].Used == false)
+		{
+			memcpy (&HeldQueue[Slot].Data[0], Data, Size);
+			HeldQueue[Slot].Size = Size;
+			HeldQueue[Slot].Connected = (Destination == 0);
+			if (Destination)
+				HeldQueue[Slot].Destination = *Destination;
+			HeldQueue[Slot].ReleaseTick = ReleaseTick;
+			HeldQueue[Slot].Order = OrderCounter++;
+			HeldQueue[Slot].Used = true;
+			HeldCount++;
+			return true;
+		}
+	}
+	return false;
+}  // CNetUMPLossInjector::HoldDatagram
+//---------------------------------------------------------------------------
+
+int CNetUMPLossInjector::SendNow (TSOCKTYPE Socket, const char* Data, int Size, const sockaddr_in* Destination)
+{
+	if (Destination == 0)
+		return (int)send (Socket, Data, Size, 0);
+	return (int)sendto (Socket, Data, Size, 0, (const sockaddr*)Destination, sizeof(sockaddr_in));
+}  // CNetUMPLossInjector::SendNow
+//---------------------------------------------------------------------------
+
+void CNetUMPLossInjector::Tick (TSOCKTYPE Socket)
+{
+	unsigned int DueList[LOSS_INJECTOR_QUEUE_SIZE];
+	unsigned int DueCount = 0;
+	unsigned int Slot;
+
+	TickCounter++;
+	if (HeldCount == 0) return;
+
+	// Collect datagrams to release and sort them by insertion order (insertion sort, list is short)
+	for (Slot=0; Slot<LOSS_INJECTOR_QUEUE_SIZE; Slot++)
+	{
+		if ((HeldQueue[Slot].Used) && ((int)(TickCounter-HeldQueue[Slot].ReleaseTick) >= 0))
+		{
+			unsigned int Pos = DueCount;
+			while ((Pos > 0) && ((int)(HeldQueue[DueList[Pos-1]].Order-HeldQueue[Slot].Order) > 0))
+			{
+				DueList[Pos] = DueList[Pos-1];
+				Pos--;
+			}
+			DueList[Pos] = Slot;
+			DueCount++;
+		}
+	}
+
+	for (unsigned int DueIndex=0; DueIndex<DueCount; DueIndex++)
+	{
+		Slot = DueList[DueIndex];
+		if (HeldQueue[Slot].Connected)
+			send (Socket, HeldQueue[Slot].Data, HeldQueue[Slot].Size, 0);
+		else
+			sendto (Socket, HeldQueue[Slot].Data, HeldQueue[Slot].Size, 0, (const sockaddr*)&HeldQueue[Slot].Destination, sizeof(sockaddr_in));
+		HeldQueue[Slot].Used = false;
+		HeldCount--;
+		Stats.Sent++;
+	}
+}  // CNetUMPLossInjector::Tick
+//---------------------------------------------------------------------------
+
+int CNetUMPLossInjector::SendTo (TSOCKTYPE Socket, const char* Data, int Size, const sockaddr_in* Destination)
+{
+	bool Lost;
+	bool Duplicate;
+	unsigned int Delay;
+
+	if ((Size <= 0) || (Size > LOSS_INJECTOR_MAX_DATAGRAM))
+		return SendNow (Socket, Data, Size, Destination);
+
+	// Update burst state, then decide if the packet is lost
+	if (BurstState)
+	{
+		if (Draw (BurstEndThreshold)) BurstState = false;
+	}
+	else
+	{
+		if (Draw (BurstStartThreshold)) BurstState = true;
+	}
+	Lost = Draw (BurstState ? BurstLossThreshold : LossThreshold);
+	if (Lost)
+	{
+		Stats.Dropped++;
+		return Size;
+	}
+
+	Duplicate = Draw (DuplicateThreshold);
+	if (Duplicate) Stats.Duplicated++;
+
+	Delay = DelayTicks;
+	if (JitterTicks > 0)
+		Delay += NextRandom() % (JitterTicks+1);
+
+	if (Draw (ReorderThreshold))
+	{  // Packet is released at least one tick after the next packet, so the next packet overtakes it
+		Delay += 2 + (NextRandom() % ReorderMaxTicks);
+		Stats.Reordered++;
+	}
+	else if (Delay > 0)
+	{
+		Stats.Delayed++;
+	}
+
+	for (unsigned int Copy=0; Copy<(Duplicate ? 2u : 1u); Copy++)
+	{
+		if ((Delay == 0) || (HoldDatagram (Data, Size, Destination, TickCounter+Delay) == false))
+		{
+			if (Delay > 0) Stats.QueueOverflow++;
+			SendNow (Socket, Data, Size, Destination);
+			Stats.Sent++;
+		}
+	}
+
+	return Size;
+}  // CNetUMPLossInjector::SendTo
+//---------------------------------------------------------------------------
+
+int CNetUMPLossInjector::RecvFrom (TSOCKTYPE Socket, char* Buffer, int Size, sockaddr_in* Source)
+{
+#if defined (__TARGET_WIN__)
+	int fromlen;
+#else
+	socklen_t fromlen;
+#endif
+
+	if (Source == 0)
+		return (int)recv (Socket, Buffer, Size, 0);
+
+	fromlen = sizeof(sockaddr_in);
+	return (int)recvfrom (Socket, Buffer, Size, 0, (sockaddr*)Source, &fromlen);
+}  // CNetUMPLossInjector::RecvFrom
+//---------------------------------------------------------------------------
@@ -0,0 +1,132 @@
+/*
+ *  NetUMP_LossInjector.h
+ *  Packet shim injecting deterministic loss, duplication, reordering and delay
+ *
+ * Copyright (c) 2023 Benoit BOUCHEZ / KissBox
+ * License : MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#ifndef __NETUMP_LOSSINJECTOR_H__
+#define __NETUMP_LOSSINJECTOR_H__
+
+#include "NetUMP.h"
+
+//! Number of datagrams which can be held by the injector (delayed / reordered / duplicated)
+#define LOSS_INJECTOR_QUEUE_SIZE		256
+
+//! Maximum size of a datagram held by the injector
+#define LOSS_INJECTOR_MAX_DATAGRAM		1472
+
+//! Impairment profile. Probabilities are given between 0.0 and 1.0, delays in RunSession ticks (milliseconds)
+//! Burst loss uses a two-state (Gilbert-Elliott) model : in "good" state, packets are lost with LossProbability,
+//! in "bad" state, packets are lost with BurstLossProbability
+typedef struct {
+	uint32_t Seed;						// Same seed and same traffic give the same impairment sequence
+	double LossProbability;				// Random loss in good state
+	double BurstStartProbability;		// Probability to switch from good to bad state (per packet)
+	double BurstEndProbability;			// Probability to switch from bad to good state (per packet)
+	double BurstLossProbability;		// Loss in bad state
+	double DuplicateProbability;		// Packet is sent twice
+	double ReorderProbability;			// Packet is held back and sent after following packet(s)
+	unsigned int ReorderMaxTicks;		// Maximum additional hold time for reordered packets
+	unsigned int DelayTicks;			// Fixed delay applied to all packets
+	unsigned int JitterTicks;			// Random delay added to fixed delay (0..JitterTicks)
+} TNetUMPLossProfile;
+
+typedef struct {
+	unsigned int Sent;					// Datagrams really sent to the socket
+	unsigned int Dropped;
+	unsigned int Duplicated;
+	unsigned int Reordered;
+	unsigned int Delayed;
+	unsigned int QueueOverflow;			// Datagrams sent immediately because injector queue was full
+} TNetUMPLossStats;
+
+//! Packet shim impairing datagrams sent by a handler
+//! Receive path is not modified : declare an injector on both sides to impair both directions
+class CNetUMPLossInjector : public CNetUMPPacketShim
+{
+public:
+	CNetUMPLossInjector (void);
+	~CNetUMPLossInjector (void);
+
+	//! Set impairment profile and restart pseudo-random sequence from profile seed
+	// Do not call while the handler is running
+	void SetProfile (TNetUMPLossProfile* Profile);
+
+	//! Returns a copy of the injector counters
+	void GetStats (TNetUMPLossStats* Stats);
+
+	//! Drop all held datagrams and reset counters
+	void Reset (void);
+
+	void Tick (TSOCKTYPE Socket);
+	int SendTo (TSOCKTYPE Socket, const char* Data, int Size, const sockaddr_in* Destination);
+	int RecvFrom (TSOCKTYPE Socket, char* Buffer, int Size, sockaddr_in* Source);
+
+private:
+	typedef struct {
+		bool Used;
+		unsigned int ReleaseTick;
+		unsigned int Order;				// Insertion order, to keep FIFO order between datagrams released on the same tick
+		bool Connected;					// Socket connected to partner : datagram is sent with send()
+		sockaddr_in Destination;
+		int Size;
+		char Data[LOSS_INJECTOR_MAX_DATAGRAM];
+	} THeldDatagram;
+
+	THeldDatagram* HeldQueue;			// LOSS_INJECTOR_QUEUE_SIZE entries
+	unsigned int HeldCount;
+	unsigned int OrderCounter;
+	unsigned int TickCounter;
+
+	uint64_t RandomState;
+	bool BurstState;					// true when in "bad" state
+
+	// Probabilities converted to 32-bit thresholds
+	uint32_t LossThreshold;
+	uint32_t BurstStartThreshold;
+	uint32_t BurstEndThreshold;
+	uint32_t BurstLossThreshold;
+	uint32_t DuplicateThreshold;
+	uint32_t ReorderThreshold;
+	unsigned int ReorderMaxTicks;
+	unsigned int DelayTicks;
+	unsigned int JitterTicks;
+
+	TNetUMPLossStats Stats;
+
+	//! xorshift64* generator, returns 32 random bits
+	uint32_t NextRandom (void);
+
+	//! Returns true with the probability given as 32-bit threshold
+	bool Draw (uint32_t Threshold);
+
+	//! Send a datagram on socket (Destination = 0 for a connected socket)
+	int SendNow (TSOCKTYPE Socket, const char* Data, int Size, const sockaddr_in* Destination);
+
+	//! Put a datagram in the held queue. Returns false if queue is full
+	bool HoldDatagram (const char* Data, int Size, const sockaddr_in* Destination, unsigned int ReleaseTick);
+};
+
+#endif  // __NETUMP_LOSSINJECTOR_H__
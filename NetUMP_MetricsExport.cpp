@@ -0,0 +1,196 @@
+/*
+ *  NetUMP_MetricsExport.cpp
+ *  Shared memory export of session counters
+ *
+ * Copyright (c) 2023 Benoit BOUCHEZ / KissBox
+ * License : MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include "NetUMP_MetricsExport.h"
+
+#if defined (__TARGET_LINUX__) || defined (__TARGET_MAC__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+//! Slots are aligned on cache lines so two handlers never write in the same line
+#define METRICS_SLOT_ALIGN		64
+
+CNetUMPMetricsExport::CNetUMPMetricsExport (void)
+{
+	MappedArea = 0;
+	MappedSize = 0;
+	FileHandle = -1;
+	Header = 0;
+}  // CNetUMPMetricsExport::CNetUMPMetricsExport
+//---------------------------------------------------------------------------
+
+CNetUMPMetricsExport::~CNetUMPMetricsExport (void)
+{
+	Close();
+}  // CNetUMPMetricsExport::~CNetUMPMetricsExport
+//---------------------------------------------------------------------------
+
+bool CNetUMPMetricsExport::Open (const char* FilePath, unsigned int NumSlots)
+{
+#if defined (__TARGET_LINUX__) || defined (__TARGET_MAC__)
+	size_t SlotSize;
+	void* Area;
+
+	Close();
+	if (NumSlots == 0) return false;
+
+	SlotSize = (sizeof(TNetUMPMetricsSlot)+METRICS_SLOT_ALIGN-1) & ~((size_t)METRICS_SLOT_ALIGN-1);
+	MappedSize = sizeof(TNetUMPMetricsHeader) + (NumSlots*SlotSize);
+
+	FileHandle = open (FilePath, O_RDWR|O_CREAT|O_TRUNC, 0644);
+	if (FileHandle < 0) return false;
+
+	// File is filled with zeros by ftruncate : all slots are free, with an even sequence
+	if (ftruncate (FileHandle, (off_t)MappedSize) != 0)
+	{
+		close (FileHandle);
+		FileHandle = -1;
+		return false;
+	}
+
+	Area = mmap (0, MappedSize, PROT_READ|PROT_WRITE, MAP_SHARED, FileHandle, 0);
+	if (Area == MAP_FAILED)
+	{
+		close (FileHandle);
+		FileHandle = -1;
+		return false;
+	}
+	MappedArea = (uint8_t*)Area;
+
+	Header = (TNetUMPMetricsHeader*)MappedArea;
+	Header->Version = NETUMP_METRICS_VERSION;
+	Header->HeaderSize = sizeof(TNetUMPMetricsHeader);
+	Header->SlotSize = (uint32_t)SlotSize;
+	Header->NumSlots = NumSlots;
+	Header->StatsSize = sizeof(TNetUMPSessionStats);
+	std::atomic_thread_fence (std::memory_order_release);
+	Header->Magic = NETUMP_METRICS_MAGIC;
+
+	return true;
+#else
+	return false;
+#endif
+}  // CNetUMPMetricsExport::Open
+//---------------------------------------------------------------------------
+
+void CNetUMPMetricsExport::Close (void)
+{
+#if defined (__TARGET_LINUX__) || defined (__TARGET_MAC__)
+	if (MappedArea)
+		munmap (MappedArea, MappedSize);
+	if (FileHandle >= 0)
+		close (FileHandle);
+#endif
+	MappedArea = 0;
+	MappedSize = 0;
+	FileHandle = -1;
+	Header = 0;
+}  // CNetUMPMetricsExport::Close
+//---------------------------------------------------------------------------
+
+TNetUMPMetricsSlot* CNetUMPMetricsExport::GetSlot (unsigned int SlotIndex)
+{
+	return (TNetUMPMetricsSlot*)(MappedArea + Header->HeaderSize + (SlotIndex*Header->SlotSize));
+}  // CNetUMPMetricsExport::GetSlot
+//---------------------------------------------------------------------------
+
+TNetUMPMetricsSlot* CNetUMPMetricsExport::AllocateSlot (const char* Label)
+{
+	TNetUMPMetricsSlot* Slot;
+	uint32_t Sequence;
+
+	if (Header == 0) return 0;
+
+	for (unsigned int SlotIndex=0; SlotIndex<Header->NumSlots; SlotIndex++)
+	{
+		Slot = GetSlot (SlotIndex);
+		if (Slot->InUse == 0)
+		{
+			Sequence = Slot->Sequence.load (std::memory_order_relaxed);
+			Slot->Sequence.store (Sequence+1, std::memory_order_relaxed);
+			std::atomic_thread_fence (std::memory_order_release);
+
+			memset (&Slot->Stats, 0, sizeof(TNetUMPSessionStats));
+			memset (&Slot->Label[0], 0, NETUMP_METRICS_LABEL_LEN);
+			if (Label)
+				strncpy (&Slot->Label[0], Label, NETUMP_METRICS_LABEL_LEN-1);
+			Slot->UpdateTime = 0;
+			Slot->InUse = 1;
+
+			Slot->Sequence.store (Sequence+2, std::memory_order_release);
+			return Slot;
+		}
+	}
+	return 0;
+}  // CNetUMPMetricsExport::AllocateSlot
+//---------------------------------------------------------------------------
+
+void CNetUMPMetricsExport::ReleaseSlot (TNetUMPMetricsSlot* Slot)
+{
+	uint32_t Sequence;
+
+	if (Slot == 0) return;
+
+	Sequence = Slot->Sequence.load (std::memory_order_relaxed);
+	Slot->Sequence.store (Sequence+1, std::memory_order_relaxed);
+	std::atomic_thread_fence (std::memory_order_release);
+	Slot->InUse = 0;
+	Slot->Sequence.store (Sequence+2, std::memory_order_release);
+}  // CNetUMPMetricsExport::ReleaseSlot
+//---------------------------------------------------------------------------
+
+bool ReadNetUMPMetricsSlot (const TNetUMPMetricsSlot* Slot, TNetUMPMetricsSlot* Copy)
+{
+	uint32_t SequenceBefore;
+	uint32_t SequenceAfter;
+
+	for (unsigned int Retry=0; Retry<100; Retry++)
+	{
+		SequenceBefore = Slot->Sequence.load (std::memory_order_acquire);
+		if (SequenceBefore & 1) continue;		// Writer is updating the slot
+
+		Copy->InUse = Slot->InUse;
+		Copy->UpdateTime = Slot->UpdateTime;
+		memcpy (&Copy->Label[0], &Slot->Label[0], NETUMP_METRICS_LABEL_LEN);
+		memcpy (&Copy->Stats, &Slot->Stats, sizeof(TNetUMPSessionStats));
+
+		std::atomic_thread_fence (std::memory_order_acquire);
+		SequenceAfter = Slot->Sequence.load (std::memory_order_relaxed);
+		if (SequenceBefore == SequenceAfter)
+		{
+			Copy->Sequence.store (SequenceBefore, std::memory_order_relaxed);
+			Copy->Label[NETUMP_METRICS_LABEL_LEN-1] = 0;
+			return (Copy->InUse != 0);
+		}
+	}
+	return false;
+}  // ReadNetUMPMetricsSlot
+//---------------------------------------------------------------------------
@@ -0,0 +1,104 @@
+/*
+ *  NetUMP_MetricsExport.h
+ *  Shared memory export of session counters
+ *
+ * Copyright (c) 2023 Benoit BOUCHEZ / KissBox
+ * License : MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#ifndef __NETUMP_METRICSEXPORT_H__
+#define __NETUMP_METRICSEXPORT_H__
+
+#include "NetUMP.h"
+#include <atomic>
+
+/*
+ File layout (all fields in host byte order) :
+   - TNetUMPMetricsHeader (64 bytes)
+   - NumSlots x TNetUMPMetricsSlot, each SlotSize bytes long
+
+ Each slot is protected by a seqlock : the writer (realtime thread of the handler) makes Sequence odd
+ before updating the slot and even after. A reader copies the slot, then checks that Sequence was even
+ and has not changed during the copy, otherwise it retries. Readers never block the writer.
+*/
+
+#define NETUMP_METRICS_MAGIC		0x4E554D4D		// "NUMM"
+#define NETUMP_METRICS_VERSION		5
+
+#define NETUMP_METRICS_LABEL_LEN	64
+
+typedef struct {
+	uint32_t Magic;				// Written last when file is created, so readers never see a partial header
+	uint32_t Version;
+	uint32_t HeaderSize;
+	uint32_t SlotSize;
+	uint32_t NumSlots;
+	uint32_t StatsSize;			// sizeof(TNetUMPSessionStats)
+	uint32_t Reserved[10];
+} TNetUMPMetricsHeader;
+
+struct TNetUMPMetricsSlot {
+	std::atomic<uint32_t> Sequence;		// Seqlock counter (odd while slot is being updated)
+	uint32_t InUse;						// 1 when slot is allocated to a handler
+	uint32_t UpdateTime;				// Handler millisecond counter at last update
+	uint32_t Reserved;
+	char Label[NETUMP_METRICS_LABEL_LEN];	// Free text given when slot is allocated (null terminated)
+	TNetUMPSessionStats Stats;
+};
+
+//! Creates the shared metrics file and allocates slots to handlers
+//! Methods shall be called from control thread only
+class CNetUMPMetricsExport
+{
+public:
+	CNetUMPMetricsExport (void);
+	~CNetUMPMetricsExport (void);
+
+	//! Create (or truncate) the metrics file and map it in memory
+	//! \return false if the file can not be created or mapped (or if target does not support it)
+	bool Open (const char* FilePath, unsigned int NumSlots);
+
+	//! Unmap and close the metrics file. Handlers using slots must have been detached before
+	void Close (void);
+
+	//! Get a free slot to be given to CNetUMPHandler::SetMetricsSlot
+	//! \return 0 if no more slot is available
+	TNetUMPMetricsSlot* AllocateSlot (const char* Label);
+
+	//! Give back a slot. Handler must have been detached from the slot before
+	void ReleaseSlot (TNetUMPMetricsSlot* Slot);
+
+private:
+	uint8_t* MappedArea;
+	size_t MappedSize;
+	int FileHandle;
+	TNetUMPMetricsHeader* Header;
+
+	TNetUMPMetricsSlot* GetSlot (unsigned int SlotIndex);
+};
+
+//! Reads a consistent copy of a slot (helper for monitoring applications)
+//! \return false if slot is not in use or has been updated too many times during the copy
+bool ReadNetUMPMetricsSlot (const TNetUMPMetricsSlot* Slot, TNetUMPMetricsSlot* Copy);
+
+#endif  // __NETUMP_METRICSEXPORT_H__
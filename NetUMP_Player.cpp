@@ -0,0 +1,487 @@
+/*
+ *  NetUMP_Player.cpp
+ *  Timestamp accurate playback of NetUMP recordings
+ *
+ * Copyright (c) 2023 Benoit BOUCHEZ / KissBox
+ * License : MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include "NetUMP_Player.h"
+#include <string.h>
+
+#if defined (__TARGET_LINUX__) || defined (__TARGET_MAC__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#endif
+
+//! Longest sleep of the playback thread (nanoseconds), so tempo, seek and stop requests are taken into account quickly
+#define PLAYER_MAX_SLEEP		5000000ULL
+
+//! Number of blocks read in advance from disk
+#define PLAYER_READAHEAD_BLOCKS	16
+
+//! Returns CLOCK_MONOTONIC time in nanoseconds
+static uint64_t GetMonotonicTime (void)
+{
+#if defined (__TARGET_LINUX__) || defined (__TARGET_MAC__)
+	struct timespec Now;
+
+	clock_gettime (CLOCK_MONOTONIC, &Now);
+	return ((uint64_t)Now.tv_sec*1000000000ULL)+(uint64_t)Now.tv_nsec;
+#else
+	return 0;
+#endif
+}  // GetMonotonicTime
+//---------------------------------------------------------------------------
+
+//! Sleeps until CLOCK_MONOTONIC reaches WakeTime (nanoseconds)
+static void SleepUntil (uint64_t WakeTime)
+{
+#if defined (__TARGET_LINUX__)
+	struct timespec Wake;
+
+	Wake.tv_sec = (time_t)(WakeTime/1000000000ULL);
+	Wake.tv_nsec = (long)(WakeTime%1000000000ULL);
+	while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &Wake, 0) == EINTR);		// Restart only when interrupted by a signal
+#elif defined (__TARGET_MAC__)
+	struct timespec Delay;
+	uint64_t Now;
+
+	Now = GetMonotonicTime();
+	if (WakeTime <= Now) return;
+	Delay.tv_sec = (time_t)((WakeTime-Now)/1000000000ULL);
+	Delay.tv_nsec = (long)((WakeTime-Now)%1000000000ULL);
+	nanosleep (&Delay, 0);
+#endif
+}  // SleepUntil
+//---------------------------------------------------------------------------
+
+CNetUMPPlayer::CNetUMPPlayer (void)
+{
+	MappedArea = 0;
+	MappedSize = 0;
+	FileHandle = -1;
+	Header = 0;
+	Index = 0;
+	Duration = 0;
+	NumOutputs = 0;
+	CursorBlock = 0;
+	CursorRecord = 0;
+	CursorOffset = sizeof(TNetUMPRecordBlockHeader);
+	TempoPercent = 100;
+	Lookahead = NETUMP_PLAYER_LOOKAHEAD*1000;
+	LoopEnabled = false;
+	LoopStart = 0;
+	LoopEnd = 0;
+	SeekRequested = false;
+	SeekPosition = 0;
+	Position = 0;
+	DroppedMessages = 0;
+	StopPlay = false;
+	Playing = false;
+}  // CNetUMPPlayer::CNetUMPPlayer
+//---------------------------------------------------------------------------
+
+CNetUMPPlayer::~CNetUMPPlayer (void)
+{
+	Close();
+}  // CNetUMPPlayer::~CNetUMPPlayer
+//---------------------------------------------------------------------------
+
+bool CNetUMPPlayer::Open (const char* FilePath)
+{
+#if defined (__TARGET_LINUX__) || defined (__TARGET_MAC__)
+	struct stat FileInfo;
+	void* Area;
+	const TNetUMPRecordBlockHeader* LastBlock;
+	uint64_t Time;
+
+	Close();
+
+	FileHandle = open (FilePath, O_RDONLY);
+	if (FileHandle < 0) return false;
+	if ((fstat (FileHandle, &FileInfo) != 0) || ((size_t)FileInfo.st_size < sizeof(TNetUMPRecordHeader)))
+	{
+		Close();
+		return false;
+	}
+
+	MappedSize = (size_t)FileInfo.st_size;
+	Area = mmap (0, MappedSize, PROT_READ, MAP_SHARED, FileHandle, 0);
+	if (Area == MAP_FAILED)
+	{
+		MappedSize = 0;
+		Close();
+		return false;
+	}
+	MappedArea = (const uint8_t*)Area;
+	madvise (Area, MappedSize, MADV_SEQUENTIAL);
+
+	// Check that file is a recording and that all used blocks are in the file
+	Header = (const TNetUMPRecordHeader*)MappedArea;
+	if ((Header->Magic != NETUMP_RECORD_MAGIC) || (Header->Version != NETUMP_RECORD_VERSION) ||
+		(Header->BlockSize != NETUMP_RECORD_BLOCK_SIZE) || (Header->UsedBlocks > Header->NumBlocks) ||
+		(Header->HeaderSize+((uint64_t)Header->NumBlocks*sizeof(TNetUMPRecordIndexEntry)) > Header->DataOffset) ||
+		(Header->DataOffset+((uint64_t)Header->UsedBlocks*NETUMP_RECORD_BLOCK_SIZE) > MappedSize))
+	{
+		Close();
+		return false;
+	}
+	Index = (const TNetUMPRecordIndexEntry*)(MappedArea+Header->HeaderSize);
+
+	// Duration is the time of the last record of the last block
+	Duration = 0;
+	if (Header->UsedBlocks > 0)
+	{
+		CursorBlock = Header->UsedBlocks-1;
+		CursorRecord = 0;
+		CursorOffset = sizeof(TNetUMPRecordBlockHeader);
+		LastBlock = GetBlock (CursorBlock);
+		while (GetCursorRecord(&Time) != 0)
+		{
+			Duration = Time;
+			if (CursorRecord+1 >= LastBlock->NumRecords) break;
+			NextRecord();
+		}
+	}
+
+	SetCursor (0);
+	Position = 0;
+	DroppedMessages = 0;
+	return true;
+#else
+	return false;
+#endif
+}  // CNetUMPPlayer::Open
+//---------------------------------------------------------------------------
+
+void CNetUMPPlayer::Close (void)
+{
+	Stop();
+
+#if defined (__TARGET_LINUX__) || defined (__TARGET_MAC__)
+	if (MappedArea)
+		munmap ((void*)MappedArea, MappedSize);
+	if (FileHandle >= 0)
+		close (FileHandle);
+#endif
+	MappedArea = 0;
+	MappedSize = 0;
+	FileHandle = -1;
+	Header = 0;
+	Index = 0;
+	Duration = 0;
+}  // CNetUMPPlayer::Close
+//---------------------------------------------------------------------------
+
+bool CNetUMPPlayer::AddOutput (CNetUMPHandler* Handler, int Source)
+{
+	if (NumOutputs >= NETUMP_PLAYER_MAX_OUTPUTS) return false;
+
+	Outputs[NumOutputs].Handler = Handler;
+	Outputs[NumOutputs].Source = Source;
+	NumOutputs++;
+	return true;
+}  // CNetUMPPlayer::AddOutput
+//---------------------------------------------------------------------------
+
+void CNetUMPPlayer::ClearOutputs (void)
+{
+	NumOutputs = 0;
+}  // CNetUMPPlayer::ClearOutputs
+//---------------------------------------------------------------------------
+
+uint64_t CNetUMPPlayer::GetDuration (void)
+{
+	return Duration/1000;
+}  // CNetUMPPlayer::GetDuration
+//---------------------------------------------------------------------------
+
+void CNetUMPPlayer::SetTempo (unsigned int Percent)
+{
+	if (Percent == 0) Percent = 1;
+	if (Percent > NETUMP_PLAYER_MAX_TEMPO) Percent = NETUMP_PLAYER_MAX_TEMPO;		// Elapsed nanoseconds * tempo must fit in 64 bits
+	TempoPercent = Percent;
+}  // CNetUMPPlayer::SetTempo
+//---------------------------------------------------------------------------
+
+void CNetUMPPlayer::SetLoop (bool Enable, uint64_t StartTime, uint64_t EndTime)
+{
+	LoopEnabled = false;
+	LoopStart = StartTime*1000;
+	LoopEnd = EndTime*1000;
+	LoopEnabled = Enable;
+}  // CNetUMPPlayer::SetLoop
+//---------------------------------------------------------------------------
+
+void CNetUMPPlayer::SetLookahead (unsigned int Microseconds)
+{
+	Lookahead = Microseconds*1000;
+}  // CNetUMPPlayer::SetLookahead
+//---------------------------------------------------------------------------
+
+void CNetUMPPlayer::Seek (uint64_t Position)
+{
+	if (Playing)
+	{  // Cursor belongs to playback thread
+		SeekPosition = Position*1000;
+		SeekRequested = true;
+	}
+	else if (Header)
+	{
+		SetCursor (Position*1000);
+		this->Position = Position*1000;
+	}
+}  // CNetUMPPlayer::Seek
+//---------------------------------------------------------------------------
+
+bool CNetUMPPlayer::Start (void)
+{
+	if (Header == 0) return false;
+	Stop();
+
+	StopPlay = false;
+	Playing = true;
+	PlayThread = std::thread (&CNetUMPPlayer::PlayTask, this);
+	return true;
+}  // CNetUMPPlayer::Start
+//---------------------------------------------------------------------------
+
+void CNetUMPPlayer::Stop (void)
+{
+	if (PlayThread.joinable())
+	{
+		StopPlay = true;
+		PlayThread.join();
+	}
+	Playing = false;
+
+	// Seek requested just before playback ended
+	if ((SeekRequested.exchange(false)) && (Header))
+	{
+		SetCursor (SeekPosition);
+		Position = SeekPosition.load();
+	}
+}  // CNetUMPPlayer::Stop
+//---------------------------------------------------------------------------
+
+bool CNetUMPPlayer::IsPlaying (void)
+{
+	return Playing;
+}  // CNetUMPPlayer::IsPlaying
+//---------------------------------------------------------------------------
+
+uint64_t CNetUMPPlayer::GetPosition (void)
+{
+	return Position/1000;
+}  // CNetUMPPlayer::GetPosition
+//---------------------------------------------------------------------------
+
+uint64_t CNetUMPPlayer::GetDroppedMessages (void)
+{
+	return DroppedMessages;
+}  // CNetUMPPlayer::GetDroppedMessages
+//---------------------------------------------------------------------------
+
+const TNetUMPRecordBlockHeader* CNetUMPPlayer::GetBlock (uint32_t BlockIndex)
+{
+	return (const TNetUMPRecordBlockHeader*)(MappedArea+Header->DataOffset+((uint64_t)BlockIndex*NETUMP_RECORD_BLOCK_SIZE));
+}  // CNetUMPPlayer::GetBlock
+//---------------------------------------------------------------------------
+
+void CNetUMPPlayer::SetCursor (uint64_t Time)
+{
+	uint32_t Low;
+	uint32_t High;
+	uint32_t Middle;
+	uint64_t RecordTime;
+
+	CursorBlock = 0;
+	CursorRecord = 0;
+	CursorOffset = sizeof(TNetUMPRecordBlockHeader);
+	if (Header->UsedBlocks == 0) return;
+
+	// Last block starting at or before Time
+	Low = 0;
+	High = Header->UsedBlocks-1;
+	while (Low < High)
+	{
+		Middle = (Low+High+1)/2;
+		if (Index[Middle].FirstTime <= Time) Low = Middle;
+		else High = Middle-1;
+	}
+	CursorBlock = Low;
+
+	// Then first record at or after Time in this block (or first record of next block)
+	while (GetCursorRecord(&RecordTime) != 0)
+	{
+		if (RecordTime >= Time) return;
+		NextRecord();
+	}
+}  // CNetUMPPlayer::SetCursor
+//---------------------------------------------------------------------------
+
+const TNetUMPRecord* CNetUMPPlayer::GetCursorRecord (uint64_t* Time)
+{
+	const TNetUMPRecordBlockHeader* Block;
+	const TNetUMPRecord* Record;
+
+	if (CursorBlock >= Header->UsedBlocks) return 0;
+
+	Block = GetBlock (CursorBlock);
+	if ((Block->Magic != NETUMP_RECORD_BLOCK_MAGIC) || (CursorRecord >= Block->NumRecords)) return 0;
+	if ((CursorOffset+sizeof(TNetUMPRecord) > Block->UsedBytes) || (Block->UsedBytes > NETUMP_RECORD_BLOCK_SIZE)) return 0;
+
+	Record = (const TNetUMPRecord*)((const uint8_t*)Block+CursorOffset);
+	if ((Record->Size > 4) || (CursorOffset+sizeof(TNetUMPRecord)+(Record->Size*4) > Block->UsedBytes)) return 0;
+
+	*Time = Block->BaseTime+((uint64_t)Record->Time*1000);
+	return Record;
+}  // CNetUMPPlayer::GetCursorRecord
+//---------------------------------------------------------------------------
+
+void CNetUMPPlayer::NextRecord (void)
+{
+	const TNetUMPRecordBlockHeader* Block;
+	const TNetUMPRecord* Record;
+
+	Block = GetBlock (CursorBlock);
+	Record = (const TNetUMPRecord*)((const uint8_t*)Block+CursorOffset);
+	CursorOffset += sizeof(TNetUMPRecord)+(Record->Size*4);
+	CursorRecord++;
+
+	if (CursorRecord >= Block->NumRecords)
+	{  // Go to next block, and ask the system to read the following ones
+		CursorBlock++;
+		CursorRecord = 0;
+		CursorOffset = sizeof(TNetUMPRecordBlockHeader);
+#if defined (__TARGET_LINUX__) || defined (__TARGET_MAC__)
+		if (CursorBlock+PLAYER_READAHEAD_BLOCKS < Header->UsedBlocks)
+			madvise ((void*)GetBlock(CursorBlock+PLAYER_READAHEAD_BLOCKS), NETUMP_RECORD_BLOCK_SIZE, MADV_WILLNEED);
+#endif
+	}
+}  // CNetUMPPlayer::NextRecord
+//---------------------------------------------------------------------------
+
+void CNetUMPPlayer::PlayRecord (const TNetUMPRecord* Record)
+{
+	uint32_t UMP[4];
+
+	if ((Record->Type != NETUMP_RECORD_UMP) || (Record->Size == 0)) return;
+	memcpy (&UMP[0], Record+1, Record->Size*4);
+
+	for (unsigned int OutputIdx=0; OutputIdx<NumOutputs; OutputIdx++)
+	{
+		if ((Outputs[OutputIdx].Source < 0) || (Outputs[OutputIdx].Source == Record->Source))
+		{
+			if (Outputs[OutputIdx].Handler->SendUMPMessage (&UMP[0]) == false)
+				DroppedMessages++;
+		}
+	}
+}  // CNetUMPPlayer::PlayRecord
+//---------------------------------------------------------------------------
+
+void CNetUMPPlayer::PlayTask (void)
+{
+	const TNetUMPRecord* Record;
+	uint64_t RecordTime;
+	uint64_t AnchorClock;		// Clock time at which AnchorTime is played
+	uint64_t AnchorTime;		// Recording time (nanoseconds)
+	unsigned int Tempo;
+	uint64_t Now;
+	uint64_t DueTime;
+	uint64_t LoopEndTime;
+	bool Loop;
+
+	Tempo = TempoPercent;
+	AnchorTime = Position;
+	AnchorClock = GetMonotonicTime();
+
+	while (StopPlay == false)
+	{
+		Now = GetMonotonicTime();
+
+		if (SeekRequested.exchange(false))
+		{
+			AnchorTime = SeekPosition;
+			AnchorClock = Now;
+			SetCursor (AnchorTime);
+		}
+
+		if (TempoPercent != Tempo)
+		{  // New tempo applies from current recording time
+			if (Now > AnchorClock)
+				AnchorTime += ((Now-AnchorClock)*Tempo)/100;
+			AnchorClock = Now;
+			Tempo = TempoPercent;
+		}
+
+		Loop = LoopEnabled;
+		LoopEndTime = LoopEnd;
+		if (LoopEndTime == 0) LoopEndTime = Duration+1;
+		if (LoopEndTime <= LoopStart) Loop = false;
+
+		Record = GetCursorRecord (&RecordTime);
+		if ((Record == 0) || ((Loop) && (RecordTime >= LoopEndTime)))
+		{
+			if (Loop == false) break;		// End of recording
+
+			// Loop start is played when loop end would have been played
+			DueTime = AnchorClock;
+			if (LoopEndTime > AnchorTime)
+				DueTime += ((LoopEndTime-AnchorTime)*100)/Tempo;
+			if (DueTime > Now)
+			{
+				if (DueTime > Now+PLAYER_MAX_SLEEP) DueTime = Now+PLAYER_MAX_SLEEP;
+				SleepUntil (DueTime);
+				continue;
+			}
+			AnchorClock = DueTime;
+			AnchorTime = LoopStart;
+			SetCursor (AnchorTime);
+			continue;
+		}
+
+		DueTime = AnchorClock;
+		if (RecordTime > AnchorTime)
+			DueTime += ((RecordTime-AnchorTime)*100)/Tempo;
+
+		if (DueTime > Now+Lookahead)
+		{
+			DueTime -= Lookahead;
+			if (DueTime > Now+PLAYER_MAX_SLEEP) DueTime = Now+PLAYER_MAX_SLEEP;
+			SleepUntil (DueTime);
+			continue;
+		}
+
+		PlayRecord (Record);
+		Position = RecordTime;
+		NextRecord();
+	}
+
+	Playing = false;
+}  // CNetUMPPlayer::PlayTask
+//---------------------------------------------------------------------------
@@ -0,0 +1,155 @@
+/*
+ *  NetUMP_Player.h
+ *  Timestamp accurate playback of NetUMP recordings
+ *
+ * Copyright (c) 2023 Benoit BOUCHEZ / KissBox
+ * License : MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#ifndef __NETUMP_PLAYER_H__
+#define __NETUMP_PLAYER_H__
+
+#include "NetUMP.h"
+#include "NetUMP_Recorder.h"
+#include <atomic>
+#include <thread>
+
+//! Maximum number of handlers fed by a player
+#define NETUMP_PLAYER_MAX_OUTPUTS	16
+
+//! Default time (microseconds) messages are given to handlers before their due time, to absorb the 1 ms transmit tick
+#define NETUMP_PLAYER_LOOKAHEAD		500
+
+//! Highest playback speed accepted by SetTempo, in percent of recorded speed
+#define NETUMP_PLAYER_MAX_TEMPO		10000
+
+//! Handler fed by the player
+typedef struct {
+	CNetUMPHandler* Handler;
+	int Source;					// Source number of the recorded messages to send (-1 : all sources)
+} TNetUMPPlayerOutput;
+
+//! Plays a recording made by CNetUMPRecorder on one or more handlers, with the recorded timing
+//! The file is mapped in memory and read by a playback thread scheduled on CLOCK_MONOTONIC. Nothing is allocated
+//! while playing, so recordings of any length can be played. Session events of the recording are not replayed
+//! Open, Close and AddOutput shall be called while playback is stopped. Other methods can be called at any time
+class CNetUMPPlayer
+{
+public:
+	CNetUMPPlayer (void);
+	~CNetUMPPlayer (void);
+
+	//! Map a recording file in memory
+	//! \return false if the file can not be opened or is not a valid recording (or if target does not support it)
+	bool Open (const char* FilePath);
+
+	//! Stop playback and release the recording file
+	void Close (void);
+
+	//! Send the messages recorded from Source (-1 : all sources) to Handler
+	//! \return false if NETUMP_PLAYER_MAX_OUTPUTS outputs are already declared
+	bool AddOutput (CNetUMPHandler* Handler, int Source);
+
+	//! Remove all outputs
+	void ClearOutputs (void);
+
+	//! Time of the last record, in microseconds from the beginning of the recording
+	uint64_t GetDuration (void);
+
+	//! Playback speed in percent of recorded speed (100 : recorded speed, 200 : twice faster). Applies immediately
+	//! Percent is clamped to 1..NETUMP_PLAYER_MAX_TEMPO (10000, a hundred times faster)
+	void SetTempo (unsigned int Percent);
+
+	//! Play again from StartTime when EndTime is reached (microseconds). EndTime = 0 loops at the end of the recording
+	void SetLoop (bool Enable, uint64_t StartTime, uint64_t EndTime);
+
+	//! Time messages are given to handlers before their due time (microseconds)
+	void SetLookahead (unsigned int Microseconds);
+
+	//! Move playback position (microseconds from beginning of recording), using the block index
+	void Seek (uint64_t Position);
+
+	//! Start playback thread from current position
+	//! \return false if no recording is opened or if playback thread can not be started
+	bool Start (void);
+
+	//! Stop playback. Position is kept, so Start continues from where playback stopped
+	void Stop (void);
+
+	//! Returns false when playback has been stopped or end of recording has been reached
+	bool IsPlaying (void);
+
+	//! Time of the last message played (microseconds from beginning of recording)
+	uint64_t GetPosition (void);
+
+	//! Messages not sent because a handler refused them (session not opened or transmit queue full)
+	uint64_t GetDroppedMessages (void);
+
+private:
+	const uint8_t* MappedArea;
+	size_t MappedSize;
+	int FileHandle;
+	const TNetUMPRecordHeader* Header;
+	const TNetUMPRecordIndexEntry* Index;
+	uint64_t Duration;						// Nanoseconds
+
+	TNetUMPPlayerOutput Outputs[NETUMP_PLAYER_MAX_OUTPUTS];
+	unsigned int NumOutputs;
+
+	// Read position (only used by playback thread while playing)
+	uint32_t CursorBlock;
+	uint32_t CursorRecord;					// Record number in block
+	uint32_t CursorOffset;					// Offset of record in block
+
+	std::atomic<unsigned int> TempoPercent;
+	std::atomic<unsigned int> Lookahead;	// Nanoseconds
+	std::atomic<bool> LoopEnabled;
+	std::atomic<uint64_t> LoopStart;		// Nanoseconds
+	std::atomic<uint64_t> LoopEnd;			// Nanoseconds (0 : end of recording)
+	std::atomic<bool> SeekRequested;
+	std::atomic<uint64_t> SeekPosition;		// Nanoseconds
+	std::atomic<uint64_t> Position;			// Nanoseconds
+	std::atomic<uint64_t> DroppedMessages;
+
+	std::thread PlayThread;
+	std::atomic<bool> StopPlay;
+	std::atomic<bool> Playing;
+
+	const TNetUMPRecordBlockHeader* GetBlock (uint32_t BlockIndex);
+
+	//! Place cursor on first record at or after Time (nanoseconds)
+	void SetCursor (uint64_t Time);
+
+	//! Returns record under cursor and its time in nanoseconds (0 at end of recording)
+	const TNetUMPRecord* GetCursorRecord (uint64_t* Time);
+
+	//! Move cursor to next record
+	void NextRecord (void);
+
+	//! Sends a recorded UMP message to the outputs declared for its source
+	void PlayRecord (const TNetUMPRecord* Record);
+
+	void PlayTask (void);
+};
+
+#endif  // __NETUMP_PLAYER_H__
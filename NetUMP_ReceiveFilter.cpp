@@ -0,0 +1,159 @@
+/*
+ *  NetUMP_ReceiveFilter.cpp
+ *  Generic class for NetUMP session initiator/listener
+ *  Receive filter (rules compiled into lookup tables, applied before messages are delivered)
+ *
+ * Copyright (c) 2023 Benoit BOUCHEZ / KissBox
+ * License : MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include "NetUMP.h"
+#include <string.h>
+
+//! Opcodes of messages carrying a note number, per MT (bit N : opcode N)
+//! MT=2 : note off/on, poly pressure. MT=4 : same, plus per-note controllers, per-note pitch bend and per-note management
+static const uint16_t FilterNoteOpcodes[16] = {0, 0, 0x0700, 0, 0x8743, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+bool CNetUMPHandler::SetReceiveFilter (const TNetUMPFilterRule* Rules, unsigned int NumRules, unsigned int DefaultAction)
+{
+	const TNetUMPFilterRule* Rule;
+	uint32_t RuleBit;
+	unsigned int MT;
+
+	if (NumRules > NETUMP_MAX_FILTER_RULES) return false;
+
+	LockRealtimeThread();
+
+	memset (&FilterTypeTable[0], 0, sizeof(FilterTypeTable));
+	memset (&FilterStatusTable[0][0], 0, sizeof(FilterStatusTable));
+	memset (&FilterNoteTable[0], 0, sizeof(FilterNoteTable));
+	memset (&FilterCounters[0], 0, sizeof(FilterCounters));
+	FilterAnyNoteRules = 0;
+	FilterDropRules = 0;
+	FilterDefaultDrop = (DefaultAction == NETUMP_FILTER_DROP);
+	FilterNumRules = NumRules;
+
+	// Each rule sets its bit in the entries it matches. A message matches the rules set in all the entries it selects
+	for (unsigned int RuleIdx=0; RuleIdx<NumRules; RuleIdx++)
+	{
+		Rule = &Rules[RuleIdx];
+		RuleBit = 1u<<RuleIdx;
+
+		for (unsigned int Byte=0; Byte<256; Byte++)
+		{
+			MT = Byte>>4;
+			if ((Rule->MTMask&(1u<<MT)) == 0) continue;
+			if ((MT == 0) || (MT == 0xF) || (Rule->GroupMask&(1u<<(Byte&0x0F))))
+				FilterTypeTable[Byte] |= RuleBit;
+		}
+
+		for (MT=0; MT<16; MT++)
+		{
+			if ((Rule->MTMask&(1u<<MT)) == 0) continue;
+			for (unsigned int Byte=0; Byte<256; Byte++)
+			{
+				if ((Byte&Rule->StatusMask) != (Rule->Status&Rule->StatusMask)) continue;
+				if (((MT == 2) || (MT == 4)) && ((Rule->ChannelMask&(1u<<(Byte&0x0F))) == 0)) continue;
+				FilterStatusTable[MT][Byte] |= RuleBit;
+			}
+		}
+
+		if ((Rule->NoteLow == 0) && (Rule->NoteHigh >= 127))
+			FilterAnyNoteRules |= RuleBit;
+		for (unsigned int Note=Rule->NoteLow; (Note<=Rule->NoteHigh) && (Note<128); Note++)
+			FilterNoteTable[Note] |= RuleBit;
+
+		if (Rule->Action == NETUMP_FILTER_DROP)
+			FilterDropRules |= RuleBit;
+	}
+
+	FilterActive = (NumRules > 0);
+	UnlockRealtimeThread();
+	return true;
+}  // CNetUMPHandler::SetReceiveFilter
+//--------------------------------------------------------------------------
+
+unsigned int CNetUMPHandler::GetReceiveFilterCounters (uint64_t* Counters)
+{
+	unsigned int NumRules;
+
+	// Counters are written by the realtime thread and rules can be replaced by SetReceiveFilter during the copy
+	LockRealtimeThread();
+	NumRules = FilterNumRules;
+	for (unsigned int RuleIdx=0; RuleIdx<=NumRules; RuleIdx++)
+		Counters[RuleIdx] = FilterCounters[RuleIdx];
+	UnlockRealtimeThread();
+	return NumRules;
+}  // CNetUMPHandler::GetReceiveFilterCounters
+//--------------------------------------------------------------------------
+
+unsigned int CNetUMPHandler::FilterUMPBlock (unsigned char* Payload, unsigned int PayloadLength)
+{
+	unsigned int ReadPos = 0;
+	unsigned int WritePos = 0;
+	unsigned int MessageSize;
+	unsigned int MT;
+	uint32_t Matches;
+	unsigned int RuleIdx;
+	bool Drop;
+
+	while (ReadPos < PayloadLength)
+	{
+		MT = Payload[ReadPos*4]>>4;
+		MessageSize = NetUMPMessageSize ((uint32_t)MT<<28);
+
+		// Three table lookups give the rules matching the message
+		Matches = FilterTypeTable[Payload[ReadPos*4]] & FilterStatusTable[MT][Payload[(ReadPos*4)+1]];
+		if ((FilterNoteOpcodes[MT]>>(Payload[(ReadPos*4)+1]>>4))&1)
+			Matches &= FilterNoteTable[Payload[(ReadPos*4)+2]&0x7F];
+		else
+			Matches &= FilterAnyNoteRules;
+
+		if (Matches != 0)
+		{  // First matching rule decides
+			RuleIdx = 0;
+			while ((Matches&1) == 0)
+			{
+				Matches >>= 1;
+				RuleIdx++;
+			}
+			FilterCounters[RuleIdx]++;
+			Drop = (FilterDropRules&(1u<<RuleIdx)) != 0;
+		}
+		else
+		{
+			FilterCounters[FilterNumRules]++;
+			Drop = FilterDefaultDrop;
+		}
+
+		// Accepted messages are moved to fill the space left by dropped ones
+		if (Drop == false)
+		{
+			if (WritePos != ReadPos)
+				memmove (&Payload[WritePos*4], &Payload[ReadPos*4], MessageSize*4);
+			WritePos += MessageSize;
+		}
+		ReadPos += MessageSize;
+	}
+	return WritePos;
+}  // CNetUMPHandler::FilterUMPBlock
+//--------------------------------------------------------------------------
@@ -0,0 +1,83 @@
+/*
+ *  NetUMP_ReceiveQueue.cpp
+ *  Generic class for NetUMP session initiator/listener
+ *  Receive queue (received UMP messages read by application thread instead of callback)
+ *
+ * Copyright (c) 2023 Benoit BOUCHEZ / KissBox
+ * License : MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include "NetUMP.h"
+#if defined (__TARGET_LINUX__)
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+void CNetUMPHandler::SelectReceiveQueueMode (bool UseQueue)
+{
+	LockRealtimeThread();
+	UseReceiveQueue = UseQueue;
+
+#if defined (__TARGET_LINUX__)
+	if ((UseQueue) && (RxEventHandle < 0))
+		RxEventHandle = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+	UnlockRealtimeThread();
+}  // CNetUMPHandler::SelectReceiveQueueMode
+//--------------------------------------------------------------------------
+
+unsigned int CNetUMPHandler::ReadUMPMessages (TNetUMPRxMessage* Messages, unsigned int MaxMessages)
+{
+	unsigned int ReadPtr;
+	unsigned int WritePtr;
+	unsigned int Count = 0;
+
+	ReadPtr = RxQueueReadPtr.load(std::memory_order_relaxed);
+	WritePtr = RxQueueWritePtr.load(std::memory_order_acquire);		// Snapshot : messages stored after are read on next call
+
+	while ((ReadPtr != WritePtr) && (Count < MaxMessages))
+	{
+		Messages[Count] = RxQueue[ReadPtr];
+		Count++;
+		ReadPtr = (ReadPtr+1)&(UMP_RX_QUEUE_SIZE-1);
+	}
+
+	// Give the entries back to the realtime thread
+	RxQueueReadPtr.store(ReadPtr, std::memory_order_release);
+	return Count;
+}  // CNetUMPHandler::ReadUMPMessages
+//--------------------------------------------------------------------------
+
+int CNetUMPHandler::GetReceiveEventHandle (void)
+{
+	return RxEventHandle;
+}  // CNetUMPHandler::GetReceiveEventHandle
+//--------------------------------------------------------------------------
+
+void CNetUMPHandler::SignalReceiveEvent (void)
+{
+#if defined (__TARGET_LINUX__)
+	if (RxEventHandle >= 0)
+		eventfd_write (RxEventHandle, 1);		// Non blocking : counter saturation can not happen with one write per millisecond
+#endif
+}  // CNetUMPHandler::SignalReceiveEvent
+//--------------------------------------------------------------------------
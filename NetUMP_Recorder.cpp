@@ -0,0 +1,342 @@
+/*
+ *  NetUMP_Recorder.cpp
+ *  Append-only recording of received UMP in a memory mapped file
+ *
+ * Copyright (c) 2023 Benoit BOUCHEZ / KissBox
+ * License : MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include "NetUMP_Recorder.h"
+#include "SystemSleep.h"
+#include <string.h>
+
+#if defined (__TARGET_LINUX__) || defined (__TARGET_MAC__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#endif
+
+//! Milliseconds between two runs of the flush thread
+#define RECORD_FLUSH_INTERVAL		20
+
+//! Number of blocks kept mapped in memory in front of the writer (4 MB)
+#define RECORD_PREFAULT_BLOCKS		64
+
+//! Largest time offset of a record in a block (microseconds)
+#define RECORD_MAX_TIME_OFFSET		0xFFFFFFFFULL
+
+CNetUMPRecorder::CNetUMPRecorder (void)
+{
+	MappedArea = 0;
+	MappedSize = 0;
+	FileHandle = -1;
+	Header = 0;
+	Index = 0;
+	StartTime = 0;
+	WriteLock.clear();
+	Block = 0;
+	WriteBlock = 0;
+	UsedBlocks = 0;
+	RecordCount = 0;
+	DroppedRecords = 0;
+	StopFlush = false;
+	FlushedBlocks = 0;
+	PrefaultedBlocks = 0;
+}  // CNetUMPRecorder::CNetUMPRecorder
+//---------------------------------------------------------------------------
+
+CNetUMPRecorder::~CNetUMPRecorder (void)
+{
+	Close();
+}  // CNetUMPRecorder::~CNetUMPRecorder
+//---------------------------------------------------------------------------
+
+bool CNetUMPRecorder::Open (const char* FilePath, unsigned int SizeMB)
+{
+#if defined (__TARGET_LINUX__) || defined (__TARGET_MAC__)
+	uint32_t NumBlocks;
+	uint64_t DataOffset;
+	void* Area;
+
+	Close();
+	NumBlocks = (uint32_t)(((uint64_t)SizeMB*1024*1024)/NETUMP_RECORD_BLOCK_SIZE);
+	if (NumBlocks == 0) return false;
+
+	// Data blocks are aligned on block size, so each one starts on a page boundary
+	DataOffset = sizeof(TNetUMPRecordHeader)+((uint64_t)NumBlocks*sizeof(TNetUMPRecordIndexEntry));
+	DataOffset = (DataOffset+NETUMP_RECORD_BLOCK_SIZE-1) & ~((uint64_t)NETUMP_RECORD_BLOCK_SIZE-1);
+	MappedSize = (size_t)(DataOffset+((uint64_t)NumBlocks*NETUMP_RECORD_BLOCK_SIZE));
+
+	FileHandle = open (FilePath, O_RDWR|O_CREAT|O_TRUNC, 0644);
+	if (FileHandle < 0) return false;
+
+	// Disk space is reserved now : writing in the mapped file can not fail later because the disk is full
+#if defined (__TARGET_LINUX__)
+	if (posix_fallocate (FileHandle, 0, (off_t)MappedSize) != 0)
+#else
+	if (ftruncate (FileHandle, (off_t)MappedSize) != 0)
+#endif
+	{
+		close (FileHandle);
+		FileHandle = -1;
+		return false;
+	}
+
+	Area = mmap (0, MappedSize, PROT_READ|PROT_WRITE, MAP_SHARED, FileHandle, 0);
+	if (Area == MAP_FAILED)
+	{
+		close (FileHandle);
+		FileHandle = -1;
+		return false;
+	}
+	MappedArea = (uint8_t*)Area;
+
+	Header = (TNetUMPRecordHeader*)MappedArea;
+	Index = (TNetUMPRecordIndexEntry*)(MappedArea+sizeof(TNetUMPRecordHeader));
+	StartTime = 0;
+	StartTime = GetRecordTime();
+
+	Block = 0;
+	WriteBlock = 0;
+	UsedBlocks = 0;
+	RecordCount = 0;
+	DroppedRecords = 0;
+	FlushedBlocks = 0;
+	PrefaultedBlocks = 0;
+	PrefaultBlocks (RECORD_PREFAULT_BLOCKS);
+
+	Header->Version = NETUMP_RECORD_VERSION;
+	Header->HeaderSize = sizeof(TNetUMPRecordHeader);
+	Header->BlockSize = NETUMP_RECORD_BLOCK_SIZE;
+	Header->NumBlocks = NumBlocks;
+	Header->UsedBlocks = 0;
+	Header->DataOffset = DataOffset;
+	Header->StartTime = StartTime;
+	Header->RecordCount = 0;
+	Header->DroppedRecords = 0;
+	std::atomic_thread_fence (std::memory_order_release);
+	Header->Magic = NETUMP_RECORD_MAGIC;
+
+	StopFlush = false;
+	FlushThread = std::thread (&CNetUMPRecorder::FlushTask, this);
+
+	return true;
+#else
+	return false;
+#endif
+}  // CNetUMPRecorder::Open
+//---------------------------------------------------------------------------
+
+void CNetUMPRecorder::Close (void)
+{
+	if (FlushThread.joinable())
+	{
+		StopFlush = true;
+		FlushThread.join();
+	}
+
+#if defined (__TARGET_LINUX__) || defined (__TARGET_MAC__)
+	if (MappedArea)
+	{
+		UpdateHeader();
+		msync (MappedArea, MappedSize, MS_SYNC);
+		munmap (MappedArea, MappedSize);
+	}
+	if (FileHandle >= 0)
+		close (FileHandle);
+#endif
+	MappedArea = 0;
+	MappedSize = 0;
+	FileHandle = -1;
+	Header = 0;
+	Index = 0;
+	Block = 0;
+}  // CNetUMPRecorder::Close
+//---------------------------------------------------------------------------
+
+TNetUMPRecordBlockHeader* CNetUMPRecorder::GetBlock (uint32_t BlockIndex)
+{
+	return (TNetUMPRecordBlockHeader*)(MappedArea+Header->DataOffset+((uint64_t)BlockIndex*NETUMP_RECORD_BLOCK_SIZE));
+}  // CNetUMPRecorder::GetBlock
+//---------------------------------------------------------------------------
+
+uint64_t CNetUMPRecorder::GetRecordTime (void)
+{
+#if defined (__TARGET_LINUX__) || defined (__TARGET_MAC__)
+	struct timespec Now;
+
+	clock_gettime (CLOCK_MONOTONIC, &Now);
+	return ((uint64_t)Now.tv_sec*1000000000ULL)+(uint64_t)Now.tv_nsec-StartTime;
+#else
+	return 0;
+#endif
+}  // CNetUMPRecorder::GetRecordTime
+//---------------------------------------------------------------------------
+
+bool CNetUMPRecorder::StartBlock (uint64_t Time)
+{
+	uint32_t NewBlock;
+
+	NewBlock = (Block == 0) ? 0 : WriteBlock+1;
+	if (NewBlock >= Header->NumBlocks) return false;
+
+	WriteBlock = NewBlock;
+	Block = GetBlock (NewBlock);
+	Block->Magic = NETUMP_RECORD_BLOCK_MAGIC;
+	Block->BlockIndex = NewBlock;
+	Block->BaseTime = Time;
+	Block->NumRecords = 0;
+	Block->UsedBytes = sizeof(TNetUMPRecordBlockHeader);
+	Index[NewBlock].FirstTime = Time;
+	Index[NewBlock].FirstRecord = RecordCount.load (std::memory_order_relaxed);
+
+	// Previous block can now be written to disk
+	UsedBlocks.store (NewBlock+1, std::memory_order_release);
+	return true;
+}  // CNetUMPRecorder::StartBlock
+//---------------------------------------------------------------------------
+
+void CNetUMPRecorder::AppendRecord (uint64_t Time, unsigned int Type, unsigned int Source, unsigned int Event, const uint32_t* UMP, unsigned int Size)
+{
+	TNetUMPRecord* Record;
+	unsigned int RecordSize;
+
+	RecordSize = sizeof(TNetUMPRecord)+(Size*4);
+	if ((Block == 0) || (Block->UsedBytes+RecordSize > NETUMP_RECORD_BLOCK_SIZE) || ((Time-Block->BaseTime)/1000 > RECORD_MAX_TIME_OFFSET))
+	{
+		if (StartBlock (Time) == false)
+		{  // File is full
+			DroppedRecords.fetch_add (1, std::memory_order_relaxed);
+			return;
+		}
+	}
+
+	Record = (TNetUMPRecord*)((uint8_t*)Block+Block->UsedBytes);
+	Record->Time = (uint32_t)((Time-Block->BaseTime)/1000);
+	Record->Type = (uint8_t)Type;
+	Record->Source = (uint8_t)Source;
+	Record->Size = (uint8_t)Size;
+	Record->Event = (uint8_t)Event;
+	if (Size > 0)
+		memcpy (Record+1, UMP, Size*4);
+
+	Block->UsedBytes += RecordSize;
+	Block->NumRecords++;
+	RecordCount.fetch_add (1, std::memory_order_relaxed);
+}  // CNetUMPRecorder::AppendRecord
+//---------------------------------------------------------------------------
+
+void CNetUMPRecorder::RecordUMPBlock (unsigned int Source, const unsigned char* Payload, unsigned int PayloadLength)
+{
+	uint64_t Time;
+
+	if (Header == 0) return;
+
+	while (WriteLock.test_and_set (std::memory_order_acquire));
+	// Time is read inside the lock so records are always in time order in the file
+	Time = GetRecordTime();
+	auto Append = [this, Time, Source] (uint32_t* UMPMsg, unsigned int Size) { AppendRecord (Time, NETUMP_RECORD_UMP, Source, 0, UMPMsg, Size); };
+	NetUMPDecodeBlock (Payload, PayloadLength, Append);
+	WriteLock.clear (std::memory_order_release);
+}  // CNetUMPRecorder::RecordUMPBlock
+//---------------------------------------------------------------------------
+
+void CNetUMPRecorder::RecordUMP (unsigned int Source, const uint32_t* UMP)
+{
+	if (Header == 0) return;
+
+	while (WriteLock.test_and_set (std::memory_order_acquire));
+	AppendRecord (GetRecordTime(), NETUMP_RECORD_UMP, Source, 0, UMP, NetUMPMessageSize(UMP[0]));
+	WriteLock.clear (std::memory_order_release);
+}  // CNetUMPRecorder::RecordUMP
+//---------------------------------------------------------------------------
+
+void CNetUMPRecorder::RecordEvent (unsigned int Source, unsigned int Event)
+{
+	if (Header == 0) return;
+
+	while (WriteLock.test_and_set (std::memory_order_acquire));
+	AppendRecord (GetRecordTime(), NETUMP_RECORD_EVENT, Source, Event, 0, 0);
+	WriteLock.clear (std::memory_order_release);
+}  // CNetUMPRecorder::RecordEvent
+//---------------------------------------------------------------------------
+
+uint64_t CNetUMPRecorder::GetDroppedRecords (void)
+{
+	return DroppedRecords.load (std::memory_order_relaxed);
+}  // CNetUMPRecorder::GetDroppedRecords
+//---------------------------------------------------------------------------
+
+void CNetUMPRecorder::PrefaultBlocks (uint32_t UpToBlock)
+{
+#if defined (__TARGET_LINUX__) || defined (__TARGET_MAC__)
+	if (UpToBlock > Header->NumBlocks) UpToBlock = Header->NumBlocks;
+	if (UpToBlock <= PrefaultedBlocks) return;
+
+#if defined (MADV_POPULATE_WRITE)
+	// Page tables are filled as if pages were written, without touching the data being written by the realtime thread
+	madvise (GetBlock(PrefaultedBlocks), (size_t)(UpToBlock-PrefaultedBlocks)*NETUMP_RECORD_BLOCK_SIZE, MADV_POPULATE_WRITE);
+#else
+	madvise (GetBlock(PrefaultedBlocks), (size_t)(UpToBlock-PrefaultedBlocks)*NETUMP_RECORD_BLOCK_SIZE, MADV_WILLNEED);
+#endif
+	PrefaultedBlocks = UpToBlock;
+#endif
+}  // CNetUMPRecorder::PrefaultBlocks
+//---------------------------------------------------------------------------
+
+void CNetUMPRecorder::UpdateHeader (void)
+{
+	Header->UsedBlocks = UsedBlocks.load (std::memory_order_acquire);
+	Header->RecordCount = RecordCount.load (std::memory_order_relaxed);
+	Header->DroppedRecords = DroppedRecords.load (std::memory_order_relaxed);
+}  // CNetUMPRecorder::UpdateHeader
+//---------------------------------------------------------------------------
+
+void CNetUMPRecorder::FlushTask (void)
+{
+	uint32_t Completed;
+
+	while (StopFlush == false)
+	{
+		// All used blocks except the last one are complete
+		Completed = UsedBlocks.load (std::memory_order_acquire);
+		if (Completed > 0) Completed--;
+
+		// Keep the blocks in front of the writer ready
+		PrefaultBlocks (Completed+1+RECORD_PREFAULT_BLOCKS);
+
+#if defined (__TARGET_LINUX__) || defined (__TARGET_MAC__)
+		// Write the completed blocks to disk
+		if (Completed > FlushedBlocks)
+		{
+			msync (GetBlock(FlushedBlocks), (size_t)(Completed-FlushedBlocks)*NETUMP_RECORD_BLOCK_SIZE, MS_SYNC);
+			FlushedBlocks = Completed;
+		}
+#endif
+		UpdateHeader();
+
+		SystemSleepMillis (RECORD_FLUSH_INTERVAL);
+	}
+}  // CNetUMPRecorder::FlushTask
+//---------------------------------------------------------------------------
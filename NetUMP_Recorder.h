@@ -0,0 +1,175 @@
+/*
+ *  NetUMP_Recorder.h
+ *  Append-only recording of received UMP in a memory mapped file
+ *
+ * Copyright (c) 2023 Benoit BOUCHEZ / KissBox
+ * License : MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#ifndef __NETUMP_RECORDER_H__
+#define __NETUMP_RECORDER_H__
+
+#include "NetUMP.h"
+#include <atomic>
+#include <thread>
+
+/*
+ File layout (all fields in host byte order) :
+   - TNetUMPRecordHeader (64 bytes)
+   - Block index : NumBlocks x TNetUMPRecordIndexEntry
+   - Padding up to DataOffset (multiple of NETUMP_RECORD_BLOCK_SIZE)
+   - NumBlocks data blocks of NETUMP_RECORD_BLOCK_SIZE bytes. Each block starts with a TNetUMPRecordBlockHeader,
+     followed by NumRecords records. A record is a TNetUMPRecord followed by Size UMP words
+
+ The file is preallocated when recording starts. Records are appended by the realtime thread(s) directly in
+ the mapped file, blocks are written to disk by a background thread. Record times are relative to the block
+ BaseTime, so a reader can jump to any time using the block index without reading previous blocks.
+ UsedBlocks and record counters in the header are updated by the background thread and when recording is closed.
+*/
+
+#define NETUMP_RECORD_MAGIC			0x4E554D52		// "NUMR"
+#define NETUMP_RECORD_BLOCK_MAGIC	0x4E554D42		// "NUMB"
+#define NETUMP_RECORD_VERSION		1
+
+//! Size of data blocks (multiple of page size)
+#define NETUMP_RECORD_BLOCK_SIZE	65536
+
+//! Highest source number (stored on one byte in each record)
+#define NETUMP_RECORD_MAX_SOURCE	255
+
+//! Record types
+#define NETUMP_RECORD_UMP			0		// UMP message received on a session (Size words follow the record header)
+#define NETUMP_RECORD_EVENT			1		// Session event (see NETUMP_EVENT_XXX), no data
+
+//! Session events
+#define NETUMP_EVENT_SESSION_OPENED		1
+#define NETUMP_EVENT_SESSION_CLOSED		2		// Session closed by application
+#define NETUMP_EVENT_PEER_CLOSED		3		// BYE received from partner
+#define NETUMP_EVENT_CONNECTION_LOST	4		// Partner timeout, or session taken over by another invitation
+
+typedef struct {
+	uint32_t Magic;				// Written last when file is created, so readers never see a partial header
+	uint32_t Version;
+	uint32_t HeaderSize;
+	uint32_t BlockSize;
+	uint32_t NumBlocks;			// Preallocated blocks
+	uint32_t UsedBlocks;		// Blocks containing records (last one can be partially filled)
+	uint64_t DataOffset;		// Offset of first data block in file
+	uint64_t StartTime;			// CLOCK_MONOTONIC time (nanoseconds) when recording started
+	uint64_t RecordCount;
+	uint64_t DroppedRecords;	// Records lost because the file was full
+	uint32_t Reserved[2];
+} TNetUMPRecordHeader;
+
+typedef struct {
+	uint64_t FirstTime;			// Block BaseTime (nanoseconds since StartTime)
+	uint64_t FirstRecord;		// Number of records written before the block
+} TNetUMPRecordIndexEntry;
+
+typedef struct {
+	uint32_t Magic;
+	uint32_t BlockIndex;
+	uint64_t BaseTime;			// Nanoseconds since StartTime. Time of first record of the block
+	uint32_t NumRecords;
+	uint32_t UsedBytes;			// Including block header
+	uint32_t Reserved[2];
+} TNetUMPRecordBlockHeader;
+
+typedef struct {
+	uint32_t Time;				// Microseconds since block BaseTime
+	uint8_t Type;				// NETUMP_RECORD_XXX
+	uint8_t Source;				// Number given to CNetUMPHandler::SetRecorder, to identify the session
+	uint8_t Size;				// Number of UMP words following the record
+	uint8_t Event;				// NETUMP_EVENT_XXX for event records
+} TNetUMPRecord;
+
+//! Records received UMP messages and session events of one or more handlers in a preallocated memory mapped file
+//! Open / Close shall be called from control thread. Record methods can be called from several realtime threads :
+//! writers are serialized by a spin lock held during the copy of a few words (no system call, no allocation)
+class CNetUMPRecorder
+{
+public:
+	CNetUMPRecorder (void);
+	~CNetUMPRecorder (void);
+
+	//! Create (or truncate) the recording file, preallocate SizeMB megabytes and start the background flush thread
+	//! \return false if the file can not be created, allocated or mapped (or if target does not support it)
+	bool Open (const char* FilePath, unsigned int SizeMB);
+
+	//! Stop recording, write remaining data to disk and close the file
+	//! Handlers must have been detached (SetRecorder(0, 0)) before
+	void Close (void);
+
+	//! Record the messages of a UMP Data command payload (big endian words, as received from network)
+	void RecordUMPBlock (unsigned int Source, const unsigned char* Payload, unsigned int PayloadLength);
+
+	//! Record one UMP message (host byte order)
+	void RecordUMP (unsigned int Source, const uint32_t* UMP);
+
+	//! Record a session event (NETUMP_EVENT_XXX)
+	void RecordEvent (unsigned int Source, unsigned int Event);
+
+	//! Number of records lost because the file is full
+	uint64_t GetDroppedRecords (void);
+
+private:
+	uint8_t* MappedArea;
+	size_t MappedSize;
+	int FileHandle;
+	TNetUMPRecordHeader* Header;
+	TNetUMPRecordIndexEntry* Index;
+	uint64_t StartTime;
+
+	// Writer state (protected by WriteLock)
+	std::atomic_flag WriteLock;
+	TNetUMPRecordBlockHeader* Block;		// Block being filled (0 before first record)
+	uint32_t WriteBlock;					// Index of the block being filled
+	std::atomic<uint32_t> UsedBlocks;		// Blocks started by the writer (all but the last one are complete)
+	std::atomic<uint64_t> RecordCount;
+	std::atomic<uint64_t> DroppedRecords;
+
+	// Background thread
+	std::thread FlushThread;
+	std::atomic<bool> StopFlush;
+	uint32_t FlushedBlocks;					// Blocks written to disk
+	uint32_t PrefaultedBlocks;				// Blocks already mapped in memory for writer
+
+	TNetUMPRecordBlockHeader* GetBlock (uint32_t BlockIndex);
+
+	//! Current time in nanoseconds since recording start
+	uint64_t GetRecordTime (void);
+
+	//! Start a new block. Returns false if the file is full
+	bool StartBlock (uint64_t Time);
+
+	//! Appends a record to the current block (called with WriteLock held)
+	void AppendRecord (uint64_t Time, unsigned int Type, unsigned int Source, unsigned int Event, const uint32_t* UMP, unsigned int Size);
+
+	//! Map in memory the blocks which will be written soon, so the writer does not wait for page faults
+	void PrefaultBlocks (uint32_t UpToBlock);
+
+	void FlushTask (void);
+	void UpdateHeader (void);
+};
+
+#endif  // __NETUMP_RECORDER_H__
@@ -27,164 +27,287 @@
  */
 
 #include "NetUMP.h"
+#if defined (__TARGET_LINUX__)
+#include <linux/filter.h>
+#endif
 
-void CNetUMPHandler::SendInvitationCommand (void)
+void CNetUMPHandler::TransmitDatagram (const void* Data, int Size, const sockaddr_in* Destination)
 {
-	TUMP_INVITATION_PACKET InvitationPacket;
-	sockaddr_in AdrEmit;
-	size_t WordLen;
-	size_t NameLen = strlen ((char*)&this->EndpointName[0]);
-	size_t PIDLen = strlen((char*)&this->ProductInstanceID[0]);
-
-	// NetUMP specification requires that all stuffing bytes in the packet must be filled with 0
-	memset(&InvitationPacket.EPName_PIID[0], 0, MAX_UMP_ENDPOINT_NAME_LEN + MAX_UMP_PRODUCT_INSTANCE_ID_LEN);
+	Stats.TxDatagrams++;
+	Stats.TxBytes += Size;
 
-	// Compute size in words of Endpoint Name
-	NameLen+=1;					// Add null terminator
-	WordLen = NameLen>>2;		// Get count of int32 words
-	if ((NameLen&0x3)!=0)
-		WordLen+=1;		// Add one extra word if length is not a multiple of four
-	InvitationPacket.CSD1 = (uint8_t)WordLen;
+	if ((SocketConnected) && (Destination == &PartnerAddress))
+	{  // Socket is connected to the partner : no address to give
+		if (PacketShim)
+			PacketShim->SendTo (UMPSocket, (const char*)Data, Size, 0);
+		else
+			send(UMPSocket, (const char*)Data, Size, 0);
+		return;
+	}
 
-	// Add size in words of ProductID
-	PIDLen += 1;
-	WordLen += PIDLen >> 2;
-	if ((PIDLen & 0x03) != 0)
-		WordLen += 1;
-	InvitationPacket.PayloadLength = (uint8_t)WordLen;
+	if (PacketShim)
+		PacketShim->SendTo (UMPSocket, (const char*)Data, Size, Destination);
+	else
+		sendto(UMPSocket, (const char*)Data, Size, 0, (const sockaddr*)Destination, sizeof(sockaddr_in));
+}  // CNetUMPHandler::TransmitDatagram
+//---------------------------------------------------------------------------
 
-	InvitationPacket.Signature = htonl (UMP_SIGNATURE);
-	InvitationPacket.CommandCode = INVITATION_COMMAND;
-	InvitationPacket.CSD2 = 0;			// Bitmap = 0 : no authentication capabilities
+void CNetUMPHandler::TransmitDatagram (const void* Data, int Size, unsigned int DestinationIP, unsigned short DestinationPort)
+{
+	sockaddr_in AdrEmit;
 
-	// Copy Endpoint Name at the beginning of the string
-	strcpy ((char*)&InvitationPacket.EPName_PIID[0], (char*)&this->EndpointName[0]);
-	// Add Product Instance ID at first word after the Endpoint Name
-	strcpy((char*)&InvitationPacket.EPName_PIID[InvitationPacket.CSD1 * 4], (char*)&this->ProductInstanceID[0]);
+	if ((DestinationIP == SessionPartnerIP) && (DestinationPort == SessionPartnerPort))
+	{
+		TransmitDatagram (Data, Size, &PartnerAddress);
+		return;
+	}
 
 	memset (&AdrEmit, 0, sizeof(sockaddr_in));
 	AdrEmit.sin_family=AF_INET;
-	AdrEmit.sin_addr.s_addr=htonl(SessionPartnerIP);
-	AdrEmit.sin_port=htons(RemoteUDPPort);
-	sendto(UMPSocket, (const char*)&InvitationPacket, 8+((int)WordLen*4), 0, (const sockaddr*)&AdrEmit, sizeof(sockaddr_in));
-}  // CNetUMPHandler::SendInvitationCommand
+	AdrEmit.sin_addr.s_addr=htonl(DestinationIP);
+	AdrEmit.sin_port=htons(DestinationPort);
+
+	TransmitDatagram (Data, Size, &AdrEmit);
+}  // CNetUMPHandler::TransmitDatagram
 //---------------------------------------------------------------------------
 
-void CNetUMPHandler::SendInvitationAcceptedCommand (void)
+int CNetUMPHandler::ReceiveDatagram (unsigned char* Buffer, int Size, sockaddr_in* Source)
 {
-	TUMP_INVITATION_ACCEPTED_PACKET ReplyPacket;
-	sockaddr_in AdrEmit;
-	size_t NameLen = strlen((char*)&this->EndpointName[0]);
-    size_t PIDLen = strlen((char*)&this->ProductInstanceID[0]);
-	size_t WordLen = 0;
+#if defined (__TARGET_MAC__)
+	socklen_t fromlen;
+#endif
+#if defined (__TARGET_LINUX__)
+	socklen_t fromlen;
+#endif
+#if defined (__TARGET_WIN__)
+	int fromlen;
+#endif
+	int RecvSize;
+
+	if (SocketConnected)
+	{  // Only the session partner can send to a connected socket : source address is not read
+		if (PacketShim)
+			RecvSize = PacketShim->RecvFrom (UMPSocket, (char*)Buffer, Size, 0);
+		else
+			RecvSize = (int)recv(UMPSocket, (char*)Buffer, Size, 0);
+	}
+	else if (PacketShim)
+		RecvSize = PacketShim->RecvFrom (UMPSocket, (char*)Buffer, Size, Source);
+	else
+	{
+		fromlen=sizeof(sockaddr_in);
+		RecvSize = (int)recvfrom(UMPSocket, (char*)Buffer, Size, 0, (sockaddr*)Source, &fromlen);
+	}
+
+	if (RecvSize > 0)
+	{
+		Stats.RxDatagrams++;
+		Stats.RxBytes += RecvSize;
+	}
+	return RecvSize;
+}  // CNetUMPHandler::ReceiveDatagram
+//---------------------------------------------------------------------------
+
+void CNetUMPHandler::ConnectSocketToPartner (bool Connect)
+{
+	sockaddr_in NoAddress;
+
+	if (Connect)
+	{
+		if (UseConnectedSocket == false) return;
+		if (connect (UMPSocket, (const sockaddr*)&PartnerAddress, sizeof(sockaddr_in)) == 0)
+			SocketConnected = true;
+		return;
+	}
+
+	if (SocketConnected == false) return;
+	SocketConnected = false;
+
+	// Dissolve the association (AF_UNSPEC on POSIX systems, null address on Windows)
+	memset (&NoAddress, 0, sizeof(sockaddr_in));
+#if defined (__TARGET_WIN__)
+	NoAddress.sin_family = AF_INET;
+#else
+	NoAddress.sin_family = AF_UNSPEC;
+#endif
+	connect (UMPSocket, (const sockaddr*)&NoAddress, sizeof(sockaddr_in));
+}  // CNetUMPHandler::ConnectSocketToPartner
+//---------------------------------------------------------------------------
+
+void CNetUMPHandler::AttachKernelFilter (bool PartnerOnly)
+{
+#if defined (__TARGET_LINUX__)
+	// For UDP sockets, the filter sees the packet from the UDP header : payload starts at offset 8
+	// Absolute loads are done in network byte order, so constants are given in host order
+	struct sock_filter SignatureFilter[] = {
+		{ BPF_LD|BPF_W|BPF_ABS, 0, 0, 8 },							// A = first payload word
+		{ BPF_JMP|BPF_JEQ|BPF_K, 0, 1, UMP_SIGNATURE },
+		{ BPF_RET|BPF_K, 0, 0, 0xFFFFFFFF },						// Accept whole datagram
+		{ BPF_RET|BPF_K, 0, 0, 0 }									// Drop
+	};
+	struct sock_filter PartnerFilter[] = {
+		{ BPF_LD|BPF_W|BPF_ABS, 0, 0, 8 },							// A = first payload word
+		{ BPF_JMP|BPF_JEQ|BPF_K, 0, 5, UMP_SIGNATURE },
+		{ BPF_LD|BPF_W|BPF_ABS, 0, 0, (uint32_t)(SKF_NET_OFF+12) },	// A = IPv4 source address
+		{ BPF_JMP|BPF_JEQ|BPF_K, 0, 3, SessionPartnerIP },
+		{ BPF_LD|BPF_H|BPF_ABS, 0, 0, 0 },							// A = UDP source port
+		{ BPF_JMP|BPF_JEQ|BPF_K, 0, 1, SessionPartnerPort },
+		{ BPF_RET|BPF_K, 0, 0, 0xFFFFFFFF },						// Accept whole datagram
+		{ BPF_RET|BPF_K, 0, 0, 0 }									// Drop
+	};
+	struct sock_fprog Program;
+	int Dummy = 0;
+
+	if (UMPSocket == INVALID_SOCKET) return;
+
+	if (KernelFilterMode == KERNEL_FILTER_NONE)
+	{
+		setsockopt (UMPSocket, SOL_SOCKET, SO_DETACH_FILTER, &Dummy, sizeof(Dummy));
+		return;
+	}
+
+	if ((PartnerOnly) && (KernelFilterMode == KERNEL_FILTER_PARTNER))
+	{
+		Program.len = sizeof(PartnerFilter)/sizeof(struct sock_filter);
+		Program.filter = &PartnerFilter[0];
+	}
+	else
+	{
+		Program.len = sizeof(SignatureFilter)/sizeof(struct sock_filter);
+		Program.filter = &SignatureFilter[0];
+	}
+
+	// Attaching a new program replaces the previous one atomically
+	setsockopt (UMPSocket, SOL_SOCKET, SO_ATTACH_FILTER, &Program, sizeof(Program));
+#endif
+}  // CNetUMPHandler::AttachKernelFilter
+//---------------------------------------------------------------------------
+
+void CNetUMPHandler::LockSocketToPartner (bool Lock)
+{
+	ConnectSocketToPartner (Lock);
+	if (KernelFilterMode == KERNEL_FILTER_PARTNER)
+		AttachKernelFilter (Lock);
+}  // CNetUMPHandler::LockSocketToPartner
+//---------------------------------------------------------------------------
+
+void CNetUMPHandler::SetSessionPartner (unsigned int PartnerIP, unsigned short PartnerPort)
+{
+	SessionPartnerIP = PartnerIP;
+	SessionPartnerPort = PartnerPort;
+
+	memset (&PartnerAddress, 0, sizeof(sockaddr_in));
+	PartnerAddress.sin_family=AF_INET;
+	PartnerAddress.sin_addr.s_addr=htonl(PartnerIP);
+	PartnerAddress.sin_port=htons(PartnerPort);
+}  // CNetUMPHandler::SetSessionPartner
+//---------------------------------------------------------------------------
+
+void CNetUMPHandler::PrepareSessionTemplates (void)
+{
+	size_t WordLen;
+	size_t NameLen = strlen ((char*)&this->EndpointName[0]);
+	size_t PIDLen = strlen((char*)&this->ProductInstanceID[0]);
 
 	// NetUMP specification requires that all stuffing bytes in the packet must be filled with 0
-	memset(&ReplyPacket.EPName_PIID[0], 0, MAX_UMP_ENDPOINT_NAME_LEN + MAX_UMP_PRODUCT_INSTANCE_ID_LEN);
+	memset(&InvitationTemplate.EPName_PIID[0], 0, sizeof(InvitationTemplate.EPName_PIID));
 
 	// Compute size in words of Endpoint Name
 	NameLen+=1;					// Add null terminator
 	WordLen = NameLen>>2;		// Get count of int32 words
 	if ((NameLen&0x3)!=0)
 		WordLen+=1;		// Add one extra word if length is not a multiple of four
-	ReplyPacket.CSD1 = (uint8_t)WordLen;
+	InvitationTemplate.CSD1 = (uint8_t)WordLen;
 
 	// Add size in words of ProductID
 	PIDLen += 1;
 	WordLen += PIDLen >> 2;
 	if ((PIDLen & 0x03) != 0)
 		WordLen += 1;
-	ReplyPacket.PayloadLength = (uint8_t)WordLen;
+	InvitationTemplate.PayloadLength = (uint8_t)WordLen;
 
-	ReplyPacket.Signature = htonl (UMP_SIGNATURE);
-	ReplyPacket.CommandCode = INVITATION_ACCEPTED_COMMAND;
-	ReplyPacket.CSD2 = 0;
+	InvitationTemplate.Signature = htonl (UMP_SIGNATURE);
+	InvitationTemplate.CommandCode = INVITATION_COMMAND;
+	InvitationTemplate.CSD2 = 0;			// Bitmap = 0 : no authentication capabilities
 
 	// Copy Endpoint Name at the beginning of the string
-	strcpy ((char*)&ReplyPacket.EPName_PIID[0], (char*)&this->EndpointName[0]);
+	strcpy ((char*)&InvitationTemplate.EPName_PIID[0], (char*)&this->EndpointName[0]);
 	// Add Product Instance ID at first word after the Endpoint Name
-	strcpy((char*)&ReplyPacket.EPName_PIID[ReplyPacket.CSD1 * 4], (char*)&this->ProductInstanceID[0]);
+	strcpy((char*)&InvitationTemplate.EPName_PIID[InvitationTemplate.CSD1 * 4], (char*)&this->ProductInstanceID[0]);
+	InvitationTemplateSize = 8+((int)WordLen*4);
 
-	memset (&AdrEmit, 0, sizeof(sockaddr_in));
-	AdrEmit.sin_family=AF_INET;
-	AdrEmit.sin_addr.s_addr=htonl(SessionPartnerIP);
-	AdrEmit.sin_port=htons(SessionPartnerPort);
-	sendto(UMPSocket, (const char*)&ReplyPacket, 8 + ((int)WordLen * 4), 0, (const sockaddr*)&AdrEmit, sizeof(sockaddr_in));
+	// Invitation Accepted carries the same payload
+	memcpy (&InvitationAcceptedTemplate, &InvitationTemplate, sizeof(TUMP_INVITATION_ACCEPTED_PACKET));
+	InvitationAcceptedTemplate.CommandCode = INVITATION_ACCEPTED_COMMAND;
+	InvitationAcceptedTemplate.CSD2 = 0;
+
+	BYETemplate.Signature = htonl (UMP_SIGNATURE);
+	BYETemplate.CommandCode = BYE_COMMAND;
+	BYETemplate.PayloadLength = 0;
+	BYETemplate.BYECode = BYE_UNDEFINED;		// Patched when message is sent
+	BYETemplate.Reserved = 0;
+
+	BYEReplyTemplate.Signature = htonl (UMP_SIGNATURE);
+	BYEReplyTemplate.CommandCode = BYE_REPLY_COMMAND;
+	BYEReplyTemplate.PayloadLength = 0;
+	BYEReplyTemplate.Reserved = 0;
+
+	PingTemplate.Signature = htonl (UMP_SIGNATURE);
+	PingTemplate.CommandCode = PING_COMMAND;
+	PingTemplate.PayloadLength = 1;
+	PingTemplate.Reserved = 0;
+	PingTemplate.ID = 0;						// Patched when message is sent
+
+	PingReplyTemplate.Signature = htonl (UMP_SIGNATURE);
+	PingReplyTemplate.CommandCode = PING_REPLY_COMMAND;
+	PingReplyTemplate.PayloadLength = 1;
+	PingReplyTemplate.Reserved = 0;
+	PingReplyTemplate.ID = 0;					// Patched when message is sent
+}  // CNetUMPHandler::PrepareSessionTemplates
+//---------------------------------------------------------------------------
+
+void CNetUMPHandler::SendInvitationCommand (void)
+{
+	// Invitation is sent to the session partner declared in InitiateSession (partner port is the invited port)
+	Stats.InvitationsSent++;
+	TransmitDatagram (&InvitationTemplate, InvitationTemplateSize, &PartnerAddress);
+}  // CNetUMPHandler::SendInvitationCommand
+//---------------------------------------------------------------------------
+
+void CNetUMPHandler::SendInvitationAcceptedCommand (void)
+{
+	TransmitDatagram (&InvitationAcceptedTemplate, InvitationTemplateSize, &PartnerAddress);
 }  // CNetUMPHandler::SendInvitationAcceptedCommand
 //---------------------------------------------------------------------------
 
 void CNetUMPHandler::SendBYECommand (unsigned char BYEReason, unsigned int DestinationIP, unsigned short DestinationPort)
 {
-	TUMP_BYE_PACKET PacketBYE;
-	sockaddr_in AdrEmit;
+	BYETemplate.BYECode = BYEReason;
 
-	PacketBYE.Signature = htonl (UMP_SIGNATURE);
-	PacketBYE.CommandCode = BYE_COMMAND;
-	PacketBYE.PayloadLength = 0;
-	PacketBYE.BYECode = BYEReason;
-	PacketBYE.Reserved = 0;
-
-	memset (&AdrEmit, 0, sizeof(sockaddr_in));
-	AdrEmit.sin_family=AF_INET;
-	AdrEmit.sin_addr.s_addr=htonl(DestinationIP);
-	AdrEmit.sin_port=htons(DestinationPort);
-	sendto(UMPSocket, (const char*)&PacketBYE, sizeof(TUMP_BYE_PACKET), 0, (const sockaddr*)&AdrEmit, sizeof(sockaddr_in));
+	Stats.BYESent++;
+	TransmitDatagram (&BYETemplate, sizeof(TUMP_BYE_PACKET), DestinationIP, DestinationPort);
 } // CNetUMPHandler::SendBYECommand
 //---------------------------------------------------------------------------
 
 void CNetUMPHandler::SendBYEReplyCommand (unsigned int DestinationIP, unsigned short DestinationPort)
 {
-	TUMP_BYE_REPLY_PACKET PacketReply;
-	sockaddr_in AdrEmit;
-
-	PacketReply.Signature = htonl (UMP_SIGNATURE);
-	PacketReply.CommandCode = BYE_REPLY_COMMAND;
-	PacketReply.PayloadLength = 0;
-	PacketReply.Reserved = 0;
-
-	memset (&AdrEmit, 0, sizeof(sockaddr_in));
-	AdrEmit.sin_family=AF_INET;
-	AdrEmit.sin_addr.s_addr=htonl(DestinationIP);
-	AdrEmit.sin_port=htons(DestinationPort);
-	sendto(UMPSocket, (const char*)&PacketReply, sizeof(TUMP_BYE_REPLY_PACKET), 0, (const sockaddr*)&AdrEmit, sizeof(sockaddr_in));
+	TransmitDatagram (&BYEReplyTemplate, sizeof(TUMP_BYE_REPLY_PACKET), DestinationIP, DestinationPort);
 }  // CNetUMPHandler::SendBYEReplyCommand
 //---------------------------------------------------------------------------
 
 void CNetUMPHandler::SendPINGCommand (uint32_t PINGId)
 {
-	TUMP_PING_PACKET PingPacket;
-	sockaddr_in AdrEmit;
-
-	PingPacket.Signature = htonl (UMP_SIGNATURE);
-	PingPacket.CommandCode = PING_COMMAND;
-	PingPacket.PayloadLength = 1;
-	//PingPacket.SequenceNumber = htons (LastCommandCounter);
-	PingPacket.Reserved = 0;
-	PingPacket.ID = htonl (PINGId);
+	PingTemplate.ID = htonl (PINGId);
 
-	memset (&AdrEmit, 0, sizeof(sockaddr_in));
-	AdrEmit.sin_family=AF_INET;
-	AdrEmit.sin_addr.s_addr=htonl(SessionPartnerIP);
-	AdrEmit.sin_port=htons(SessionPartnerPort);
-	sendto(UMPSocket, (const char*)&PingPacket, sizeof(TUMP_PING_PACKET), 0, (const sockaddr*)&AdrEmit, sizeof(sockaddr_in));
+	Stats.PingsSent++;
+	TransmitDatagram (&PingTemplate, sizeof(TUMP_PING_PACKET), &PartnerAddress);
 }  // CNetUMPHandler::SendPINGCommand
 //---------------------------------------------------------------------------
 
 void CNetUMPHandler::SendPINGReplyCommand (uint32_t PINGId)
 {
-	TUMP_PING_REPLY_PACKET ReplyPacket;
-	sockaddr_in AdrEmit;
-
-	ReplyPacket.Signature = htonl (UMP_SIGNATURE);
-	ReplyPacket.CommandCode = PING_REPLY_COMMAND;
-	ReplyPacket.PayloadLength = 1;
-	//ReplyPacket.SequenceNumber = htons (UMPCommandCounter);
-	ReplyPacket.Reserved = 0;
-	ReplyPacket.ID = htonl (PINGId);
+	PingReplyTemplate.ID = htonl (PINGId);
 
-	memset (&AdrEmit, 0, sizeof(sockaddr_in));
-	AdrEmit.sin_family=AF_INET;
-	AdrEmit.sin_addr.s_addr=htonl(SessionPartnerIP);
-	AdrEmit.sin_port=htons(SessionPartnerPort);
-	sendto(UMPSocket, (const char*)&ReplyPacket, sizeof(TUMP_PING_REPLY_PACKET), 0, (const sockaddr*)&AdrEmit, sizeof(sockaddr_in));
+	TransmitDatagram (&PingReplyTemplate, sizeof(TUMP_PING_REPLY_PACKET), &PartnerAddress);
 }  // CNetUMPHandler::SendPINGReplyCommand
 //---------------------------------------------------------------------------
@@ -0,0 +1,479 @@
+/*
+ *  NetUMP_StateTracker.cpp
+ *  Per channel MIDI state tracker, to resynchronize a device after reconnection
+ *
+ * Copyright (c) 2023 Benoit BOUCHEZ / KissBox
+ * License : MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include "NetUMP_StateTracker.h"
+#include <string.h>
+
+//! Build and give one message to Emit
+static void EmitMessage (TNetUMPStateEmit Emit, void* Instance, uint32_t Word0, uint32_t Word1)
+{
+	uint32_t UMP[2];
+
+	UMP[0] = Word0;
+	UMP[1] = Word1;
+	Emit (Instance, &UMP[0]);
+}  // EmitMessage
+//---------------------------------------------------------------------------
+
+//! Emit a control change. Header contains MT, group and channel
+static void EmitControlChange (TNetUMPStateEmit Emit, void* Instance, uint32_t Header, bool MIDI2, unsigned int Index, uint32_t Value)
+{
+	if (MIDI2)
+		EmitMessage (Emit, Instance, Header|0xB00000|(Index<<8), Value);
+	else
+		EmitMessage (Emit, Instance, Header|0xB00000|(Index<<8)|(Value>>25), 0);
+}  // EmitControlChange
+//---------------------------------------------------------------------------
+
+CNetUMPStateTracker::CNetUMPStateTracker (void)
+{
+	Lock.clear();
+	Overflows = 0;
+	memset (&Channels[0][0], 0, sizeof(Channels));
+}  // CNetUMPStateTracker::CNetUMPStateTracker
+//---------------------------------------------------------------------------
+
+void CNetUMPStateTracker::Reset (void)
+{
+	while (Lock.test_and_set (std::memory_order_acquire));
+	memset (&Channels[0][0], 0, sizeof(Channels));
+	Lock.clear (std::memory_order_release);
+}  // CNetUMPStateTracker::Reset
+//---------------------------------------------------------------------------
+
+uint64_t CNetUMPStateTracker::GetOverflowCount (void)
+{
+	return Overflows.load (std::memory_order_relaxed);
+}  // CNetUMPStateTracker::GetOverflowCount
+//---------------------------------------------------------------------------
+
+void CNetUMPStateTracker::Update (const uint32_t* UMP)
+{
+	unsigned int MT;
+	TNetUMPChannelState* Channel;
+
+	// Only channel voice messages carry a state
+	MT = UMP[0]>>28;
+	if ((MT != 2) && (MT != 4)) return;
+
+	Channel = &Channels[(UMP[0]>>24)&0x0F][(UMP[0]>>16)&0x0F];
+
+	while (Lock.test_and_set (std::memory_order_acquire));
+	Channel->Flags |= NETUMP_CHANNEL_USED;
+	if (MT == 4)
+	{
+		Channel->Flags |= NETUMP_CHANNEL_MIDI2;
+		UpdateMIDI2 (Channel, UMP);
+	}
+	else
+	{
+		Channel->Flags &= ~NETUMP_CHANNEL_MIDI2;
+		UpdateMIDI1 (Channel, UMP[0]);
+	}
+	Lock.clear (std::memory_order_release);
+}  // CNetUMPStateTracker::Update
+//---------------------------------------------------------------------------
+
+TNetUMPControllerSlot* CNetUMPStateTracker::FindController (TNetUMPChannelState* Channel, unsigned int Type, unsigned int Key1, unsigned int Key2)
+{
+	TNetUMPControllerSlot* Slot;
+
+	for (unsigned int SlotIdx=0; SlotIdx<NETUMP_STATE_CONTROLLER_SLOTS; SlotIdx++)
+	{
+		Slot = &Channel->Controllers[SlotIdx];
+		if ((Slot->Type == Type) && (Slot->Key1 == Key1) && (Slot->Key2 == Key2))
+			return Slot;
+	}
+	return 0;
+}  // CNetUMPStateTracker::FindController
+//---------------------------------------------------------------------------
+
+void CNetUMPStateTracker::SetController (TNetUMPChannelState* Channel, unsigned int Type, unsigned int Key1, unsigned int Key2, uint32_t Value)
+{
+	TNetUMPControllerSlot* Slot;
+
+	Slot = FindController (Channel, Type, Key1, Key2);
+	if (Slot == 0)
+	{
+		Slot = FindController (Channel, NETUMP_STATE_SLOT_FREE, 0, 0);
+		if (Slot == 0)
+		{
+			Overflows.fetch_add (1, std::memory_order_relaxed);
+			return;
+		}
+		Slot->Type = Type;
+		Slot->Key1 = Key1;
+		Slot->Key2 = Key2;
+	}
+	Slot->Value = Value;
+}  // CNetUMPStateTracker::SetController
+//---------------------------------------------------------------------------
+
+void CNetUMPStateTracker::ClearNoteControllers (TNetUMPChannelState* Channel, unsigned int Note)
+{
+	TNetUMPControllerSlot* Slot;
+
+	for (unsigned int SlotIdx=0; SlotIdx<NETUMP_STATE_CONTROLLER_SLOTS; SlotIdx++)
+	{
+		Slot = &Channel->Controllers[SlotIdx];
+		if ((Slot->Type >= NETUMP_STATE_SLOT_NOTE_REGISTERED) && (Slot->Key1 == Note))
+			memset (Slot, 0, sizeof(TNetUMPControllerSlot));
+	}
+}  // CNetUMPStateTracker::ClearNoteControllers
+//---------------------------------------------------------------------------
+
+void CNetUMPStateTracker::UpdateControlChange (TNetUMPChannelState* Channel, unsigned int Index, uint32_t Value)
+{
+	if (Index < 120)
+	{
+		Channel->CCValue[Index] = Value;
+		Channel->CCKnown[Index>>5] |= (1u<<(Index&0x1F));
+		return;
+	}
+
+	// Channel mode messages are not stored, but some of them change the state
+	if ((Index == 120) || (Index == 123))
+	{  // All Sound Off / All Notes Off
+		memset (&Channel->ActiveNotes[0], 0, sizeof(Channel->ActiveNotes));
+		for (unsigned int SlotIdx=0; SlotIdx<NETUMP_STATE_CONTROLLER_SLOTS; SlotIdx++)
+			if (Channel->Controllers[SlotIdx].Type >= NETUMP_STATE_SLOT_NOTE_REGISTERED)
+				memset (&Channel->Controllers[SlotIdx], 0, sizeof(TNetUMPControllerSlot));
+	}
+	else if (Index == 121)
+	{  // Reset All Controllers (registered / assignable controllers and program are kept)
+		memset (&Channel->CCKnown[0], 0, sizeof(Channel->CCKnown));
+		Channel->Flags &= ~(NETUMP_CHANNEL_PITCHBEND|NETUMP_CHANNEL_PRESSURE);
+	}
+}  // CNetUMPStateTracker::UpdateControlChange
+//---------------------------------------------------------------------------
+
+void CNetUMPStateTracker::UpdateMIDI1 (TNetUMPChannelState* Channel, uint32_t Word)
+{
+	unsigned int Data1;
+	unsigned int Data2;
+	TNetUMPControllerSlot* Slot;
+
+	Data1 = (Word>>8)&0x7F;
+	Data2 = Word&0x7F;
+
+	switch ((Word>>20)&0x0F)
+	{
+		case 0x9 :		// Note On (velocity 0 is a Note Off)
+			if (Data2 != 0)
+			{
+				Channel->ActiveNotes[Data1>>5] |= (1u<<(Data1&0x1F));
+				Channel->NoteVelocity[Data1] = (uint16_t)(Data2<<9);
+				break;
+			}
+			// fall through
+		case 0x8 :		// Note Off
+			Channel->ActiveNotes[Data1>>5] &= ~(1u<<(Data1&0x1F));
+			ClearNoteControllers (Channel, Data1);
+			break;
+		case 0xB :		// Control change : RPN / NRPN are rebuilt from parameter number and data entry
+			switch (Data1)
+			{
+				case 99 :
+					Channel->ParameterType = NETUMP_STATE_SLOT_ASSIGNABLE;
+					Channel->ParameterMSB = Data2;
+					break;
+				case 98 :
+					Channel->ParameterType = NETUMP_STATE_SLOT_ASSIGNABLE;
+					Channel->ParameterLSB = Data2;
+					break;
+				case 101 :
+					Channel->ParameterType = NETUMP_STATE_SLOT_REGISTERED;
+					Channel->ParameterMSB = Data2;
+					break;
+				case 100 :
+					Channel->ParameterType = NETUMP_STATE_SLOT_REGISTERED;
+					Channel->ParameterLSB = Data2;
+					break;
+				case 6 :		// Data entry MSB
+					if (Channel->ParameterType == NETUMP_STATE_SLOT_FREE) break;
+					if ((Channel->ParameterType == NETUMP_STATE_SLOT_REGISTERED) && (Channel->ParameterMSB == 127) && (Channel->ParameterLSB == 127)) break;		// Null RPN
+					SetController (Channel, Channel->ParameterType, Channel->ParameterMSB, Channel->ParameterLSB, Data2<<25);
+					break;
+				case 38 :		// Data entry LSB
+					if (Channel->ParameterType == NETUMP_STATE_SLOT_FREE) break;
+					Slot = FindController (Channel, Channel->ParameterType, Channel->ParameterMSB, Channel->ParameterLSB);
+					if (Slot)
+						Slot->Value = (Slot->Value&0xFE000000)|(Data2<<18);
+					break;
+				case 96 :		// Data increment / decrement
+				case 97 :
+					break;
+				default :
+					UpdateControlChange (Channel, Data1, Data2<<25);
+					break;
+			}
+			break;
+		case 0xC :		// Program change (bank is given by CC 0 / 32)
+			Channel->Program = Data1<<24;
+			Channel->Flags = (Channel->Flags|NETUMP_CHANNEL_PROGRAM)&~NETUMP_CHANNEL_PROGRAM_BANK;
+			break;
+		case 0xD :		// Channel pressure
+			Channel->Pressure = Data1<<25;
+			Channel->Flags |= NETUMP_CHANNEL_PRESSURE;
+			break;
+		case 0xE :		// Pitch bend (14 bits, LSB first)
+			Channel->PitchBend = ((Data2<<7)|Data1)<<18;
+			Channel->Flags |= NETUMP_CHANNEL_PITCHBEND;
+			break;
+		default :		// Poly pressure
+			break;
+	}
+}  // CNetUMPStateTracker::UpdateMIDI1
+//---------------------------------------------------------------------------
+
+void CNetUMPStateTracker::UpdateMIDI2 (TNetUMPChannelState* Channel, const uint32_t* UMP)
+{
+	unsigned int Byte1;		// Note, controller index or bank
+	unsigned int Byte0;		// Controller index, attribute type or flags
+
+	Byte1 = (UMP[0]>>8)&0x7F;
+	Byte0 = UMP[0]&0xFF;
+
+	switch ((UMP[0]>>20)&0x0F)
+	{
+		case 0x9 :		// Note On (velocity 0 is a valid velocity in MIDI 2.0)
+			Channel->ActiveNotes[Byte1>>5] |= (1u<<(Byte1&0x1F));
+			Channel->NoteVelocity[Byte1] = (uint16_t)(UMP[1]>>16);
+			break;
+		case 0x8 :		// Note Off
+			Channel->ActiveNotes[Byte1>>5] &= ~(1u<<(Byte1&0x1F));
+			ClearNoteControllers (Channel, Byte1);
+			break;
+		case 0xB :		// Control change
+			UpdateControlChange (Channel, Byte1, UMP[1]);
+			break;
+		case 0xC :		// Program change, with optional bank
+			Channel->Program = UMP[1]&0x7F007F7F;
+			Channel->Flags |= NETUMP_CHANNEL_PROGRAM;
+			if (UMP[0]&0x01) Channel->Flags |= NETUMP_CHANNEL_PROGRAM_BANK;
+			else Channel->Flags &= ~NETUMP_CHANNEL_PROGRAM_BANK;
+			break;
+		case 0xD :		// Channel pressure
+			Channel->Pressure = UMP[1];
+			Channel->Flags |= NETUMP_CHANNEL_PRESSURE;
+			break;
+		case 0xE :		// Pitch bend
+			Channel->PitchBend = UMP[1];
+			Channel->Flags |= NETUMP_CHANNEL_PITCHBEND;
+			break;
+		case 0x0 :		// Registered per-note controller
+			SetController (Channel, NETUMP_STATE_SLOT_NOTE_REGISTERED, Byte1, Byte0, UMP[1]);
+			break;
+		case 0x1 :		// Assignable per-note controller
+			SetController (Channel, NETUMP_STATE_SLOT_NOTE_ASSIGNABLE, Byte1, Byte0, UMP[1]);
+			break;
+		case 0x2 :		// Registered controller (RPN)
+			SetController (Channel, NETUMP_STATE_SLOT_REGISTERED, Byte1, Byte0&0x7F, UMP[1]);
+			break;
+		case 0x3 :		// Assignable controller (NRPN)
+			SetController (Channel, NETUMP_STATE_SLOT_ASSIGNABLE, Byte1, Byte0&0x7F, UMP[1]);
+			break;
+		case 0x6 :		// Per-note pitch bend
+			SetController (Channel, NETUMP_STATE_SLOT_NOTE_PITCHBEND, Byte1, 0, UMP[1]);
+			break;
+		case 0xF :		// Per-note management : S flag resets per-note controllers to default
+			if (Byte0&0x01)
+				ClearNoteControllers (Channel, Byte1);
+			break;
+		default :		// Poly pressure, relative controllers
+			break;
+	}
+}  // CNetUMPStateTracker::UpdateMIDI2
+//---------------------------------------------------------------------------
+
+unsigned int CNetUMPStateTracker::Resync (TNetUMPStateEmit Emit, void* Instance)
+{
+	return ResyncRange (0, 256, Emit, Instance);
+}  // CNetUMPStateTracker::Resync
+//---------------------------------------------------------------------------
+
+unsigned int CNetUMPStateTracker::ResyncRange (unsigned int First, unsigned int Count, TNetUMPStateEmit Emit, void* Instance)
+{
+	TNetUMPChannelState Channel;
+	unsigned int Group;
+	unsigned int ChannelNumber;
+	unsigned int Messages = 0;
+
+	for (unsigned int Index=First; (Index<First+Count) && (Index<256); Index++)
+	{
+		Group = Index>>4;
+		ChannelNumber = Index&0x0F;
+
+		// Work on a copy, so the lock is not held while messages are emitted
+		while (Lock.test_and_set (std::memory_order_acquire));
+		if ((Channels[Group][ChannelNumber].Flags&NETUMP_CHANNEL_USED) == 0)
+		{
+			Lock.clear (std::memory_order_release);
+			continue;
+		}
+		memcpy (&Channel, &Channels[Group][ChannelNumber], sizeof(TNetUMPChannelState));
+		Lock.clear (std::memory_order_release);
+
+		Messages += ResyncChannel (&Channel, Group, ChannelNumber, Emit, Instance);
+	}
+	return Messages;
+}  // CNetUMPStateTracker::ResyncRange
+//---------------------------------------------------------------------------
+
+unsigned int CNetUMPStateTracker::ResyncChannel (const TNetUMPChannelState* Channel, unsigned int Group, unsigned int ChannelNumber, TNetUMPStateEmit Emit, void* Instance)
+{
+	bool MIDI2;
+	uint32_t Header;
+	const TNetUMPControllerSlot* Slot;
+	unsigned int Messages = 0;
+	bool ParameterSent = false;
+	unsigned int Velocity;
+
+	MIDI2 = (Channel->Flags&NETUMP_CHANNEL_MIDI2) != 0;
+	Header = (MIDI2 ? 0x40000000 : 0x20000000)|(Group<<24)|(ChannelNumber<<16);
+
+	// Bank select then program
+	for (unsigned int Index=0; Index<=32; Index+=32)
+	{
+		if (Channel->CCKnown[Index>>5]&(1u<<(Index&0x1F)))
+		{
+			EmitControlChange (Emit, Instance, Header, MIDI2, Index, Channel->CCValue[Index]);
+			Messages++;
+		}
+	}
+	if (Channel->Flags&NETUMP_CHANNEL_PROGRAM)
+	{
+		if (MIDI2)
+			EmitMessage (Emit, Instance, Header|0xC00000|((Channel->Flags&NETUMP_CHANNEL_PROGRAM_BANK) ? 1 : 0), Channel->Program);
+		else
+		{
+			if (Channel->Flags&NETUMP_CHANNEL_PROGRAM_BANK)
+			{
+				EmitControlChange (Emit, Instance, Header, false, 0, ((Channel->Program>>8)&0x7F)<<25);
+				EmitControlChange (Emit, Instance, Header, false, 32, (Channel->Program&0x7F)<<25);
+				Messages += 2;
+			}
+			EmitMessage (Emit, Instance, Header|0xC00000|((Channel->Program>>24)<<8), 0);
+		}
+		Messages++;
+	}
+
+	// Other controllers
+	for (unsigned int Index=1; Index<120; Index++)
+	{
+		if (Index == 32) continue;
+		if (Channel->CCKnown[Index>>5]&(1u<<(Index&0x1F)))
+		{
+			EmitControlChange (Emit, Instance, Header, MIDI2, Index, Channel->CCValue[Index]);
+			Messages++;
+		}
+	}
+
+	// Registered / assignable controllers (RPN / NRPN sequences in MIDI 1.0)
+	for (unsigned int SlotIdx=0; SlotIdx<NETUMP_STATE_CONTROLLER_SLOTS; SlotIdx++)
+	{
+		Slot = &Channel->Controllers[SlotIdx];
+		if ((Slot->Type != NETUMP_STATE_SLOT_REGISTERED) && (Slot->Type != NETUMP_STATE_SLOT_ASSIGNABLE)) continue;
+		if (MIDI2)
+		{
+			EmitMessage (Emit, Instance, Header|((Slot->Type == NETUMP_STATE_SLOT_REGISTERED) ? 0x200000 : 0x300000)|(Slot->Key1<<8)|Slot->Key2, Slot->Value);
+			Messages++;
+		}
+		else
+		{
+			EmitControlChange (Emit, Instance, Header, false, (Slot->Type == NETUMP_STATE_SLOT_REGISTERED) ? 101 : 99, Slot->Key1<<25);
+			EmitControlChange (Emit, Instance, Header, false, (Slot->Type == NETUMP_STATE_SLOT_REGISTERED) ? 100 : 98, Slot->Key2<<25);
+			EmitControlChange (Emit, Instance, Header, false, 6, Slot->Value);
+			EmitControlChange (Emit, Instance, Header, false, 38, Slot->Value<<7);
+			Messages += 4;
+			ParameterSent = true;
+		}
+	}
+	if (ParameterSent)
+	{  // Null RPN, so next data entry messages do not change the last parameter
+		EmitControlChange (Emit, Instance, Header, false, 101, 127u<<25);
+		EmitControlChange (Emit, Instance, Header, false, 100, 127u<<25);
+		Messages += 2;
+	}
+
+	if (Channel->Flags&NETUMP_CHANNEL_PITCHBEND)
+	{
+		if (MIDI2)
+			EmitMessage (Emit, Instance, Header|0xE00000, Channel->PitchBend);
+		else
+			EmitMessage (Emit, Instance, Header|0xE00000|(((Channel->PitchBend>>18)&0x7F)<<8)|(Channel->PitchBend>>25), 0);
+		Messages++;
+	}
+	if (Channel->Flags&NETUMP_CHANNEL_PRESSURE)
+	{
+		if (MIDI2)
+			EmitMessage (Emit, Instance, Header|0xD00000, Channel->Pressure);
+		else
+			EmitMessage (Emit, Instance, Header|0xD00000|((Channel->Pressure>>25)<<8), 0);
+		Messages++;
+	}
+
+	// Held notes, then their per-note controllers (MIDI 2.0 only)
+	for (unsigned int Note=0; Note<128; Note++)
+	{
+		if ((Channel->ActiveNotes[Note>>5]&(1u<<(Note&0x1F))) == 0) continue;
+		if (MIDI2)
+			EmitMessage (Emit, Instance, Header|0x900000|(Note<<8), (uint32_t)Channel->NoteVelocity[Note]<<16);
+		else
+		{
+			Velocity = Channel->NoteVelocity[Note]>>9;
+			if (Velocity == 0) Velocity = 1;
+			EmitMessage (Emit, Instance, Header|0x900000|(Note<<8)|Velocity, 0);
+		}
+		Messages++;
+	}
+	if (MIDI2)
+	{
+		for (unsigned int SlotIdx=0; SlotIdx<NETUMP_STATE_CONTROLLER_SLOTS; SlotIdx++)
+		{
+			Slot = &Channel->Controllers[SlotIdx];
+			switch (Slot->Type)
+			{
+				case NETUMP_STATE_SLOT_NOTE_REGISTERED :
+					EmitMessage (Emit, Instance, Header|(Slot->Key1<<8)|Slot->Key2, Slot->Value);
+					break;
+				case NETUMP_STATE_SLOT_NOTE_ASSIGNABLE :
+					EmitMessage (Emit, Instance, Header|0x100000|(Slot->Key1<<8)|Slot->Key2, Slot->Value);
+					break;
+				case NETUMP_STATE_SLOT_NOTE_PITCHBEND :
+					EmitMessage (Emit, Instance, Header|0x600000|(Slot->Key1<<8), Slot->Value);
+					break;
+				default :
+					continue;
+			}
+			Messages++;
+		}
+	}
+
+	return Messages;
+}  // CNetUMPStateTracker::ResyncChannel
+//---------------------------------------------------------------------------
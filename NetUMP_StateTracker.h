@@ -0,0 +1,142 @@
+/*
+ *  NetUMP_StateTracker.h
+ *  Per channel MIDI state tracker, to resynchronize a device after reconnection
+ *
+ * Copyright (c) 2023 Benoit BOUCHEZ / KissBox
+ * License : MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef __NETUMP_STATETRACKER_H__
+#define __NETUMP_STATETRACKER_H__
+
+#include "NetUMP.h"
+#include <atomic>
+
+//! Number of registered / assignable / per-note controllers remembered per channel
+#define NETUMP_STATE_CONTROLLER_SLOTS	32
+
+//! Controller slot types
+#define NETUMP_STATE_SLOT_FREE				0
+#define NETUMP_STATE_SLOT_REGISTERED		1		// RPN (Key1 = bank, Key2 = index)
+#define NETUMP_STATE_SLOT_ASSIGNABLE		2		// NRPN (Key1 = bank, Key2 = index)
+#define NETUMP_STATE_SLOT_NOTE_REGISTERED	3		// Registered per-note controller (Key1 = note, Key2 = index)
+#define NETUMP_STATE_SLOT_NOTE_ASSIGNABLE	4		// Assignable per-note controller (Key1 = note, Key2 = index)
+#define NETUMP_STATE_SLOT_NOTE_PITCHBEND	5		// Per-note pitch bend (Key1 = note)
+
+//! Channel flags
+#define NETUMP_CHANNEL_USED				0x01	// At least one channel voice message has been sent on the channel
+#define NETUMP_CHANNEL_MIDI2			0x02	// Last message was a MIDI 2.0 channel voice message (MT=4) : resync uses MT=4
+#define NETUMP_CHANNEL_PROGRAM			0x04
+#define NETUMP_CHANNEL_PROGRAM_BANK		0x08	// Program change carried a bank (MT=4)
+#define NETUMP_CHANNEL_PITCHBEND		0x10
+#define NETUMP_CHANNEL_PRESSURE			0x20
+
+//! Receives the messages rebuilt by CNetUMPStateTracker::Resync (host byte order)
+typedef void (*TNetUMPStateEmit) (void* Instance, uint32_t* UMP);
+
+typedef struct {
+	uint8_t Type;			// NETUMP_STATE_SLOT_XXX
+	uint8_t Key1;
+	uint8_t Key2;
+	uint8_t Reserved;
+	uint32_t Value;			// 32 bits value
+} TNetUMPControllerSlot;
+
+//! State of one channel. Values are stored with MIDI 2.0 resolution (MIDI 1.0 values are scaled up)
+typedef struct {
+	uint32_t Flags;				// NETUMP_CHANNEL_XXX
+	uint32_t Program;			// Second word of MIDI 2.0 program change (program, bank MSB, bank LSB)
+	uint32_t PitchBend;
+	uint32_t Pressure;
+	uint32_t CCKnown[4];		// Bit N set when controller N has been sent
+	uint32_t ActiveNotes[4];	// Bit N set while note N is on
+	uint32_t CCValue[128];
+	uint16_t NoteVelocity[128];
+	TNetUMPControllerSlot Controllers[NETUMP_STATE_CONTROLLER_SLOTS];
+	uint8_t ParameterType;		// MIDI 1.0 parameter selected by CC 99/98 or 101/100 (NETUMP_STATE_SLOT_REGISTERED or ASSIGNABLE)
+	uint8_t ParameterMSB;
+	uint8_t ParameterLSB;
+	uint8_t Reserved;
+} TNetUMPChannelState;
+
+//! Keeps the last state sent on each group / channel (controllers, program, pitch bend, channel pressure,
+//! registered / assignable and per-note controllers, active notes) and rebuilds the minimal list of messages
+//! which sets a device to this state after a reconnection or a session reset
+//! Declared to handlers with CNetUMPHandler::SetStateTracker : messages given to SendUMPMessage update the tracker
+//! (even when session is not opened) and the resync is sent each time the session opens
+//! Update can be called from several threads (channel table is protected by a spin lock held during a few
+//! memory writes). The object is about 300 kB : create it with new
+/*
+ Not tracked : poly pressure and relative controllers (transient values), note attributes, MIDI 1.0 data
+ increment / decrement, channel mode messages (CC 120 to 127 : All Notes Off and All Sound Off release
+ active notes, Reset All Controllers clears the controllers).
+ MIDI 1.0 RPN / NRPN (CC 99/98/101/100 followed by data entry CC 6/38) are stored as registered / assignable
+ controllers, and resent with the parameter number, then the null RPN.
+*/
+class CNetUMPStateTracker
+{
+public:
+	CNetUMPStateTracker (void);
+
+	//! Forget all state
+	void Reset (void);
+
+	//! Update the state with a message sent to the device (host byte order)
+	void Update (const uint32_t* UMP);
+
+	//! Give the messages restoring the current state to Emit, channel after channel
+	//! Emit is called without the tracker lock held : it can call SendUMPMessage
+	//! \return number of messages given to Emit
+	unsigned int Resync (TNetUMPStateEmit Emit, void* Instance);
+
+	//! Same as Resync, for Count channels starting at First (channel index is Group*16+Channel)
+	unsigned int ResyncRange (unsigned int First, unsigned int Count, TNetUMPStateEmit Emit, void* Instance);
+
+	//! Number of controllers not remembered because the controller table of their channel was full
+	uint64_t GetOverflowCount (void);
+
+private:
+	std::atomic_flag Lock;
+	TNetUMPChannelState Channels[16][16];		// [Group][Channel]
+	std::atomic<uint64_t> Overflows;
+
+	//! Returns the slot of a registered / assignable / per-note controller, 0 if it has not been stored (called with Lock held)
+	TNetUMPControllerSlot* FindController (TNetUMPChannelState* Channel, unsigned int Type, unsigned int Key1, unsigned int Key2);
+
+	//! Store a registered / assignable / per-note controller value (called with Lock held)
+	void SetController (TNetUMPChannelState* Channel, unsigned int Type, unsigned int Key1, unsigned int Key2, uint32_t Value);
+
+	//! Free all per-note controller slots of a note (called with Lock held)
+	void ClearNoteControllers (TNetUMPChannelState* Channel, unsigned int Note);
+
+	//! Control change (CC) with value scaled to 32 bits (called with Lock held)
+	void UpdateControlChange (TNetUMPChannelState* Channel, unsigned int Index, uint32_t Value);
+
+	//! Update from a MIDI 1.0 (MT=2) or MIDI 2.0 (MT=4) channel voice message (called with Lock held)
+	void UpdateMIDI1 (TNetUMPChannelState* Channel, uint32_t Word);
+	void UpdateMIDI2 (TNetUMPChannelState* Channel, const uint32_t* UMP);
+
+	//! Rebuild messages of one channel from a copy of its state
+	unsigned int ResyncChannel (const TNetUMPChannelState* Channel, unsigned int Group, unsigned int ChannelNumber, TNetUMPStateEmit Emit, void* Instance);
+};
+
+#endif  // __NETUMP_STATETRACKER_H__
@@ -0,0 +1,98 @@
+/*
+ *  NetUMP_ExportRecording.cpp
+ *  Command line converter of NetUMP recordings to MIDI files
+ *
+ * Copyright (c) 2023 Benoit BOUCHEZ / KissBox
+ * License : MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ Converts a recording made by CNetUMPRecorder to a Standard MIDI File (default) or a MIDI Clip File (--clip).
+ The recording is read block by block, so recordings of any size can be converted.
+
+ Build example (Linux) :
+   g++ -O2 -std=c++11 -D__TARGET_LINUX__ -I. -I<BEBSDK> Tools/NetUMP_ExportRecording.cpp NetUMP_FileExport.cpp UMP_Transcoder.c
+       -lpthread
+
+ Usage :
+   NetUMP_ExportRecording <recording> <output> [--clip] [--source n] [--group n]
+*/
+
+#include "NetUMP_FileExport.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void PrintUsage (void)
+{
+	printf ("Usage : NetUMP_ExportRecording <recording> <output> [--clip] [--source n] [--group n]\n");
+}  // PrintUsage
+//---------------------------------------------------------------------------
+
+int main (int argc, char* argv[])
+{
+	CNetUMPFileExport Exporter;
+	unsigned int Format = NETUMP_EXPORT_SMF;
+	int Source = -1;
+	int Group = -1;
+
+	if (argc < 3)
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	for (int ArgIdx=3; ArgIdx<argc; ArgIdx++)
+	{
+		if (strcmp(argv[ArgIdx], "--clip")==0)
+			Format = NETUMP_EXPORT_CLIP;
+		else if ((strcmp(argv[ArgIdx], "--source")==0)&&(ArgIdx+1<argc))
+			Source = atoi(argv[++ArgIdx]);
+		else if ((strcmp(argv[ArgIdx], "--group")==0)&&(ArgIdx+1<argc))
+			Group = atoi(argv[++ArgIdx]);
+		else
+		{
+			PrintUsage();
+			return 1;
+		}
+	}
+
+	if (Exporter.Create (argv[2], Format, Group) == false)
+	{
+		printf ("Can not create %s\n", argv[2]);
+		return 1;
+	}
+	if (Exporter.AddRecording (argv[1], Source, 0) == false)
+	{
+		printf ("Can not read recording %s\n", argv[1]);
+		Exporter.Finish();
+		return 1;
+	}
+	if (Exporter.Finish() == false)
+	{
+		printf ("Error while writing %s\n", argv[2]);
+		return 1;
+	}
+	printf ("%s written\n", argv[2]);
+	return 0;
+}  // main
+//---------------------------------------------------------------------------
@@ -0,0 +1,611 @@
+/*
+ *  NetUMP_LoopbackBench.cpp
+ *  Loopback throughput / latency benchmark for CNetUMPHandler
+ *
+ * Copyright (c) 2023 Benoit BOUCHEZ / KissBox
+ * License : MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ The benchmark opens a session initiator and a session listener on 127.0.0.1 in the same process.
+ A realtime thread calls RunSession() on both handlers every millisecond, while a producer thread
+ pushes UMP messages into the initiator at the requested rate. Each message carries a sequence tag,
+ so the listener callback can compute delivered rate, loss and one-way latency.
+
+ Build example (Linux) :
+   g++ -O2 -std=c++11 -D__TARGET_LINUX__ -I. -I<BEBSDK> Tools/NetUMP_LoopbackBench.cpp NetUMP.cpp
+       NetUMP_SessionProtocol.cpp NetUMP_ReceiveQueue.cpp NetUMP_ReceiveFilter.cpp NetUMP_Recorder.cpp NetUMP_StateTracker.cpp
+       <BEBSDK>/network.cpp <BEBSDK>/SystemSleep.cpp -lpthread
+
+ Usage :
+   NetUMP_LoopbackBench [--mix notes|cc|mt4|sysex|mixed] [--rate msg/s] [--duration s]
+                        [--fec on|off|both] [--port base_port]
+                        [--loss %] [--burst avg_len] [--dup %] [--reorder %]
+                        [--delay ms] [--jitter ms] [--seed n] [--metrics file] [--connected] [--rxqueue]
+                        [--producers n] [--sink] [--txrate words/s] [--txdatagrams datagrams/s] [--record file]
+
+ Network impairments are injected on both directions by CNetUMPLossInjector (add NetUMP_LossInjector.cpp to the build)
+ With --metrics, both handlers publish their counters in the given file (add NetUMP_MetricsExport.cpp to the build),
+ which can be read during the run with NetUMP_MetricsReader
+ With --producers, several threads send messages to the initiator at the same time (rate is shared between them)
+ With --sink, the listener is a CNetUMPHandlerT (messages given to an inlined sink instead of the callback)
+ With --rxqueue, the listener stores received messages in its receive queue, emptied by a consumer thread
+ With --record, messages received by the listener are recorded in the given file (one source number per FEC pass)
+ With --txrate / --txdatagrams, the initiator transmit rate is limited (messages above the limit are delayed, not rejected)
+*/
+
+#include "NetUMP.h"
+#include "NetUMP_HandlerT.h"
+#include "NetUMP_LossInjector.h"
+#include "NetUMP_MetricsExport.h"
+#include "NetUMP_Recorder.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#if defined (__TARGET_LINUX__)
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#ifndef __TARGET_WIN__
+#define CALLBACK
+#endif
+
+#define MIX_NOTES		0
+#define MIX_CC			1
+#define MIX_MT4			2
+#define MIX_SYSEX		3
+#define MIX_MIXED		4
+
+//! Number of SYSEX7 packets sent in a single burst (Start, Continue..., End)
+#define SYSEX_BURST_PACKETS		16
+
+//! Size of the send time table. Tags are reused modulo this size
+#define TAG_TABLE_SIZE			16384
+
+typedef std::chrono::steady_clock TBenchClock;
+
+typedef struct {
+	int Mix;
+	unsigned int Rate;				// Target rate in UMP messages per second
+	unsigned int Duration;			// Measurement duration in seconds
+	unsigned short BasePort;
+	bool Impaired;					// Use loss injectors
+	TNetUMPLossProfile Impairment;
+	CNetUMPMetricsExport* Metrics;	// 0 if metrics are not published
+	CNetUMPRecorder* Recorder;		// 0 if listener does not record
+	bool ConnectedSocket;			// Use connected socket mode on both handlers
+	bool ReceiveQueue;				// Listener uses receive queue mode (messages read by a consumer thread)
+	unsigned int Producers;			// Number of producer threads
+	bool StaticSink;				// Listener is a CNetUMPHandlerT
+	TNetUMPRateLimit TxLimit;		// Initiator transmit rate limit (0 : no limit)
+} TBenchConfig;
+
+typedef struct {
+	std::atomic<uint64_t> SendTime[TAG_TABLE_SIZE];	// Nanoseconds, indexed by tag (written by producers, read by receiver)
+	std::atomic<bool> Delivered[TAG_TABLE_SIZE];		// Set when tag is received, to detect duplicates
+	std::atomic<unsigned int> Received;
+	std::atomic<unsigned int> Duplicates;
+	std::vector<uint32_t> Latencies;		// Microseconds
+} TBenchReceiver;
+
+static TBenchClock::time_point BenchEpoch;
+
+static uint64_t NowNanos (void)
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(TBenchClock::now()-BenchEpoch).count();
+}  // NowNanos
+//---------------------------------------------------------------------------
+
+//! Extract the sequence tag from a received UMP message (see BuildMessage for encoding)
+static unsigned int ExtractTag (uint32_t* UMP)
+{
+	switch (UMP[0]>>28)
+	{
+		case 0x2 : return (((UMP[0]>>8)&0x7F)<<7)|(UMP[0]&0x7F);
+		case 0x4 : return UMP[1]&(TAG_TABLE_SIZE-1);
+		case 0x3 : return (((UMP[0]>>8)&0x7F)<<7)|(UMP[0]&0x7F);
+	}
+	return 0xFFFFFFFF;
+}  // ExtractTag
+//---------------------------------------------------------------------------
+
+//! Build a message of the selected type carrying the sequence tag
+//! \param Index message counter (used to select message type in mixed mode and SYSEX burst position)
+static void BuildMessage (int Mix, unsigned int Index, unsigned int Tag, uint32_t* UMP)
+{
+	unsigned int SYSEXStatus;
+	unsigned int BurstPos;
+
+	if (Mix == MIX_MIXED)
+	{
+		// 50% notes, 30% CC, 10% MT=4, 10% SYSEX (SYSEX bursts are kept complete)
+		BurstPos = (Index/SYSEX_BURST_PACKETS)%10;
+		if (BurstPos == 9) Mix = MIX_SYSEX;
+		else if (BurstPos == 8) Mix = MIX_MT4;
+		else if (BurstPos >= 5) Mix = MIX_CC;
+		else Mix = MIX_NOTES;
+	}
+
+	switch (Mix)
+	{
+		case MIX_NOTES :
+			UMP[0] = 0x20900000 | (((Tag>>7)&0x7F)<<8) | (Tag&0x7F);
+			break;
+		case MIX_CC :
+			UMP[0] = 0x20B00000 | (((Tag>>7)&0x7F)<<8) | (Tag&0x7F);
+			break;
+		case MIX_MT4 :
+			UMP[0] = 0x40903C00;
+			UMP[1] = Tag;
+			break;
+		case MIX_SYSEX :
+			BurstPos = Index%SYSEX_BURST_PACKETS;
+			if (BurstPos == 0) SYSEXStatus = 0x1;
+			else if (BurstPos == SYSEX_BURST_PACKETS-1) SYSEXStatus = 0x3;
+			else SYSEXStatus = 0x2;
+			UMP[0] = 0x30060000 | (SYSEXStatus<<20) | (((Tag>>7)&0x7F)<<8) | (Tag&0x7F);
+			UMP[1] = 0x01020304;
+			break;
+	}
+}  // BuildMessage
+//---------------------------------------------------------------------------
+
+static void CALLBACK ListenerCallback (void* UserInstance, uint32_t* DataBlock)
+{
+	TBenchReceiver* Receiver = (TBenchReceiver*)UserInstance;
+	unsigned int Tag;
+	uint64_t Now;
+
+	Tag = ExtractTag (DataBlock);
+	if (Tag >= TAG_TABLE_SIZE) return;
+
+	if (Receiver->Delivered[Tag].exchange(true, std::memory_order_relaxed))
+	{
+		Receiver->Duplicates++;
+		return;
+	}
+
+	Now = NowNanos();
+	Receiver->Latencies.push_back ((uint32_t)((Now-Receiver->SendTime[Tag].load(std::memory_order_acquire))/1000));
+	Receiver->Received++;
+}  // ListenerCallback
+//---------------------------------------------------------------------------
+
+//! Listener sink for CNetUMPHandlerT (same processing as the callback, called directly)
+struct TBenchSink
+{
+	TBenchReceiver* Receiver;
+	void OnUMPMessage (uint32_t* UMP, unsigned int /*Size*/) { ListenerCallback (Receiver, UMP); }
+};
+
+static void CALLBACK InitiatorCallback (void* /*UserInstance*/, uint32_t* /*DataBlock*/)
+{
+}  // InitiatorCallback
+//---------------------------------------------------------------------------
+
+static void ConnectionEvent (const char* /*EndpointName*/, unsigned int /*Size*/)
+{
+}  // ConnectionEvent
+//---------------------------------------------------------------------------
+
+static void DisconnectionEvent (void)
+{
+}  // DisconnectionEvent
+//---------------------------------------------------------------------------
+
+//! Runs one benchmark pass and prints a report line
+//! \return false if session could not be established
+static bool RunBenchPass (TBenchConfig* Config, unsigned int ErrorCorrection)
+{
+	CNetUMPHandler* Initiator;
+	CNetUMPHandler* Listener;
+	CNetUMPLossInjector InitiatorShim;
+	CNetUMPLossInjector ListenerShim;
+	TNetUMPLossStats ShimStats;
+	TNetUMPMetricsSlot* InitiatorSlot = 0;
+	TNetUMPMetricsSlot* ListenerSlot = 0;
+	TBenchReceiver* Receiver;
+	TBenchSink Sink;
+	std::atomic<bool> StopRT (false);
+	std::atomic<bool> StopProducer (false);
+	std::atomic<unsigned int> Sent (0);
+	std::atomic<unsigned int> Rejected (0);
+	unsigned int WaitCounter;
+	double Elapsed;
+
+	Receiver = new TBenchReceiver;
+	Receiver->Received = 0;
+	Receiver->Duplicates = 0;
+	for (unsigned int Tag=0; Tag<TAG_TABLE_SIZE; Tag++)
+	{
+		Receiver->SendTime[Tag].store (0, std::memory_order_relaxed);
+		Receiver->Delivered[Tag].store (false, std::memory_order_relaxed);
+	}
+	Receiver->Latencies.reserve ((size_t)Config->Rate*Config->Duration+1024);
+
+	Sink.Receiver = Receiver;
+	if (Config->StaticSink)
+		Listener = new CNetUMPHandlerT<TBenchSink> (&Sink);
+	else
+		Listener = new CNetUMPHandler (ListenerCallback, Receiver);
+	Initiator = new CNetUMPHandler (InitiatorCallback, 0);
+	Listener->SetConnectionCallback (ConnectionEvent);
+	Listener->SetDisconnectCallback (DisconnectionEvent);
+	Initiator->SetConnectionCallback (ConnectionEvent);
+	Initiator->SetDisconnectCallback (DisconnectionEvent);
+	Initiator->SelectErrorCorrectionMode (ErrorCorrection);
+	Listener->SelectErrorCorrectionMode (ErrorCorrection);
+	Initiator->SelectConnectedSocketMode (Config->ConnectedSocket);
+	Listener->SelectConnectedSocketMode (Config->ConnectedSocket);
+	Listener->SelectReceiveQueueMode (Config->ReceiveQueue);
+	if ((Config->TxLimit.WordsPerSecond != 0) || (Config->TxLimit.DatagramsPerSecond != 0))
+		Initiator->SetTransmitRateLimit (&Config->TxLimit);
+
+	if (Config->Metrics)
+	{
+		InitiatorSlot = Config->Metrics->AllocateSlot ("bench initiator");
+		ListenerSlot = Config->Metrics->AllocateSlot ("bench listener");
+		Initiator->SetMetricsSlot (InitiatorSlot, 100);
+		Listener->SetMetricsSlot (ListenerSlot, 100);
+	}
+	if (Config->Recorder)
+		Listener->SetRecorder (Config->Recorder, ErrorCorrection);		// Source tells which pass recorded the messages
+
+	if (Config->Impaired)
+	{  // Same profile on both directions, with different seeds
+		InitiatorShim.SetProfile (&Config->Impairment);
+		Config->Impairment.Seed++;
+		ListenerShim.SetProfile (&Config->Impairment);
+		Config->Impairment.Seed--;
+		Initiator->SetPacketShim (&InitiatorShim);
+		Listener->SetPacketShim (&ListenerShim);
+	}
+
+	if (Listener->InitiateSession (0, 0, Config->BasePort, false) != 0)
+	{
+		printf ("Can not open listener socket on port %d\n", Config->BasePort);
+		delete Listener; delete Initiator; delete Receiver;
+		return false;
+	}
+	if (Initiator->InitiateSession (0x7F000001, Config->BasePort, Config->BasePort+1, true) != 0)
+	{
+		printf ("Can not open initiator socket on port %d\n", Config->BasePort+1);
+		delete Listener; delete Initiator; delete Receiver;
+		return false;
+	}
+
+	// Realtime thread : 1 ms tick for both handlers
+	std::thread RTThread ([&]() {
+		TBenchClock::time_point NextTick = TBenchClock::now();
+		while (!StopRT)
+		{
+			Initiator->RunSession();
+			Listener->RunSession();
+			NextTick += std::chrono::milliseconds(1);
+			std::this_thread::sleep_until (NextTick);
+		}
+	});
+
+	// Consumer thread (receive queue mode) : waits on receive event, then empties the queue
+	std::atomic<bool> StopConsumer (false);
+	std::thread ConsumerThread ([&]() {
+		TNetUMPRxMessage Messages[64];
+		unsigned int Count;
+
+		if (Config->ReceiveQueue == false) return;
+		while (!StopConsumer)
+		{
+#if defined (__TARGET_LINUX__)
+			struct pollfd EventPoll;
+			uint64_t EventCount;
+			EventPoll.fd = Listener->GetReceiveEventHandle();
+			EventPoll.events = POLLIN;
+			if (poll (&EventPoll, 1, 10) <= 0) continue;
+			if (read (EventPoll.fd, &EventCount, sizeof(EventCount)) < 0) continue;
+#else
+			std::this_thread::sleep_for (std::chrono::milliseconds(1));
+#endif
+			do
+			{
+				Count = Listener->ReadUMPMessages (&Messages[0], 64);
+				for (unsigned int MsgIdx=0; MsgIdx<Count; MsgIdx++)
+					ListenerCallback (Receiver, &Messages[MsgIdx].UMP[0]);
+			} while (Count > 0);
+		}
+	});
+
+	// Wait for session to open
+	WaitCounter = 0;
+	while ((Initiator->GetSessionStatus()!=NETUMP_STATUS_OPENED)||(Listener->GetSessionStatus()!=NETUMP_STATUS_OPENED))
+	{
+		std::this_thread::sleep_for (std::chrono::milliseconds(10));
+		WaitCounter++;
+		if (WaitCounter>500)
+		{
+			printf ("Session not established after 5 seconds\n");
+			StopRT = true;
+			RTThread.join();
+			StopConsumer = true;
+			ConsumerThread.join();
+			delete Listener; delete Initiator; delete Receiver;
+			return false;
+		}
+	}
+
+	// Producer threads : messages are pushed in small batches every 250us to reach target rate
+	// Producer P sends messages P, P+N, P+2N... so tags are not shared between producers
+	TBenchClock::time_point StartTime = TBenchClock::now();
+	std::vector<std::thread> ProducerThreads;
+	for (unsigned int ProducerIdx=0; ProducerIdx<Config->Producers; ProducerIdx++)
+	{
+		ProducerThreads.push_back (std::thread ([&, ProducerIdx]() {
+			TBenchClock::time_point NextBatch = StartTime;
+			uint64_t Due;
+			uint64_t Produced = ProducerIdx;
+			uint64_t ElapsedUs;
+			unsigned int Tag;
+			uint32_t UMP[4];
+
+			while (!StopProducer)
+			{
+				ElapsedUs = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(TBenchClock::now()-StartTime).count();
+				if (ElapsedUs >= (uint64_t)Config->Duration*1000000) break;
+				Due = (ElapsedUs*Config->Rate)/1000000;
+
+				while (Produced < Due)
+				{
+					Tag = (unsigned int)(Produced%TAG_TABLE_SIZE);
+					BuildMessage (Config->Mix, (unsigned int)Produced, Tag, &UMP[0]);
+					Receiver->Delivered[Tag].store (false, std::memory_order_relaxed);
+					Receiver->SendTime[Tag].store (NowNanos(), std::memory_order_release);
+					if (Initiator->SendUMPMessage (&UMP[0]))
+						Sent++;
+					else
+						Rejected++;
+					Produced += Config->Producers;
+				}
+				NextBatch += std::chrono::microseconds(250);
+				std::this_thread::sleep_until (NextBatch);
+			}
+		}));
+	}
+
+	for (unsigned int ProducerIdx=0; ProducerIdx<Config->Producers; ProducerIdx++)
+		ProducerThreads[ProducerIdx].join();
+	Elapsed = std::chrono::duration<double>(TBenchClock::now()-StartTime).count();
+
+	// Leave time to in-flight packets to be delivered
+	std::this_thread::sleep_for (std::chrono::milliseconds(200));
+	StopRT = true;
+	RTThread.join();
+	StopConsumer = true;
+	ConsumerThread.join();
+
+	Initiator->CloseSession();
+
+	// Report
+	std::vector<uint32_t>& Lat = Receiver->Latencies;
+	std::sort (Lat.begin(), Lat.end());
+	unsigned int Received = Receiver->Received;
+	unsigned int Lost = (Received < Sent) ? Sent-Received : 0;
+
+	printf ("FEC %-3s  sent %9u  rejected %7u  delivered %9u  (%9.0f msg/s)  lost %7u (%.3f%%)  duplicates %u",
+		ErrorCorrection==ERROR_CORRECTION_FEC ? "on" : "off",
+		(unsigned int)Sent, (unsigned int)Rejected, Received, (double)Received/Elapsed, Lost,
+		Sent>0 ? (100.0*Lost)/Sent : 0.0, (unsigned int)Receiver->Duplicates);
+	if (Lat.size() > 0)
+	{
+		printf ("  latency us p50 %u  p90 %u  p99 %u  p99.9 %u  max %u",
+			Lat[Lat.size()*50/100], Lat[Lat.size()*90/100], Lat[Lat.size()*99/100],
+			Lat[Lat.size()*999/1000], Lat[Lat.size()-1]);
+	}
+	printf ("\n");
+
+	if ((Config->TxLimit.WordsPerSecond != 0) || (Config->TxLimit.DatagramsPerSecond != 0))
+	{
+		TNetUMPSessionStats InitiatorStats;
+
+		Initiator->GetSessionStats (&InitiatorStats);
+		printf ("         rate limit : %llu datagrams sent, %llu ticks throttled\n",
+			(unsigned long long)InitiatorStats.TxDatagrams, (unsigned long long)InitiatorStats.TxThrottledTicks);
+	}
+
+	if (Config->Impaired)
+	{
+		InitiatorShim.GetStats (&ShimStats);
+		printf ("         data path : %u datagrams sent, %u dropped, %u duplicated, %u reordered, %u delayed\n",
+			ShimStats.Sent, ShimStats.Dropped, ShimStats.Duplicated, ShimStats.Reordered, ShimStats.Delayed);
+	}
+
+	delete Initiator;
+	delete Listener;
+	delete Receiver;
+	if (Config->Metrics)
+	{
+		Config->Metrics->ReleaseSlot (InitiatorSlot);
+		Config->Metrics->ReleaseSlot (ListenerSlot);
+	}
+	return true;
+}  // RunBenchPass
+//---------------------------------------------------------------------------
+
+static void PrintUsage (void)
+{
+	printf ("Usage : NetUMP_LoopbackBench [--mix notes|cc|mt4|sysex|mixed] [--rate msg/s] [--duration s] [--fec on|off|both] [--port base_port]\n");
+	printf ("                             [--loss %%] [--burst avg_len] [--dup %%] [--reorder %%] [--delay ms] [--jitter ms] [--seed n] [--metrics file] [--connected] [--rxqueue] [--producers n] [--sink]\n");
+	printf ("                             [--txrate words/s] [--txdatagrams datagrams/s] [--record file]\n");
+}  // PrintUsage
+//---------------------------------------------------------------------------
+
+int main (int argc, char* argv[])
+{
+	TBenchConfig Config;
+	bool FECOn = true;
+	bool FECOff = true;
+	const char* MixNames[] = {"notes", "cc", "mt4", "sysex", "mixed"};
+	double LossRate = 0.0;
+	double BurstLength = 0.0;
+	CNetUMPMetricsExport Metrics;
+	const char* MetricsFile = 0;
+	CNetUMPRecorder Recorder;
+	const char* RecordFile = 0;
+
+	Config.Mix = MIX_MIXED;
+	Config.Rate = 10000;
+	Config.Duration = 5;
+	Config.BasePort = 5504;
+	Config.Impaired = false;
+	memset (&Config.Impairment, 0, sizeof(TNetUMPLossProfile));
+	Config.Impairment.Seed = 1;
+	Config.Metrics = 0;
+	Config.Recorder = 0;
+	Config.ConnectedSocket = false;
+	Config.ReceiveQueue = false;
+	Config.Producers = 1;
+	Config.StaticSink = false;
+	memset (&Config.TxLimit, 0, sizeof(TNetUMPRateLimit));
+
+	for (int ArgIdx=1; ArgIdx<argc; ArgIdx++)
+	{
+		if ((strcmp(argv[ArgIdx], "--mix")==0)&&(ArgIdx+1<argc))
+		{
+			ArgIdx++;
+			Config.Mix = -1;
+			for (int MixIdx=0; MixIdx<5; MixIdx++)
+				if (strcmp(argv[ArgIdx], MixNames[MixIdx])==0) Config.Mix = MixIdx;
+			if (Config.Mix<0) { PrintUsage(); return 1; }
+		}
+		else if ((strcmp(argv[ArgIdx], "--rate")==0)&&(ArgIdx+1<argc))
+			Config.Rate = (unsigned int)atoi(argv[++ArgIdx]);
+		else if ((strcmp(argv[ArgIdx], "--duration")==0)&&(ArgIdx+1<argc))
+			Config.Duration = (unsigned int)atoi(argv[++ArgIdx]);
+		else if ((strcmp(argv[ArgIdx], "--port")==0)&&(ArgIdx+1<argc))
+			Config.BasePort = (unsigned short)atoi(argv[++ArgIdx]);
+		else if ((strcmp(argv[ArgIdx], "--loss")==0)&&(ArgIdx+1<argc))
+			LossRate = atof(argv[++ArgIdx])/100.0;
+		else if ((strcmp(argv[ArgIdx], "--burst")==0)&&(ArgIdx+1<argc))
+			BurstLength = atof(argv[++ArgIdx]);
+		else if ((strcmp(argv[ArgIdx], "--dup")==0)&&(ArgIdx+1<argc))
+			Config.Impairment.DuplicateProbability = atof(argv[++ArgIdx])/100.0;
+		else if ((strcmp(argv[ArgIdx], "--reorder")==0)&&(ArgIdx+1<argc))
+		{
+			Config.Impairment.ReorderProbability = atof(argv[++ArgIdx])/100.0;
+			Config.Impairment.ReorderMaxTicks = 3;
+		}
+		else if ((strcmp(argv[ArgIdx], "--delay")==0)&&(ArgIdx+1<argc))
+			Config.Impairment.DelayTicks = (unsigned int)atoi(argv[++ArgIdx]);
+		else if ((strcmp(argv[ArgIdx], "--jitter")==0)&&(ArgIdx+1<argc))
+			Config.Impairment.JitterTicks = (unsigned int)atoi(argv[++ArgIdx]);
+		else if (strcmp(argv[ArgIdx], "--connected")==0)
+			Config.ConnectedSocket = true;
+		else if (strcmp(argv[ArgIdx], "--rxqueue")==0)
+			Config.ReceiveQueue = true;
+		else if (strcmp(argv[ArgIdx], "--sink")==0)
+			Config.StaticSink = true;
+		else if ((strcmp(argv[ArgIdx], "--producers")==0) && (ArgIdx+1<argc))
+		{
+			Config.Producers = (unsigned int)atoi(argv[++ArgIdx]);
+			if (Config.Producers == 0) Config.Producers = 1;
+		}
+		else if ((strcmp(argv[ArgIdx], "--txrate")==0)&&(ArgIdx+1<argc))
+			Config.TxLimit.WordsPerSecond = (unsigned int)atoi(argv[++ArgIdx]);
+		else if ((strcmp(argv[ArgIdx], "--txdatagrams")==0)&&(ArgIdx+1<argc))
+			Config.TxLimit.DatagramsPerSecond = (unsigned int)atoi(argv[++ArgIdx]);
+		else if ((strcmp(argv[ArgIdx], "--metrics")==0)&&(ArgIdx+1<argc))
+			MetricsFile = argv[++ArgIdx];
+		else if ((strcmp(argv[ArgIdx], "--record")==0)&&(ArgIdx+1<argc))
+			RecordFile = argv[++ArgIdx];
+		else if ((strcmp(argv[ArgIdx], "--seed")==0)&&(ArgIdx+1<argc))
+			Config.Impairment.Seed = (uint32_t)atoi(argv[++ArgIdx]);
+		else if ((strcmp(argv[ArgIdx], "--fec")==0)&&(ArgIdx+1<argc))
+		{
+			ArgIdx++;
+			FECOn = (strcmp(argv[ArgIdx], "off")!=0);
+			FECOff = (strcmp(argv[ArgIdx], "on")!=0);
+		}
+		else
+		{
+			PrintUsage();
+			return 1;
+		}
+	}
+
+	// Burst loss : two-state model with average burst length, where overall loss rate is kept to LossRate
+	if ((BurstLength > 1.0) && (LossRate > 0.0) && (LossRate < 1.0))
+	{
+		Config.Impairment.BurstEndProbability = 1.0/BurstLength;
+		Config.Impairment.BurstStartProbability = (LossRate*Config.Impairment.BurstEndProbability)/(1.0-LossRate);
+		Config.Impairment.BurstLossProbability = 1.0;
+	}
+	else
+		Config.Impairment.LossProbability = LossRate;
+
+	Config.Impaired = (LossRate > 0.0) || (Config.Impairment.DuplicateProbability > 0.0) ||
+					(Config.Impairment.ReorderProbability > 0.0) || (Config.Impairment.DelayTicks > 0) ||
+					(Config.Impairment.JitterTicks > 0);
+
+	if (MetricsFile)
+	{
+		if (Metrics.Open (MetricsFile, 8) == false)
+		{
+			printf ("Can not create metrics file %s\n", MetricsFile);
+			return 1;
+		}
+		Config.Metrics = &Metrics;
+	}
+	if (RecordFile)
+	{
+		if (Recorder.Open (RecordFile, 256) == false)
+		{
+			printf ("Can not create recording file %s\n", RecordFile);
+			return 1;
+		}
+		Config.Recorder = &Recorder;
+	}
+
+	BenchEpoch = TBenchClock::now();
+	printf ("NetUMP loopback benchmark : mix %s, %u msg/s, %u s\n", MixNames[Config.Mix], Config.Rate, Config.Duration);
+
+	if (FECOff)
+	{
+		if (!RunBenchPass (&Config, ERROR_CORRECTION_NONE)) return 1;
+	}
+	if (FECOn)
+	{
+		if (!RunBenchPass (&Config, ERROR_CORRECTION_FEC)) return 1;
+	}
+
+	if (RecordFile)
+	{
+		Recorder.Close();
+		printf ("Recording : %llu messages dropped (file full)\n", (unsigned long long)Recorder.GetDroppedRecords());
+	}
+
+	return 0;
+}  // main
+//---------------------------------------------------------------------------
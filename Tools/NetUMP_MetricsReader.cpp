@@ -0,0 +1,183 @@
+/*
+ *  NetUMP_MetricsReader.cpp
+ *  Command line reader for NetUMP shared memory metrics
+ *
+ * Copyright (c) 2023 Benoit BOUCHEZ / KissBox
+ * License : MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+/*
+ Prints the counters published by handlers through CNetUMPMetricsExport.
+ Reading the file never blocks nor slows down the handlers (seqlock protected slots).
+
+ Build example (Linux) :
+   g++ -O2 -std=c++11 -D__TARGET_LINUX__ -I. -I<BEBSDK> Tools/NetUMP_MetricsReader.cpp NetUMP_MetricsExport.cpp
+
+ Usage :
+   NetUMP_MetricsReader <metrics_file> [--watch ms] [--histograms]
+*/
+
+#include "NetUMP_MetricsExport.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static const char* StatusName (uint32_t Status)
+{
+	switch (Status)
+	{
+		case 0 : return "closed";
+		case 1 : return "inviting";
+		case 2 : return "waiting";
+		case 3 : return "opened";
+	}
+	return "?";
+}  // StatusName
+//---------------------------------------------------------------------------
+
+static void PrintHistogram (const char* Name, const uint64_t* Histogram)
+{
+	printf ("      %-22s", Name);
+	for (unsigned int Bucket=0; Bucket<NETUMP_HISTOGRAM_BUCKETS; Bucket++)
+		printf (" %llu", (unsigned long long)Histogram[Bucket]);
+	printf ("\n");
+}  // PrintHistogram
+//---------------------------------------------------------------------------
+
+static void PrintSlots (const uint8_t* Area, const TNetUMPMetricsHeader* Header, bool ShowHistograms)
+{
+	TNetUMPMetricsSlot Copy;
+	const TNetUMPMetricsSlot* Slot;
+	TNetUMPSessionStats* S;
+	unsigned int SlotsInUse = 0;
+
+	printf ("%-4s %-24s %-8s %-21s %10s %10s %10s %10s %8s %8s %8s\n",
+		"slot", "label", "state", "partner", "tx pkts", "rx pkts", "tx words", "rx msgs", "dup", "lost", "drops");
+
+	for (unsigned int SlotIndex=0; SlotIndex<Header->NumSlots; SlotIndex++)
+	{
+		Slot = (const TNetUMPMetricsSlot*)(Area + Header->HeaderSize + (SlotIndex*Header->SlotSize));
+		if (ReadNetUMPMetricsSlot (Slot, &Copy) == false) continue;
+
+		SlotsInUse++;
+		S = &Copy.Stats;
+		char Partner[32];
+		snprintf (Partner, sizeof(Partner), "%u.%u.%u.%u:%u", (S->PartnerIP>>24)&0xFF, (S->PartnerIP>>16)&0xFF,
+			(S->PartnerIP>>8)&0xFF, S->PartnerIP&0xFF, S->PartnerPort);
+
+		printf ("%-4u %-24.24s %-8s %-21s %10llu %10llu %10llu %10llu %8llu %8llu %8llu\n",
+			SlotIndex, Copy.Label, StatusName(S->SessionStatus), Partner,
+			(unsigned long long)S->TxDatagrams, (unsigned long long)S->RxDatagrams,
+			(unsigned long long)S->TxUMPWords, (unsigned long long)S->RxUMPMessages,
+			(unsigned long long)S->RxDuplicateCommands, (unsigned long long)S->RxLostCommands,
+			(unsigned long long)S->TxQueueFull);
+
+		if (ShowHistograms)
+		{
+			printf ("      connections %llu  lost %llu  invitations %llu  pings %llu/%llu  BYE %llu/%llu  invalid %llu  rx queue full %llu  tx throttled %llu  tx coalesced %llu  resync lost %llu\n",
+				(unsigned long long)S->Connections, (unsigned long long)S->ConnectionsLost,
+				(unsigned long long)S->InvitationsSent, (unsigned long long)S->PingsSent,
+				(unsigned long long)S->PingRepliesReceived, (unsigned long long)S->BYESent,
+				(unsigned long long)S->BYEReceived, (unsigned long long)S->RxInvalidDatagrams,
+				(unsigned long long)S->RxQueueFull, (unsigned long long)S->TxThrottledTicks,
+				(unsigned long long)S->TxCoalescedMessages, (unsigned long long)S->TxResyncLost);
+			PrintHistogram ("rx inter-arrival (ms)", &S->RxInterArrivalHistogram[0]);
+			PrintHistogram ("tx queue depth (messages)", &S->TxQueueDepthHistogram[0]);
+		}
+	}
+	printf ("%u session(s)\n", SlotsInUse);
+}  // PrintSlots
+//---------------------------------------------------------------------------
+
+int main (int argc, char* argv[])
+{
+	int FileHandle;
+	struct stat FileInfo;
+	void* Area;
+	const TNetUMPMetricsHeader* Header;
+	unsigned int WatchInterval = 0;
+	bool ShowHistograms = false;
+
+	if (argc < 2)
+	{
+		printf ("Usage : NetUMP_MetricsReader <metrics_file> [--watch ms] [--histograms]\n");
+		return 1;
+	}
+
+	for (int ArgIdx=2; ArgIdx<argc; ArgIdx++)
+	{
+		if ((strcmp(argv[ArgIdx], "--watch")==0)&&(ArgIdx+1<argc))
+			WatchInterval = (unsigned int)atoi(argv[++ArgIdx]);
+		else if (strcmp(argv[ArgIdx], "--histograms")==0)
+			ShowHistograms = true;
+	}
+
+	FileHandle = open (argv[1], O_RDONLY);
+	if (FileHandle < 0)
+	{
+		printf ("Can not open %s\n", argv[1]);
+		return 1;
+	}
+	if ((fstat (FileHandle, &FileInfo) != 0) || (FileInfo.st_size < (off_t)sizeof(TNetUMPMetricsHeader)))
+	{
+		printf ("Invalid metrics file\n");
+		close (FileHandle);
+		return 1;
+	}
+
+	Area = mmap (0, (size_t)FileInfo.st_size, PROT_READ, MAP_SHARED, FileHandle, 0);
+	close (FileHandle);
+	if (Area == MAP_FAILED)
+	{
+		printf ("Can not map %s\n", argv[1]);
+		return 1;
+	}
+
+	Header = (const TNetUMPMetricsHeader*)Area;
+	if ((Header->Magic != NETUMP_METRICS_MAGIC) || (Header->Version != NETUMP_METRICS_VERSION) ||
+		(Header->StatsSize != sizeof(TNetUMPSessionStats)) ||
+		((off_t)(Header->HeaderSize + ((size_t)Header->NumSlots*Header->SlotSize)) > FileInfo.st_size))
+	{
+		printf ("Unsupported metrics file (magic %08X, version %u)\n", Header->Magic, Header->Version);
+		munmap (Area, (size_t)FileInfo.st_size);
+		return 1;
+	}
+
+	do
+	{
+		PrintSlots ((const uint8_t*)Area, Header, ShowHistograms);
+		if (WatchInterval > 0)
+		{
+			usleep (WatchInterval*1000);
+			printf ("\n");
+		}
+	} while (WatchInterval > 0);
+
+	munmap (Area, (size_t)FileInfo.st_size);
+	return 0;
+}  // main
+//---------------------------------------------------------------------------
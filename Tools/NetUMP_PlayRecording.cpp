@@ -0,0 +1,168 @@
+/*
+ *  NetUMP_PlayRecording.cpp
+ *  Command line player for NetUMP recordings
+ *
+ * Copyright (c) 2023 Benoit BOUCHEZ / KissBox
+ * License : MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ Plays a recording made by CNetUMPRecorder to a NetUMP device, with the recorded timing.
+ The tool invites the device, then starts CNetUMPPlayer when the session is opened.
+
+ Build example (Linux) :
+   g++ -O2 -std=c++11 -D__TARGET_LINUX__ -I. -I<BEBSDK> Tools/NetUMP_PlayRecording.cpp NetUMP.cpp NetUMP_SessionProtocol.cpp
+       NetUMP_ReceiveQueue.cpp NetUMP_ReceiveFilter.cpp NetUMP_Recorder.cpp NetUMP_StateTracker.cpp NetUMP_Player.cpp
+       <BEBSDK>/network.cpp <BEBSDK>/SystemSleep.cpp -lpthread
+
+ Usage :
+   NetUMP_PlayRecording <recording> <device_ip> <device_port> [--local port] [--source n] [--tempo %]
+                        [--seek ms] [--loop] [--lookahead us]
+*/
+
+#include "NetUMP.h"
+#include "NetUMP_Player.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <arpa/inet.h>
+
+static void PrintUsage (void)
+{
+	printf ("Usage : NetUMP_PlayRecording <recording> <device_ip> <device_port> [--local port] [--source n] [--tempo %%]\n");
+	printf ("                             [--seek ms] [--loop] [--lookahead us]\n");
+}  // PrintUsage
+//---------------------------------------------------------------------------
+
+int main (int argc, char* argv[])
+{
+	CNetUMPPlayer Player;
+	CNetUMPHandler* Handler;
+	std::atomic<bool> StopRT (false);
+	struct in_addr DeviceAddress;
+	unsigned short DevicePort;
+	unsigned short LocalPort = 5600;
+	int Source = -1;
+	unsigned int Tempo = 100;
+	uint64_t SeekPosition = 0;
+	bool Loop = false;
+	unsigned int Lookahead = NETUMP_PLAYER_LOOKAHEAD;
+	int Result = 0;
+
+	if (argc < 4)
+	{
+		PrintUsage();
+		return 1;
+	}
+	if (inet_pton (AF_INET, argv[2], &DeviceAddress) != 1)
+	{
+		printf ("Invalid device address %s\n", argv[2]);
+		return 1;
+	}
+	DevicePort = (unsigned short)atoi(argv[3]);
+
+	for (int ArgIdx=4; ArgIdx<argc; ArgIdx++)
+	{
+		if ((strcmp(argv[ArgIdx], "--local")==0)&&(ArgIdx+1<argc))
+			LocalPort = (unsigned short)atoi(argv[++ArgIdx]);
+		else if ((strcmp(argv[ArgIdx], "--source")==0)&&(ArgIdx+1<argc))
+			Source = atoi(argv[++ArgIdx]);
+		else if ((strcmp(argv[ArgIdx], "--tempo")==0)&&(ArgIdx+1<argc))
+			Tempo = (unsigned int)atoi(argv[++ArgIdx]);
+		else if ((strcmp(argv[ArgIdx], "--seek")==0)&&(ArgIdx+1<argc))
+			SeekPosition = (uint64_t)atoll(argv[++ArgIdx])*1000;
+		else if (strcmp(argv[ArgIdx], "--loop")==0)
+			Loop = true;
+		else if ((strcmp(argv[ArgIdx], "--lookahead")==0)&&(ArgIdx+1<argc))
+			Lookahead = (unsigned int)atoi(argv[++ArgIdx]);
+		else
+		{
+			PrintUsage();
+			return 1;
+		}
+	}
+
+	if (Player.Open (argv[1]) == false)
+	{
+		printf ("Can not open recording %s\n", argv[1]);
+		return 1;
+	}
+	printf ("Recording %s : %.3f s\n", argv[1], (double)Player.GetDuration()/1000000.0);
+
+	Handler = new CNetUMPHandler (0, 0);
+	if (Handler->InitiateSession (ntohl(DeviceAddress.s_addr), DevicePort, LocalPort, true) != 0)
+	{
+		printf ("Can not open socket on port %d\n", LocalPort);
+		delete Handler;
+		return 1;
+	}
+
+	// Realtime thread : 1 ms tick
+	std::thread RTThread ([&]() {
+		std::chrono::steady_clock::time_point NextTick = std::chrono::steady_clock::now();
+		while (!StopRT)
+		{
+			Handler->RunSession();
+			NextTick += std::chrono::milliseconds(1);
+			std::this_thread::sleep_until (NextTick);
+		}
+	});
+
+	for (unsigned int Wait=0; (Wait<500) && (Handler->GetSessionStatus()!=NETUMP_STATUS_OPENED); Wait++)
+		std::this_thread::sleep_for (std::chrono::milliseconds(10));
+
+	if (Handler->GetSessionStatus() != NETUMP_STATUS_OPENED)
+	{
+		printf ("Session not established after 5 seconds\n");
+		Result = 1;
+	}
+	else
+	{
+		Player.AddOutput (Handler, Source);
+		Player.SetTempo (Tempo);
+		Player.SetLookahead (Lookahead);
+		Player.SetLoop (Loop, 0, 0);
+		Player.Seek (SeekPosition);
+		Player.Start();
+
+		while (Player.IsPlaying())
+		{
+			std::this_thread::sleep_for (std::chrono::milliseconds(1000));
+			printf ("Position %.3f s  dropped %llu\n", (double)Player.GetPosition()/1000000.0,
+				(unsigned long long)Player.GetDroppedMessages());
+		}
+		Player.Stop();
+
+		// Let the last messages leave
+		std::this_thread::sleep_for (std::chrono::milliseconds(100));
+	}
+
+	Handler->CloseSession();
+	StopRT = true;
+	RTThread.join();
+	delete Handler;
+	return Result;
+}  // main
+//---------------------------------------------------------------------------